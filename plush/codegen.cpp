@@ -901,6 +901,7 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
             bodyCtx.addBranch("jump", "to", incrBlock);
         auto incrCtx = ctx.subCtx(incrBlock);
         genExpr(incrCtx, forStmt->incrExpr);
+        incrCtx.addOp("pop");
         incrCtx.addBranch("jump", "to", testBlock);
 
         ctx.merge(exitBlock);
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+# Generate a Plush program with many small functions, each called once,
+# and run it with the given zeta options. With 4000 functions, the code
+# compiled for the program does not fit in one code heap chunk.
+
+NUM_FUNS=$1
+shift
+
+SRC_FILE=`mktemp`
+trap 'rm -f "$SRC_FILE"' EXIT
+
+echo '#language "lang/plush/0"' > "$SRC_FILE"
+echo 'var sum = 0;' >> "$SRC_FILE"
+
+i=1
+while [ $i -le $NUM_FUNS ]; do
+    echo "var f$i = function (x) { var y = x + $i; return y; };" >> "$SRC_FILE"
+    echo "sum = sum + f$i(2);" >> "$SRC_FILE"
+    i=$((i + 1))
+done
+
+echo 'print(sum);' >> "$SRC_FILE"
+
+./zeta "$@" "$SRC_FILE"
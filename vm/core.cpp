@@ -265,6 +265,19 @@ Value get_core_window_pkg()
 // Cache of loaded packages
 std::unordered_map<std::string, Value> pkgCache;
 
+/// Enumerate the GC roots held by the package system
+void visitCoreRoots()
+{
+    for (auto& pair : pkgCache)
+        vm.visitRoot(pair.second);
+}
+
+/// Initialize the package system
+void initCore()
+{
+    vm.addRootFn(visitCoreRoots);
+}
+
 /// Load a package based on its path
 Object load(std::string pkgPath)
 {
@@ -390,7 +403,8 @@ Value import(std::string pkgName)
             callExportFn(pkg, "init");
         }
 
-        return pkg;
+        // The package object may have been moved by the GC
+        return pkgCache[pkgName];
     }
 
     // If we can find a core package for this name
@@ -31,6 +31,9 @@ public:
     size_t getNumParams() const { return numParams; }
 };
 
+/// Initialize the package system
+void initCore();
+
 /// Load a package based on its path
 Object load(std::string pkgPath);
 
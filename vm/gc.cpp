@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include "gc.h"
+
+bool markGrey(refptr ptr)
+{
+    // Avoid the atomic update when the object is already marked
+    if (loadHeader(ptr) & HEADER_MSK_MARK)
+        return false;
+
+    auto header = setHeaderBits(ptr, HEADER_MSK_MARK);
+    return !(header & HEADER_MSK_MARK);
+}
+
+bool claimScan(refptr ptr, bool wait)
+{
+    auto header = loadHeader(ptr);
+
+    for (;;)
+    {
+        if (header & HEADER_MSK_SCANNED)
+            return false;
+
+        // Another thread is scanning the object
+        if (header & HEADER_MSK_BUSY)
+        {
+            if (!wait)
+                return false;
+
+            std::this_thread::yield();
+            header = loadHeader(ptr);
+            continue;
+        }
+
+        auto newHeader = header | HEADER_MSK_MARK | HEADER_MSK_BUSY;
+
+        if (__atomic_compare_exchange_n(
+            (uint64_t*)ptr,
+            &header,
+            newHeader,
+            true,
+            __ATOMIC_ACQ_REL,
+            __ATOMIC_ACQUIRE))
+            return true;
+    }
+}
+
+/// Mark grey an object referenced by a field of a scanned object
+static void visitRef(Word word, Tag tag, std::vector<refptr>& greyObjs)
+{
+    if (!Value(word, tag).isPointer())
+        return;
+
+    // Nursery objects are not considered when marking the old space
+    auto ptr = word.ptr;
+    if (ptr == nullptr || vm.isYoung(ptr))
+        return;
+
+    if (markGrey(ptr))
+        greyObjs.push_back(ptr);
+}
+
+/// Read a pointer-sized field which nursery collections may update
+/// while the object is being scanned
+static Word loadWord(void* fieldPtr)
+{
+    return Word(__atomic_load_n((refptr*)fieldPtr, __ATOMIC_RELAXED));
+}
+
+void scanObj(refptr ptr, std::vector<refptr>& greyObjs)
+{
+    auto header = loadHeader(ptr);
+    assert (header & HEADER_MSK_BUSY);
+
+    if (header & HEADER_MSK_NEXT)
+    {
+        visitRef(loadWord(ptr + OBJ_OF_NEXT), *(Tag*)ptr, greyObjs);
+    }
+    else
+    {
+        switch (*(Tag*)ptr)
+        {
+            case TAG_STRING:
+            if (header & HEADER_MSK_INDIRECT)
+            {
+                visitRef(loadWord(ptr + String::OF_LEFT), TAG_STRING, greyObjs);
+                visitRef(loadWord(ptr + String::OF_RIGHT), TAG_STRING, greyObjs);
+            }
+            break;
+
+            case TAG_ARRAY:
+            {
+                auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+                auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+                auto words = (Word*)(ptr + Array::OF_DATA);
+                auto tags  = (Tag*) (ptr + Array::OF_DATA + cap * sizeof(Word));
+
+                for (size_t i = 0; i < len; ++i)
+                    visitRef(loadWord(&words[i]), tags[i], greyObjs);
+            }
+            break;
+
+            case TAG_OBJECT:
+            {
+                auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+                auto words = (Word*)(ptr + Object::OF_FIELDS);
+                auto tags  = (Tag*) (ptr + Object::OF_FIELDS + cap * sizeof(Word));
+
+                for (size_t i = 0; i < cap; ++i)
+                    visitRef(loadWord(&words[i]), tags[i], greyObjs);
+            }
+            break;
+
+            case TAG_IMGREF:
+            visitRef(loadWord(ptr + ImgRef::OF_SYM), TAG_STRING, greyObjs);
+            break;
+
+            default:
+            assert (false && "unknown object type in scanObj");
+        }
+    }
+
+    // Clear the busy bit and set the scanned bit at once
+    __atomic_fetch_xor(
+        (uint64_t*)ptr,
+        HEADER_MSK_BUSY | HEADER_MSK_SCANNED,
+        __ATOMIC_RELEASE
+    );
+}
+
+Marker::Marker()
+: numShared(0),
+  numPending(0),
+  shutdown(false)
+{
+    size_t numThreads = std::thread::hardware_concurrency();
+    numThreads = std::min((size_t)MAX_THREADS, numThreads);
+    numThreads = std::max((size_t)1, numThreads);
+
+    for (size_t i = 0; i < numThreads + 1; ++i)
+        stacks.push_back(new SharedStack());
+
+    for (size_t i = 0; i < numThreads; ++i)
+        threads.push_back(std::thread(&Marker::threadMain, this, i));
+}
+
+Marker::~Marker()
+{
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        shutdown = true;
+    }
+    idleCond.notify_all();
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (auto stack : stacks)
+        delete stack;
+}
+
+void Marker::push(std::vector<refptr>& objs)
+{
+    if (objs.empty())
+        return;
+
+    // Count the objects as pending before any thread can scan them
+    numPending += objs.size();
+
+    auto stack = stacks.back();
+    {
+        std::lock_guard<std::mutex> guard(stack->lock);
+        stack->objs.insert(stack->objs.end(), objs.begin(), objs.end());
+    }
+    numShared += objs.size();
+    objs.clear();
+
+    std::lock_guard<std::mutex> guard(idleLock);
+    idleCond.notify_all();
+}
+
+void Marker::share(size_t threadIdx, std::vector<refptr>& objs)
+{
+    // Share the bottom half of the stack, the objects at the top
+    // are more likely to be cached
+    auto numObjs = objs.size() / 2;
+
+    auto stack = stacks[threadIdx];
+    {
+        std::lock_guard<std::mutex> guard(stack->lock);
+        stack->objs.insert(stack->objs.end(), objs.begin(), objs.begin() + numObjs);
+    }
+    objs.erase(objs.begin(), objs.begin() + numObjs);
+    numShared += numObjs;
+
+    std::lock_guard<std::mutex> guard(idleLock);
+    idleCond.notify_one();
+}
+
+bool Marker::takeWork(size_t threadIdx, std::vector<refptr>& objs)
+{
+    if (numShared == 0)
+        return false;
+
+    for (size_t i = 0; i < stacks.size(); ++i)
+    {
+        auto stack = stacks[(threadIdx + i) % stacks.size()];
+        std::lock_guard<std::mutex> guard(stack->lock);
+
+        if (stack->objs.empty())
+            continue;
+
+        // Take half of the objects, and at least one
+        auto numObjs = (stack->objs.size() + 1) / 2;
+        auto begin = stack->objs.begin();
+        objs.insert(objs.end(), begin, begin + numObjs);
+        stack->objs.erase(begin, begin + numObjs);
+        numShared -= numObjs;
+
+        return true;
+    }
+
+    return false;
+}
+
+void Marker::threadMain(size_t threadIdx)
+{
+    // Private mark stack
+    std::vector<refptr> objs;
+
+    while (!shutdown)
+    {
+        if (objs.empty() && !takeWork(threadIdx, objs))
+        {
+            std::unique_lock<std::mutex> guard(idleLock);
+
+            idleCond.wait_for(
+                guard,
+                std::chrono::milliseconds(1),
+                [this] { return shutdown || numShared > 0; }
+            );
+
+            continue;
+        }
+
+        auto ptr = objs.back();
+        objs.pop_back();
+
+        auto numObjs = objs.size();
+        if (claimScan(ptr, false))
+            scanObj(ptr, objs);
+
+        // The objects greyed are counted before the scanned object is
+        // retired, so that the count only drops to zero once all the
+        // grey objects handed over have been scanned
+        numPending += objs.size() - numObjs;
+        if (--numPending == 0)
+            vm.requestSafepoint();
+
+        if (objs.size() > SHARE_THRESHOLD && numShared == 0)
+            share(threadIdx, objs);
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "runtime.h"
+
+/// Mark an old object grey, returns false if it was already marked
+bool markGrey(refptr ptr);
+
+/// Claim the exclusive right to scan an object, marking it if needed.
+/// Returns false if the object was already scanned, or if another
+/// thread is scanning it and wait is false.
+bool claimScan(refptr ptr, bool wait);
+
+/// Mark grey the old objects referenced by an object claimed for
+/// scanning, then release the object as scanned (black)
+void scanObj(refptr ptr, std::vector<refptr>& greyObjs);
+
+/**
+Parallel marker for the old space, running on background threads.
+
+Marking follows a snapshot-at-the-beginning discipline: all objects
+reachable when marking starts get marked, and objects allocated while
+marking are allocated black. Each marked object is scanned once, either
+by a marker thread or by the write barrier, before the mutator first
+writes to it. The BUSY header bit is held for the duration of a scan,
+so marker threads never read an object while the mutator writes to it.
+
+Each marker thread has a private mark stack, and shares part of it
+when it grows large, so that idle threads can steal work.
+*/
+class Marker
+{
+private:
+
+    /// Maximum number of marker threads
+    static const size_t MAX_THREADS = 4;
+
+    /// Private mark stack size past which half of it gets shared
+    static const size_t SHARE_THRESHOLD = 256;
+
+    /// Mark stack which other threads can steal work from
+    struct SharedStack
+    {
+        std::mutex lock;
+        std::deque<refptr> objs;
+    };
+
+    std::vector<std::thread> threads;
+
+    /// Shared stack of each marker thread, and one extra stack
+    /// receiving the grey objects handed over by the mutator
+    std::vector<SharedStack*> stacks;
+
+    /// Number of objects in the shared stacks
+    std::atomic<size_t> numShared;
+
+    /// Number of grey objects handed over and not yet scanned
+    std::atomic<size_t> numPending;
+
+    /// Idle threads wait for shared work on this condition
+    std::mutex idleLock;
+    std::condition_variable idleCond;
+
+    /// Flag set to stop the marker threads
+    std::atomic<bool> shutdown;
+
+    void threadMain(size_t threadIdx);
+
+    /// Take objects from the shared stacks, stealing from the
+    /// other threads if there are none to take from our own
+    bool takeWork(size_t threadIdx, std::vector<refptr>& objs);
+
+    /// Move half of a private mark stack to a shared stack
+    void share(size_t threadIdx, std::vector<refptr>& objs);
+
+public:
+
+    Marker();
+    ~Marker();
+
+    /// Hand over grey objects to be scanned by the marker threads
+    void push(std::vector<refptr>& objs);
+
+    /// Test if all the grey objects handed over have been scanned
+    bool isDone() const { return numPending == 0; }
+};
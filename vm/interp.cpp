@@ -1,26 +1,38 @@
+#include <algorithm>
 #include <cassert>
+#include <csetjmp>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <unordered_map>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "core.h"
 
+// The baseline JIT emits x86-64 code, and allocates executable memory
+// with mmap. Other hosts only run the interpreters.
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
 /// Inline cache to speed up property lookups
 class ICache
 {
 private:
 
-    // Cached slot index
+    // Cached shape and slot index
+    Shape* shape = nullptr;
     size_t slotIdx = 0;
 
-    // Field name to look up
-    std::string fieldName;
+    // Field name to look up, interned so that it never moves
+    String fieldName;
 
 public:
 
     ICache(std::string fieldName)
-    : fieldName(fieldName)
+    : fieldName(String::intern(fieldName))
     {
     }
 
@@ -28,9 +40,11 @@ public:
     {
         Value val;
 
-        if (!obj.getField(fieldName.c_str(), val, slotIdx))
+        if (!obj.getField(fieldName, val, shape, slotIdx))
         {
-            throw RunError("missing field \"" + fieldName + "\"");
+            throw RunError(
+                "missing field \"" + (std::string)fieldName + "\""
+            );
         }
 
         return val;
@@ -65,6 +79,45 @@ public:
     }
 };
 
+/// Parse a decimal integer string, with an optional minus sign.
+/// Returns false if the string is not a valid 64-bit integer.
+bool parseInt64(String str, int64_t& val)
+{
+    auto len = str.length();
+    auto data = str.getDataPtr();
+
+    size_t idx = 0;
+    bool neg = (len > 0 && data[0] == '-');
+    if (neg)
+        idx++;
+
+    if (idx == len)
+        return false;
+
+    // Accumulate negative values, which have the larger range
+    int64_t acc = 0;
+    for (; idx < len; ++idx)
+    {
+        auto ch = data[idx];
+        if (ch < '0' || ch > '9')
+            return false;
+
+        if (__builtin_mul_overflow(acc, 10, &acc) ||
+            __builtin_sub_overflow(acc, ch - '0', &acc))
+            return false;
+    }
+
+    if (!neg)
+    {
+        if (acc == INT64_MIN)
+            return false;
+        acc = -acc;
+    }
+
+    val = acc;
+    return true;
+}
+
 std::string posToString(Value srcPos)
 {
     assert (srcPos.isObject());
@@ -108,6 +161,11 @@ enum Opcode : uint16_t
     GET_CHAR,
     GET_CHAR_CODE,
     STR_CAT,
+    STR_SLICE,
+    STR_CMP,
+    STR_FIND,
+    STR_TO_I64,
+    I64_TO_STR,
     EQ_STR,
 
     // Object operations
@@ -137,26 +195,214 @@ enum Opcode : uint16_t
     RET,
 
     IMPORT,
-    ABORT
+    ABORT,
+
+    // Integer instructions without operand type checks, generated by
+    // the block versioning interpreter when the operands are known
+    // to be int64 values
+    ADD_I64_UNCHECKED,
+    SUB_I64_UNCHECKED,
+    MUL_I64_UNCHECKED,
+    LT_I64_UNCHECKED,
+    LE_I64_UNCHECKED,
+    GT_I64_UNCHECKED,
+    GE_I64_UNCHECKED,
+    EQ_I64_UNCHECKED,
+
+    // Register forms of the integer instructions, where the right
+    // operand is an immediate or a local variable rather than a stack
+    // value. The result replaces the left operand on top of the stack.
+    ADD_I64_IMM,
+    SUB_I64_IMM,
+    MUL_I64_IMM,
+    LT_I64_IMM,
+    LE_I64_IMM,
+    GT_I64_IMM,
+    GE_I64_IMM,
+    EQ_I64_IMM,
+    ADD_I64_LOC,
+    SUB_I64_LOC,
+    MUL_I64_LOC,
+    LT_I64_LOC,
+    LE_I64_LOC,
+    GT_I64_LOC,
+    GE_I64_LOC,
+    EQ_I64_LOC,
+
+    // Return from execCode to JIT code, which runs instructions
+    // without a native translation through the interpreter
+    JIT_RETURN,
+
+    NUM_OPCODES
 };
 
-/// Map from pointers to instruction objects to opcodes
-std::unordered_map<refptr, Opcode> opCache;
-
 /// Total count of instructions executed
 size_t cycleCount = 0;
 
 /// Cache of all possible one-character string values
 Value charStrings[256];
 
+/**
+Inline cache for a field access instruction. Each entry maps a field
+name and an object shape to the slot index of the field in objects of
+that shape, or to NOT_FOUND if the field is missing. For set_field,
+the entry also holds the shape resulting from the write.
+Instructions which see more than MAX_ENTRIES name and shape pairs
+become megamorphic, and fall back to a global cache shared by all
+megamorphic instructions.
+*/
+class FieldIC
+{
+public:
+
+    static const size_t MAX_ENTRIES = 4;
+
+    struct Entry
+    {
+        /// Field name, compared by identity
+        Value name;
+
+        Shape* shape;
+        Shape* newShape;
+        uint32_t slotIdx;
+    };
+
+    /// Opcode of the instruction
+    Opcode op;
+
+    Entry entries[MAX_ENTRIES];
+    size_t numEntries = 0;
+
+    bool megamorphic = false;
+
+    FieldIC(Opcode op) : op(op) {}
+
+    /// Find the entry for a field name and object shape
+    Entry* find(String name, Shape* shape)
+    {
+        auto namePtr = (refptr)name;
+
+        for (size_t i = 0; i < numEntries; ++i)
+        {
+            auto& entry = entries[i];
+            if (entry.shape == shape && entry.name.getWord().ptr == namePtr)
+                return &entry;
+        }
+
+        return nullptr;
+    }
+
+    /// Add an entry, or make the cache megamorphic if it is full
+    void add(String name, Shape* shape, uint32_t slotIdx, Shape* newShape);
+};
+
+/// Inline caches of the field access instructions, indexed by the
+/// number stored in the instruction header
+/// Note: the caches of instructions which get collected are not reused
+std::vector<FieldIC*> fieldICs;
+
+/// Inline cache names pointing into the nursery
+std::vector<Value*> youngICNames;
+
+/// Size of the global caches for megamorphic field accesses
+const size_t MEGA_CACHE_SIZE = 1024;
+
+/// Global caches for megamorphic loads and stores, indexed by a hash
+/// of the field name and shape. The names held are not roots, so these
+/// caches are flushed whenever a collection could move or free them.
+FieldIC::Entry megaLoadCache[MEGA_CACHE_SIZE];
+FieldIC::Entry megaStoreCache[MEGA_CACHE_SIZE];
+
+/// Field access cache hit and miss counts
+size_t fieldICHits = 0;
+size_t fieldICMisses = 0;
+
+/// Get the megamorphic cache entry for a field name and shape
+FieldIC::Entry& megaEntry(FieldIC::Entry* cache, refptr name, Shape* shape)
+{
+    auto hash = ((uintptr_t)name >> 3) ^ ((uintptr_t)shape >> 4);
+    return cache[hash & (MEGA_CACHE_SIZE - 1)];
+}
+
+/// Find the cache entry for a field access, null if there is none
+FieldIC::Entry* findEntry(FieldIC* ic, String name, Shape* shape, bool store)
+{
+    if (!ic->megamorphic)
+        return ic->find(name, shape);
+
+    auto namePtr = (refptr)name;
+    auto& entry = megaEntry(store? megaStoreCache:megaLoadCache, namePtr, shape);
+
+    if (entry.shape == shape && entry.name.getWord().ptr == namePtr)
+        return &entry;
+
+    return nullptr;
+}
+
+/// Record the result of a field access lookup
+void addEntry(
+    FieldIC* ic,
+    String name,
+    Shape* shape,
+    uint32_t slotIdx,
+    Shape* newShape,
+    bool store
+)
+{
+    if (!ic->megamorphic)
+    {
+        ic->add(name, shape, slotIdx, newShape);
+        if (!ic->megamorphic)
+            return;
+    }
+
+    auto& entry = megaEntry(store? megaStoreCache:megaLoadCache, name, shape);
+    entry.name = name;
+    entry.shape = shape;
+    entry.newShape = newShape;
+    entry.slotIdx = slotIdx;
+}
+
+void FieldIC::add(String name, Shape* shape, uint32_t slotIdx, Shape* newShape)
+{
+    if (numEntries == MAX_ENTRIES)
+    {
+        megamorphic = true;
+        return;
+    }
+
+    auto& entry = entries[numEntries++];
+    entry.name = name;
+    entry.shape = shape;
+    entry.newShape = newShape;
+    entry.slotIdx = slotIdx;
+
+    if (vm.isYoung((refptr)name))
+        youngICNames.push_back(&entry.name);
+}
+
+/// Flag set in the cached decoding bits of instruction headers when
+/// they hold the index of an inline cache instead of an opcode
+const uint64_t AUX_FLAG_IC = 0x8000;
+
+/// Maximum number of field access inline caches
+const size_t MAX_FIELD_ICS = AUX_FLAG_IC - 1;
+
 Opcode decode(Object instr)
 {
     auto instrPtr = (refptr)instr;
 
-    if (opCache.find(instrPtr) != opCache.end())
+    // Decoded opcodes are cached in the header of instruction objects,
+    // offset by one so that zero means the instruction is not decoded.
+    // Field access instructions store the index of their inline cache.
+    auto aux = (loadHeader(instrPtr) & HEADER_MSK_AUX) >> HEADER_IDX_AUX;
+    if (aux & AUX_FLAG_IC)
+    {
+        return fieldICs[aux & ~AUX_FLAG_IC]->op;
+    }
+    if (aux != 0)
     {
-        //std::cout << "cache hit" << std::endl;
-        return opCache[instrPtr];
+        return (Opcode)(aux - 1);
     }
 
     // Get the opcode string for this instruction
@@ -210,6 +456,16 @@ Opcode decode(Object instr)
         op = GET_CHAR_CODE;
     else if (opStr == "str_cat")
         op = STR_CAT;
+    else if (opStr == "str_slice")
+        op = STR_SLICE;
+    else if (opStr == "str_cmp")
+        op = STR_CMP;
+    else if (opStr == "str_find")
+        op = STR_FIND;
+    else if (opStr == "str_to_i64")
+        op = STR_TO_I64;
+    else if (opStr == "i64_to_str")
+        op = I64_TO_STR;
     else if (opStr == "eq_str")
         op = EQ_STR;
 
@@ -262,227 +518,713 @@ Opcode decode(Object instr)
     else
         throw RunError("unknown op in decode \"" + opStr + "\"");
 
-    opCache[instrPtr] = op;
+    aux = op + 1;
+
+    // Allocate an inline cache for field access instructions
+    if ((op == GET_FIELD || op == SET_FIELD || op == HAS_FIELD) &&
+        fieldICs.size() < MAX_FIELD_ICS)
+    {
+        aux = AUX_FLAG_IC | fieldICs.size();
+        fieldICs.push_back(new FieldIC(op));
+    }
+
+    setHeaderBits(instrPtr, aux << HEADER_IDX_AUX);
+
     return op;
 }
 
-Value call(Object fun, ValueVec args)
+/// Get the inline cache of a decoded field access instruction, if any
+FieldIC* getFieldIC(Object instr)
 {
-    static ICache numParamsIC("num_params");
-    static ICache numLocalsIC("num_locals");
-    auto numParams = numParamsIC.getInt64(fun);
-    auto numLocals = numLocalsIC.getInt64(fun);
-    assert (args.size() <= numParams);
-    assert (numParams <= numLocals);
+    auto aux = (loadHeader(instr) & HEADER_MSK_AUX) >> HEADER_IDX_AUX;
 
-    ValueVec locals;
-    locals.resize(numLocals, Value::UNDEF);
+    if (aux & AUX_FLAG_IC)
+        return fieldICs[aux & ~AUX_FLAG_IC];
 
-    // Copy the arguments into the locals
-    for (size_t i = 0; i < args.size(); ++i)
+    return nullptr;
+}
+
+/// Look up a field through an inline cache, returns false if missing
+bool lookupField(FieldIC* ic, Object obj, String name, Value& val)
+{
+    if (!ic)
     {
-        //std::cout << "  " << args[i].toString() << std::endl;
-        locals[i] = args[i];
+        fieldICMisses++;
+        return obj.getField(name, val);
     }
 
-    // Temporary value stack
-    ValueVec stack;
+    auto shape = obj.getShape();
+    auto entry = findEntry(ic, name, shape, false);
+    uint32_t slotIdx;
 
-    // Array of instructions to execute
-    Value instrs;
+    if (entry)
+    {
+        fieldICHits++;
+        slotIdx = entry->slotIdx;
+    }
+    else
+    {
+        fieldICMisses++;
 
-    // Number of instructions in the current block
-    size_t numInstrs = 0;
+        // Objects in dictionary mode are not cached
+        if (shape == Shape::dict())
+            return obj.getField(name, val);
 
-    // Index of the next instruction to execute
-    size_t instrIdx = 0;
+        slotIdx = shape->getSlotIdx(name);
+        addEntry(ic, name, shape, slotIdx, shape, false);
+    }
 
-    auto popVal = [&stack]()
-    {
-        if (stack.empty())
-            throw RunError("op cannot pop value, stack empty");
-        auto val = stack.back();
-        stack.pop_back();
-        return val;
-    };
+    if (slotIdx == Shape::NOT_FOUND)
+        return false;
 
-    auto popBool = [&popVal]()
-    {
-        auto val = popVal();
-        if (!val.isBool())
-            throw RunError("op expects boolean value");
-        return (bool)val;
-    };
+    val = obj.getSlot(slotIdx);
+    return true;
+}
 
-    auto popInt64 = [&popVal]()
+/// Write a field through an inline cache
+void storeField(FieldIC* ic, Object obj, String name, Value val)
+{
+    auto shape = obj.getShape();
+    auto entry = ic? findEntry(ic, name, shape, true):nullptr;
+
+    if (entry)
     {
-        auto val = popVal();
-        if (!val.isInt64())
-            throw RunError("op expects int64 value");
-        return (int64_t)val;
-    };
+        fieldICHits++;
 
-    auto popStr = [&popVal]()
+        if (entry->newShape == shape)
+        {
+            obj.setSlot(entry->slotIdx, val);
+            return;
+        }
+
+        // Add the field unless the object must be extended
+        if (obj.addSlot(entry->newShape, val))
+            return;
+
+        obj.setField(name, val);
+        return;
+    }
+
+    fieldICMisses++;
+
+    // Field names are validated when the cache misses only,
+    // since cached names were validated before
+    if (!isValidIdent(name))
     {
-        auto val = popVal();
-        if (!val.isString())
-            throw RunError("op expects string value");
-        return String(val);
-    };
+        throw RunError(
+            "invalid identifier in set_field \"" +
+            (std::string)name + "\""
+        );
+    }
+
+    obj.setField(name, val);
 
-    auto popArray = [&popVal]()
+    auto newShape = obj.getShape();
+    if (ic && newShape != Shape::dict())
     {
-        auto val = popVal();
-        if (!val.isArray())
-            throw RunError("op expects array value");
-        return Array(val);
-    };
+        addEntry(ic, name, shape, newShape->getSlotIdx(name), newShape, true);
+    }
+}
+
+/// Tag matching no value, for has_tag instructions with an unknown tag name
+const Tag TAG_NONE = 0xFF;
+
+/// Get the tag named by the tag string of a has_tag instruction
+Tag tagFromStr(String tagStr)
+{
+    if (tagStr == "undef")
+        return TAG_UNDEF;
+    if (tagStr == "bool")
+        return TAG_BOOL;
+    if (tagStr == "int64")
+        return TAG_INT64;
+    if (tagStr == "string")
+        return TAG_STRING;
+    if (tagStr == "array")
+        return TAG_ARRAY;
+    if (tagStr == "object")
+        return TAG_OBJECT;
+
+    return TAG_NONE;
+}
+
+class DecodedBlock;
+
+/**
+Fixed-size instruction record. The operands of an instruction are read
+from the instruction object once, when its block is first entered, and
+the interpreter then executes from these records.
+*/
+class CallIC;
+class BlockVersion;
+
+struct DecodedInstr
+{
+    Opcode op;
+
+    /// Tag tested by has_tag
+    Tag tag;
+
+    /// Local or stack index, or argument count of a call
+    int64_t idx;
+
+    /// Value pushed by push, or the instruction object for the
+    /// instructions reporting their source position
+    Value val;
+
+    /// Branch targets, the second being the else block of if_true
+    DecodedBlock* target0;
+    DecodedBlock* target1;
+
+    /// Inline cache of field access instructions
+    FieldIC* ic;
+
+    /// Inline cache of call instructions
+    CallIC* callIC;
+};
+
+/// Basic block and its decoded instructions
+class DecodedBlock
+{
+public:
+
+    /// Block object
+    Value block;
+
+    /// Instruction records, empty until the block is first entered.
+    /// These are never resized once filled, since the GC holds
+    /// pointers to the values they contain.
+    std::vector<DecodedInstr> instrs;
+
+    DecodedBlock(Object block) : block(block) {}
+};
+
+/// Map of block objects to decoded blocks
+std::unordered_map<refptr, DecodedBlock*> decodedBlocks;
 
-    auto popObj = [&popVal]()
+/// Inline cache callees pointing into the nursery
+std::vector<Value*> youngCallees;
+
+/**
+Inline cache for a call site. The last callee seen is cached along with
+what was checked and looked up when it was first called, so that calls
+to the same callee only need to compare its identity. Function objects
+are assumed not to change once they have been called.
+*/
+class CallIC
+{
+public:
+
+    /// Callee, compared by identity, undefined if the cache is empty
+    Value callee = Value::UNDEF;
+
+    /// Host function, or null if the callee is a function object
+    HostFn* hostFn = nullptr;
+
+    /// Number of local variables of the callee
+    uint32_t numLocals = 0;
+
+    /// Entry point of the callee, in the code heap for the block
+    /// versioning interpreter, or as a decoded block for call()
+    uint8_t* entryAddr = nullptr;
+    DecodedBlock* entryBlock = nullptr;
+
+    /// Entry block version of the callee, and its native code once
+    /// the callee is called from JIT code
+    BlockVersion* entryVer = nullptr;
+    uint8_t* jitEntry = nullptr;
+
+    /// Set the callee once the cache is filled
+    void setCallee(Value val)
     {
-        auto val = popVal();
-        assert (val.isObject());
-        return Object(val);
-    };
+        callee = val;
+
+        if (val.isPointer() && vm.isYoung(val.getWord().ptr))
+            youngCallees.push_back(&callee);
+    }
+};
+
+/// Inline caches of the call instructions
+std::vector<CallIC*> callICs;
 
-    auto pushBool = [&stack](bool val)
+CallIC* newCallIC()
+{
+    auto ic = new CallIC();
+    callICs.push_back(ic);
+    return ic;
+}
+
+/**
+Check that a callee can be called with the argument count of a call
+site, and fill an inline cache with its host function or frame size.
+The entry point and the callee are then set by the interpreter.
+*/
+void fillCallIC(CallIC* ic, Value callee, size_t numArgs, Value instrVal)
+{
+    static ICache numParamsIC("num_params");
+    static ICache numLocalsIC("num_locals");
+
+    ic->callee = Value::UNDEF;
+    ic->hostFn = nullptr;
+    ic->numLocals = 0;
+    ic->entryAddr = nullptr;
+    ic->entryBlock = nullptr;
+    ic->entryVer = nullptr;
+    ic->jitEntry = nullptr;
+
+    size_t numParams;
+    if (callee.isObject())
     {
-        stack.push_back(val? Value::TRUE:Value::FALSE);
-    };
+        numParams = numParamsIC.getInt64(callee);
+        ic->numLocals = numLocalsIC.getInt64(callee);
+        assert (numParams <= ic->numLocals);
+    }
+    else if (callee.isHostFn())
+    {
+        ic->hostFn = (HostFn*)(callee.getWord().ptr);
+        numParams = ic->hostFn->getNumParams();
+    }
+    else
+    {
+        throw RunError("invalid callee at call site");
+    }
 
-    auto branchTo = [&instrs, &numInstrs, &instrIdx](Object targetBB)
+    if (numArgs != numParams)
     {
-        //std::cout << "branching" << std::endl;
+        auto instr = Object(instrVal);
+        std::string srcPosStr = (
+            instr.hasField("src_pos")?
+            (posToString(instr.getField("src_pos")) + " - "):
+            std::string("")
+        );
 
-        if (instrIdx != numInstrs)
-        {
-            throw RunError(
-                "only the last instruction in a block can be a branch ("
-                "instrIdx=" + std::to_string(instrIdx) + ", " +
-                "numInstrs=" + std::to_string(numInstrs) + ")"
-            );
-        }
+        throw RunError(
+            srcPosStr +
+            "incorrect argument count in call, received " +
+            std::to_string(numArgs) +
+            ", expected " +
+            std::to_string(numParams)
+        );
+    }
+}
 
-        static ICache instrsIC("instrs");
-        Array instrArr = instrsIC.getArr(targetBB);
+/// Keys of the decoded block map pointing into the nursery
+std::vector<refptr> youngDecodedKeys;
 
-        instrs = (Value)instrArr;
-        numInstrs = instrArr.length();
-        instrIdx = 0;
+/// Values of instruction records pointing into the nursery
+std::vector<Value*> youngDecodedVals;
 
-        if (numInstrs == 0)
-        {
-            throw RunError("target basic block is empty");
-        }
-    };
+/// Get the decoded block for a block object. The block instructions
+/// are only decoded when it is first entered.
+DecodedBlock* getDecodedBlock(Object block)
+{
+    auto blockPtr = (refptr)block;
 
-    // Get the entry block for this function
-    static ICache entryIC("entry");
-    Object entryBB = entryIC.getObj(fun);
+    auto itr = decodedBlocks.find(blockPtr);
+    if (itr != decodedBlocks.end())
+        return itr->second;
 
-    // Branch to the entry block
-    branchTo(entryBB);
+    auto decoded = new DecodedBlock(block);
+    decodedBlocks[blockPtr] = decoded;
 
-    // For each instruction to execute
-    for (;;)
+    if (vm.isYoung(blockPtr))
+        youngDecodedKeys.push_back(blockPtr);
+
+    return decoded;
+}
+
+/// Decode the instructions of a block into instruction records
+void decodeBlock(DecodedBlock* decoded)
+{
+    static ICache instrsIC("instrs");
+    static ICache idxIC("idx");
+    static ICache valIC("val");
+    static ICache tagIC("tag");
+    static ICache toIC("to");
+    static ICache thenIC("then");
+    static ICache elseIC("else");
+    static ICache retToIC("ret_to");
+    static ICache numArgsIC("num_args");
+
+    assert (decoded->instrs.empty());
+    Array instrArr = instrsIC.getArr(decoded->block);
+    auto numInstrs = instrArr.length();
+
+    if (numInstrs == 0)
     {
-        assert (instrIdx < numInstrs);
+        throw RunError("target basic block is empty");
+    }
 
-        //std::cout << "cycleCount=" << cycleCount << std::endl;
-        //std::cout << "instrIdx=" << instrIdx << std::endl;
+    std::vector<DecodedInstr> instrs(numInstrs);
 
-        Array instrArr = Array(instrs);
-        Value instrVal = instrArr.getElem(instrIdx);
+    for (size_t i = 0; i < numInstrs; ++i)
+    {
+        Value instrVal = instrArr.getElem(i);
         assert (instrVal.isObject());
         auto instr = Object(instrVal);
 
-        cycleCount++;
-        instrIdx++;
-
-        // Get the opcode for this instruction
-        auto op = decode(instr);
+        auto& rec = instrs[i];
+        rec.op = decode(instr);
+        rec.ic = getFieldIC(instr);
 
-        switch (op)
+        switch (rec.op)
         {
-            // Read a local variable and push it on the stack
             case GET_LOCAL:
-            {
-                static ICache icache("idx");
-                auto localIdx = icache.getInt64(instr);
-                //std::cout << "localIdx=" << localIdx << std::endl;
-                assert (localIdx < locals.size());
-                stack.push_back(locals[localIdx]);
-            }
-            break;
-
-            // Set a local variable
             case SET_LOCAL:
-            {
-                static ICache icache("idx");
-                auto localIdx = icache.getInt64(instr);
-                //std::cout << "localIdx=" << localIdx << std::endl;
-                assert (localIdx < locals.size());
-                locals[localIdx] = popVal();
-            }
+            case DUP:
+            rec.idx = idxIC.getInt64(instr);
             break;
 
             case PUSH:
-            {
-                static ICache icache("val");
-                auto val = icache.getField(instr);
-                stack.push_back(val);
-            }
+            rec.val = valIC.getField(instr);
             break;
 
-            case POP:
-            {
-                if (stack.empty())
-                    throw RunError("pop failed, stack empty");
-                stack.pop_back();
-            }
+            case HAS_TAG:
+            rec.tag = tagFromStr(tagIC.getStr(instr));
             break;
 
-            // Duplicate the top of the stack
-            case DUP:
-            {
-                static ICache idxIC("idx");
-                auto idx = idxIC.getInt64(instr);
-
-                if (idx >= stack.size())
-                    throw RunError("stack undeflow, invalid index for dup");
-
-                auto val = stack[stack.size() - 1 - idx];
-                stack.push_back(val);
-            }
+            case JUMP:
+            rec.target0 = getDecodedBlock(toIC.getObj(instr));
             break;
 
-            // Swap the topmost two stack elements
-            case SWAP:
-            {
-                auto v0 = popVal();
-                auto v1 = popVal();
-                stack.push_back(v0);
-                stack.push_back(v1);
-            }
+            case IF_TRUE:
+            rec.target0 = getDecodedBlock(thenIC.getObj(instr));
+            rec.target1 = getDecodedBlock(elseIC.getObj(instr));
             break;
 
-            //
-            // 64-bit integer operations
-            //
+            case CALL:
+            rec.idx = numArgsIC.getInt64(instr);
+            rec.target0 = getDecodedBlock(retToIC.getObj(instr));
+            rec.val = instr;
+            rec.callIC = newCallIC();
+            break;
 
-            case ADD_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                stack.push_back(arg0 + arg1);
-            }
+            case ABORT:
+            rec.val = instr;
+            break;
+
+            default:
+            break;
+        }
+
+        if ((rec.op == JUMP || rec.op == IF_TRUE || rec.op == CALL) &&
+            i + 1 != numInstrs)
+        {
+            throw RunError(
+                "only the last instruction in a block can be a branch ("
+                "instrIdx=" + std::to_string(i + 1) + ", " +
+                "numInstrs=" + std::to_string(numInstrs) + ")"
+            );
+        }
+    }
+
+    auto lastOp = instrs.back().op;
+    if (lastOp != JUMP && lastOp != IF_TRUE && lastOp != CALL &&
+        lastOp != RET && lastOp != ABORT)
+    {
+        throw RunError("basic block does not end with a branch");
+    }
+
+    decoded->instrs = std::move(instrs);
+
+    for (auto& rec : decoded->instrs)
+    {
+        if (rec.val.isPointer() && vm.isYoung(rec.val.getWord().ptr))
+            youngDecodedVals.push_back(&rec.val);
+    }
+}
+
+/// Initial stack size in words
+const size_t STACK_INIT_SIZE = 1 << 20;
+
+/// Size of the stack in words
+size_t stackSize = 0;
+
+/// Lower stack limit (stack pointer must be greater than this)
+Value* stackLimit = nullptr;
+
+/// Stack bottom (end of the stack memory array)
+Value* stackBottom = nullptr;
+
+/// Stack frame base pointer
+Value* basePtr = nullptr;
+
+/// Current temp stack top pointer
+Value* stackPtr = nullptr;
+
+/// The code stream and stack operations are used by most instructions,
+/// and must be inlined into the interpreter loop despite their error paths
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+
+/// Push a value on the stack
+ALWAYS_INLINE void pushVal(Value val)
+{
+    if (stackPtr <= stackLimit)
+        throw RunError("stack overflow");
+    stackPtr--;
+    stackPtr[0] = val;
+}
+
+ALWAYS_INLINE Value popVal()
+{
+    if (stackPtr >= stackBottom)
+        throw RunError("op cannot pop value, stack empty");
+    auto val = stackPtr[0];
+    stackPtr++;
+    return val;
+}
+
+ALWAYS_INLINE void pushBool(bool val)
+{
+    pushVal(val? Value::TRUE:Value::FALSE);
+}
+
+ALWAYS_INLINE bool popBool()
+{
+    auto val = popVal();
+    if (!val.isBool())
+        throw RunError("op expects boolean value");
+    return (bool)val;
+}
+
+ALWAYS_INLINE int64_t popInt64()
+{
+    auto val = popVal();
+    if (!val.isInt64())
+        throw RunError("op expects int64 value");
+    return (int64_t)val;
+}
+
+/// Read the int64 value on top of the stack without popping it
+ALWAYS_INLINE int64_t topInt64()
+{
+    if (stackPtr >= stackBottom)
+        throw RunError("op cannot pop value, stack empty");
+    if (!stackPtr[0].isInt64())
+        throw RunError("op expects int64 value");
+    return stackPtr[0].getWord().int64;
+}
+
+/// Read an int64 value from a local variable of the current frame
+ALWAYS_INLINE int64_t localInt64(uint32_t idx)
+{
+    auto val = basePtr[-(ptrdiff_t)idx];
+    if (!val.isInt64())
+        throw RunError("op expects int64 value");
+    return val.getWord().int64;
+}
+
+ALWAYS_INLINE String popStr()
+{
+    auto val = popVal();
+    if (!val.isString())
+        throw RunError("op expects string value");
+    return String(val);
+}
+
+ALWAYS_INLINE Object popObj()
+{
+    auto val = popVal();
+    assert (val.isObject());
+    return Object(val);
+}
+
+ALWAYS_INLINE Array popArray()
+{
+    auto val = popVal();
+    if (!val.isArray())
+        throw RunError("op expects array value");
+    return Array(val);
+}
+
+/**
+Push a call frame for a function whose arguments are on top of the
+stack, and return the base pointer of the new frame. Locals are
+addressed downward from the base pointer, starting with the arguments,
+which are left in place. The caller's base pointer, the return address
+and the function are saved below the locals.
+*/
+Value* pushFrame(Object fun, size_t numArgs, size_t numLocals, uint8_t* retAddr)
+{
+    assert (numArgs <= numLocals);
+
+    if (stackPtr - (numLocals - numArgs) - 3 <= stackLimit)
+        throw RunError("stack overflow");
+
+    auto newBasePtr = stackPtr + numArgs - 1;
+
+    for (size_t i = numArgs; i < numLocals; ++i)
+        pushVal(Value::UNDEF);
+
+    pushVal(Value((refptr)basePtr, TAG_RETADDR));
+    pushVal(Value(retAddr, TAG_RETADDR));
+    pushVal(fun);
+
+    return newBasePtr;
+}
+
+/// Call a host function with its arguments on top of the stack. The
+/// arguments stay on the stack during the call, so that they remain
+/// visible to the GC, and are popped by the caller.
+ALWAYS_INLINE Value callHostFn(HostFn* hostFn, size_t numArgs)
+{
+    switch (numArgs)
+    {
+        case 0:
+        return hostFn->call0();
+
+        case 1:
+        return hostFn->call1(stackPtr[0]);
+
+        case 2:
+        return hostFn->call2(stackPtr[1], stackPtr[0]);
+
+        case 3:
+        return hostFn->call3(stackPtr[2], stackPtr[1], stackPtr[0]);
+
+        default:
+        assert (false);
+        return Value::UNDEF;
+    }
+}
+
+/**
+Get the start of the temporary values of a call() frame. The call()
+interpreter saves the number of locals of the calling function below
+the frame values pushed by pushFrame, and the temporaries follow.
+*/
+ALWAYS_INLINE Value* tempsBase(size_t numLocals)
+{
+    return basePtr - numLocals - 3;
+}
+
+Value call(Object fun, ValueVec args)
+{
+    static ICache numParamsIC("num_params");
+    static ICache numLocalsIC("num_locals");
+    static ICache entryIC("entry");
+    auto numParams = numParamsIC.getInt64(fun);
+    size_t numLocals = numLocalsIC.getInt64(fun);
+    assert (args.size() <= numParams);
+    assert (numParams <= numLocals);
+
+    // Push the arguments and the frame. There is no return block
+    // since this is a top-level call.
+    auto prevStackPtr = stackPtr;
+    for (size_t i = 0; i < args.size(); ++i)
+        pushVal(args[i]);
+    basePtr = pushFrame(fun, args.size(), numLocals, nullptr);
+    pushVal(Value((int64_t)0));
+
+    // Next instruction to execute
+    DecodedInstr* nextInstr = nullptr;
+
+    auto branchTo = [&nextInstr](DecodedBlock* targetBB)
+    {
+        //std::cout << "branching" << std::endl;
+
+        // Blocks are decoded on first entry
+        if (targetBB->instrs.empty())
+            decodeBlock(targetBB);
+
+        nextInstr = targetBB->instrs.data();
+
+        // Block entry is a GC safepoint
+        vm.safepoint();
+    };
+
+    // Get the entry block for this function
+    Object entryBB = entryIC.getObj(fun);
+
+    // Branch to the entry block
+    branchTo(getDecodedBlock(entryBB));
+
+    // For each instruction to execute
+    for (;;)
+    {
+        //std::cout << "cycleCount=" << cycleCount << std::endl;
+
+        auto& instr = *nextInstr;
+
+        cycleCount++;
+        nextInstr++;
+
+        switch (instr.op)
+        {
+            // Read a local variable and push it on the stack
+            case GET_LOCAL:
+            {
+                auto localIdx = instr.idx;
+                //std::cout << "localIdx=" << localIdx << std::endl;
+                assert (localIdx < numLocals);
+                pushVal(basePtr[-localIdx]);
+            }
+            break;
+
+            // Set a local variable
+            case SET_LOCAL:
+            {
+                auto localIdx = instr.idx;
+                //std::cout << "localIdx=" << localIdx << std::endl;
+                assert (localIdx < numLocals);
+                basePtr[-localIdx] = popVal();
+            }
+            break;
+
+            case PUSH:
+            {
+                pushVal(instr.val);
+            }
+            break;
+
+            case POP:
+            {
+                if (stackPtr >= tempsBase(numLocals))
+                    throw RunError("pop failed, stack empty");
+                stackPtr++;
+            }
+            break;
+
+            // Duplicate the top of the stack
+            case DUP:
+            {
+                auto idx = instr.idx;
+
+                if (stackPtr + idx >= tempsBase(numLocals))
+                    throw RunError("stack undeflow, invalid index for dup");
+
+                auto val = stackPtr[idx];
+                pushVal(val);
+            }
+            break;
+
+            // Swap the topmost two stack elements
+            case SWAP:
+            {
+                auto v0 = popVal();
+                auto v1 = popVal();
+                pushVal(v0);
+                pushVal(v1);
+            }
+            break;
+
+            //
+            // 64-bit integer operations
+            //
+
+            case ADD_I64:
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 + arg1);
+            }
             break;
 
             case SUB_I64:
             {
                 auto arg1 = popInt64();
                 auto arg0 = popInt64();
-                stack.push_back(arg0 - arg1);
+                pushVal(arg0 - arg1);
             }
             break;
 
@@ -490,7 +1232,7 @@ Value call(Object fun, ValueVec args)
             {
                 auto arg1 = popInt64();
                 auto arg0 = popInt64();
-                stack.push_back(arg0 * arg1);
+                pushVal(arg0 * arg1);
             }
             break;
 
@@ -541,7 +1283,7 @@ Value call(Object fun, ValueVec args)
             case STR_LEN:
             {
                 auto str = popStr();
-                stack.push_back(str.length());
+                pushVal(str.length());
             }
             break;
 
@@ -566,7 +1308,7 @@ Value call(Object fun, ValueVec args)
                     charStrings[ch] = String(buf);
                 }
 
-                stack.push_back(charStrings[ch]);
+                pushVal(charStrings[ch]);
             }
             break;
 
@@ -582,7 +1324,7 @@ Value call(Object fun, ValueVec args)
                     );
                 }
 
-                stack.push_back((int64_t)str[idx]);
+                pushVal((int64_t)str[idx]);
             }
             break;
 
@@ -591,7 +1333,69 @@ Value call(Object fun, ValueVec args)
                 auto a = popStr();
                 auto b = popStr();
                 auto c = String::concat(b, a);
-                stack.push_back(c);
+                pushVal(c);
+            }
+            break;
+
+            case STR_SLICE:
+            {
+                auto end = popInt64();
+                auto start = popInt64();
+                auto str = popStr();
+
+                if (start < 0 || start > end || end > str.length())
+                {
+                    throw RunError(
+                        "str_slice, index out of bounds"
+                    );
+                }
+
+                pushVal(String::slice(str, start, end));
+            }
+            break;
+
+            case STR_CMP:
+            {
+                auto arg1 = popStr();
+                auto arg0 = popStr();
+                auto cmp = String::compare(arg0, arg1);
+                pushVal(Value((int64_t)((cmp > 0) - (cmp < 0))));
+            }
+            break;
+
+            case STR_FIND:
+            {
+                auto startIdx = popInt64();
+                auto sub = popStr();
+                auto str = popStr();
+
+                if (startIdx < 0)
+                {
+                    throw RunError(
+                        "str_find, negative start index"
+                    );
+                }
+
+                pushVal(Value(str.find(sub, startIdx)));
+            }
+            break;
+
+            case STR_TO_I64:
+            {
+                auto str = popStr();
+
+                int64_t val;
+                if (parseInt64(str, val))
+                    pushVal(Value(val));
+                else
+                    pushVal(Value::FALSE);
+            }
+            break;
+
+            case I64_TO_STR:
+            {
+                auto val = popInt64();
+                pushVal(String(std::to_string(val)));
             }
             break;
 
@@ -611,7 +1415,7 @@ Value call(Object fun, ValueVec args)
             {
                 auto capacity = popInt64();
                 auto obj = Object::newObject(capacity);
-                stack.push_back(obj);
+                pushVal(obj);
             }
             break;
 
@@ -619,7 +1423,8 @@ Value call(Object fun, ValueVec args)
             {
                 auto fieldName = popStr();
                 auto obj = popObj();
-                pushBool(obj.hasField(fieldName));
+                Value val;
+                pushBool(lookupField(instr.ic, obj, fieldName, val));
             }
             break;
 
@@ -628,16 +1433,7 @@ Value call(Object fun, ValueVec args)
                 auto val = popVal();
                 auto fieldName = popStr();
                 auto obj = popObj();
-
-                if (!isValidIdent(fieldName))
-                {
-                    throw RunError(
-                        "invalid identifier in set_field \"" +
-                        (std::string)fieldName + "\""
-                    );
-                }
-
-                obj.setField(fieldName, val);
+                storeField(instr.ic, obj, fieldName, val);
             }
             break;
 
@@ -652,7 +1448,8 @@ Value call(Object fun, ValueVec args)
 
                 //std::cout << "get " << std::string(fieldName) << std::endl;
 
-                if (!obj.hasField(fieldName))
+                Value val;
+                if (!lookupField(instr.ic, obj, fieldName, val))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -660,8 +1457,7 @@ Value call(Object fun, ValueVec args)
                     );
                 }
 
-                auto val = obj.getField(fieldName);
-                stack.push_back(val);
+                pushVal(val);
             }
             break;
 
@@ -681,14 +1477,14 @@ Value call(Object fun, ValueVec args)
             {
                 auto len = popInt64();
                 auto array = Array(len);
-                stack.push_back(array);
+                pushVal(array);
             }
             break;
 
             case ARRAY_LEN:
             {
                 auto arr = Array(popVal());
-                stack.push_back(arr.length());
+                pushVal(arr.length());
             }
             break;
 
@@ -729,7 +1525,7 @@ Value call(Object fun, ValueVec args)
                     );
                 }
 
-                stack.push_back(arr.getElem(idx));
+                pushVal(arr.getElem(idx));
             }
             break;
 
@@ -745,33 +1541,16 @@ Value call(Object fun, ValueVec args)
             case HAS_TAG:
             {
                 auto tag = popVal().getTag();
-                static ICache tagIC("tag");
-                auto tagStr = tagIC.getStr(instr);
 
                 switch (tag)
                 {
                     case TAG_UNDEF:
-                    pushBool(tagStr == "undef");
-                    break;
-
                     case TAG_BOOL:
-                    pushBool(tagStr == "bool");
-                    break;
-
                     case TAG_INT64:
-                    pushBool(tagStr == "int64");
-                    break;
-
                     case TAG_STRING:
-                    pushBool(tagStr == "string");
-                    break;
-
                     case TAG_ARRAY:
-                    pushBool(tagStr == "array");
-                    break;
-
                     case TAG_OBJECT:
-                    pushBool(tagStr == "object");
+                    pushBool(tag == instr.tag);
                     break;
 
                     default:
@@ -784,127 +1563,98 @@ Value call(Object fun, ValueVec args)
 
             case JUMP:
             {
-                static ICache icache("to");
-                auto target = icache.getObj(instr);
-                branchTo(target);
+                branchTo(instr.target0);
             }
             break;
 
             case IF_TRUE:
             {
-                static ICache thenCache("then");
-                static ICache elseCache("else");
-                auto thenBB = thenCache.getObj(instr);
-                auto elseBB = elseCache.getObj(instr);
                 auto arg0 = popVal();
-                branchTo((arg0 == Value::TRUE)? thenBB:elseBB);
+                branchTo((arg0 == Value::TRUE)? instr.target0:instr.target1);
             }
             break;
 
             // Regular function call
             case CALL:
             {
-                static ICache retToCache("ret_to");
-                static ICache numArgsCache("num_args");
-                auto retToBB = retToCache.getObj(instr);
-                auto numArgs = numArgsCache.getInt64(instr);
+                auto numArgs = instr.idx;
+                auto ic = instr.callIC;
 
                 auto callee = popVal();
 
-                if (stack.size() < numArgs)
+                if (stackPtr + numArgs > tempsBase(numLocals))
                 {
                     throw RunError(
                         "stack underflow at call"
                     );
                 }
 
-                // Copy the arguments into a vector
-                ValueVec args;
-                args.resize(numArgs);
-                for (size_t i = 0; i < numArgs; ++i)
-                    args[numArgs - 1 - i] = popVal();
-
-                static ICache numParamsIC("num_params");
-                size_t numParams;
-                if (callee.isObject())
-                {
-                    numParams = numParamsIC.getInt64(callee);
-                }
-                else if (callee.isHostFn())
-                {
-                    auto hostFn = (HostFn*)(callee.getWord().ptr);
-                    numParams = hostFn->getNumParams();
-                }
-                else
+                // On a cache miss, check the callee and get its entry block
+                if (callee != ic->callee)
                 {
-                    throw RunError("invalid callee at call site");
+                    fillCallIC(ic, callee, numArgs, instr.val);
+
+                    if (!ic->hostFn)
+                        ic->entryBlock = getDecodedBlock(entryIC.getObj(callee));
+
+                    ic->setCallee(callee);
                 }
 
-                if (numArgs != numParams)
+                // Calls to other functions do not recurse, the callee
+                // frame is pushed with the arguments left in place,
+                // and execution continues at the callee entry block
+                if (ic->entryBlock)
                 {
-                    std::string srcPosStr = (
-                        instr.hasField("src_pos")?
-                        (posToString(instr.getField("src_pos")) + " - "):
-                        std::string("")
+                    basePtr = pushFrame(
+                        callee,
+                        numArgs,
+                        ic->numLocals,
+                        (uint8_t*)instr.target0
                     );
+                    pushVal(Value((int64_t)numLocals));
+                    numLocals = ic->numLocals;
 
-                    throw RunError(
-                        srcPosStr +
-                        "incorrect argument count in call, received " +
-                        std::to_string(numArgs) +
-                        ", expected " +
-                        std::to_string(numParams)
-                    );
+                    branchTo(ic->entryBlock);
+                    break;
                 }
 
-                Value retVal;
+                auto hostFn = ic->hostFn;
 
-                if (callee.isObject())
-                {
-                    // Perform the call
-                    retVal = call(callee, args);
-                }
-                else if (callee.isHostFn())
-                {
-                    auto hostFn = (HostFn*)(callee.getWord().ptr);
+                // Call the host function, the arguments are read
+                // from the stack before they are popped
+                auto retVal = callHostFn(hostFn, numArgs);
+                stackPtr += numArgs;
 
-                    // Call the host function
-                    switch (numArgs)
-                    {
-                        case 0:
-                        retVal = hostFn->call0();
-                        break;
-
-                        case 1:
-                        retVal = hostFn->call1(args[0]);
-                        break;
-
-                        case 2:
-                        retVal = hostFn->call2(args[0], args[1]);
-                        break;
-
-                        case 3:
-                        retVal = hostFn->call3(args[0], args[1], args[2]);
-                        break;
-
-                        default:
-                        assert (false);
-                    }
-                }
-
-                // Push the return value on the stack
-                stack.push_back(retVal);
+                // Push the return value on the stack
+                pushVal(retVal);
 
                 // Jump to the return basic block
-                branchTo(retToBB);
+                branchTo(instr.target0);
             }
             break;
 
+            // Pop the frame, and return to the calling host function
+            // if this is a top-level call
             case RET:
             {
-                auto val = stack.back();
-                stack.pop_back();
-                return val;
+                auto val = popVal();
+
+                auto retBlock = (DecodedBlock*)basePtr[-numLocals-1].getWord().ptr;
+                auto prevBase = (Value*)basePtr[-numLocals].getWord().ptr;
+                auto prevLocals = basePtr[-numLocals-3].getWord().int64;
+
+                stackPtr = basePtr + 1;
+                basePtr = prevBase;
+                numLocals = prevLocals;
+
+                if (!retBlock)
+                {
+                    assert (stackPtr == prevStackPtr);
+                    return val;
+                }
+
+                pushVal(val);
+                branchTo(retBlock);
             }
             break;
 
@@ -912,7 +1662,7 @@ Value call(Object fun, ValueVec args)
             {
                 auto pkgName = popStr();
                 auto pkg = import(pkgName);
-                stack.push_back(pkg);
+                pushVal(pkg);
             }
             break;
 
@@ -921,9 +1671,10 @@ Value call(Object fun, ValueVec args)
                 auto errMsg = (std::string)popStr();
 
                 // If a source position was specified
-                if (instr.hasField("src_pos"))
+                auto instrObj = Object(instr.val);
+                if (instrObj.hasField("src_pos"))
                 {
-                    auto srcPos = instr.getField("src_pos");
+                    auto srcPos = instrObj.getField("src_pos");
                     std::cout << posToString(srcPos) << " - ";
                 }
 
@@ -949,19 +1700,31 @@ Value call(Object fun, ValueVec args)
     assert (false);
 }
 
-/// Call a function exported by a package
-Value callExportFn(
-    Object pkg,
-    std::string fnName,
-    ValueVec args
-)
+/// Run code with the call() interpreter instead of the block
+/// versioning interpreter
+bool useCallInterp = false;
+
+/// Run hot block versions as native code. Code starts in the block
+/// versioning interpreter, or in the call() interpreter on hosts
+/// which do not support the JIT.
+bool useJit = true;
+
+/// Number of entries into a block version by the interpreter after
+/// which it runs in JIT code. Entry versions count the calls to their
+/// function, and loop headers the iterations of their loop.
+uint32_t jitThreshold = 50;
+
+/// Number of entries into the baseline JIT code of a block version
+/// after which it is recompiled by the optimizing tier
+uint32_t optThreshold = 1000;
+
+/// Get a function exported by a package
+Object getExportFn(Object pkg, std::string fnName)
 {
     assert (pkg.hasField(fnName));
     auto fnVal = pkg.getField(fnName);
     assert (fnVal.isObject());
-    auto funObj = Object(fnVal);
-
-    return call(funObj, args);
+    return Object(fnVal);
 }
 
 Value testRunImage(std::string fileName)
@@ -970,7 +1733,7 @@ Value testRunImage(std::string fileName)
 
     auto pkg = parseFile(fileName);
 
-    return callExportFn(pkg, "main");
+    return call(getExportFn(pkg, "main"), ValueVec());
 }
 
 void testInterp()
@@ -982,17 +1745,25 @@ void testInterp()
     assert (testRunImage("tests/vm/ex_image.zim") == Value(10));
     assert (testRunImage("tests/vm/ex_rec_fact.zim") == Value(5040));
     assert (testRunImage("tests/vm/ex_fibonacci.zim") == Value(377));
+
+    // Field accesses in loops hit their inline caches
+    auto numHits = fieldICHits;
+    assert (testRunImage("tests/vm/ex_field_ic.zim") == Value(10));
+    assert (fieldICHits >= numHits + 18);
+
+    assert (testRunImage("tests/vm/ex_str_ops.zim") == Value(-1176));
+    assert (testRunImage("tests/vm/ex_type_tests.zim") == Value(18));
 }
 
 //============================================================================
 // New interpreter
 //============================================================================
 
-/// Initial code heap size in bytes
-const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
+/// Size of the chunks the code heap grows by, in bytes
+const size_t CODE_HEAP_CHUNK_SIZE = 1 << 20;
 
-/// Initial stack size in words
-const size_t STACK_INIT_SIZE = 1 << 16;
+/// Upper bound on the size of the code compiled for one instruction
+const size_t MAX_INSTR_CODE_SIZE = 64;
 
 class CodeFragment
 {
@@ -1043,6 +1814,174 @@ public:
     */
 };
 
+/// Tag of a value whose type is not known at compilation time
+const Tag TAG_UNKNOWN = 0xFE;
+
+/**
+Code generation context. Tracks what is known about the types of the
+temporary stack slots and of the local variables at a point in a
+block. Blocks are compiled separately for each context they are
+entered with, so that type tests which have already been performed
+can be skipped.
+*/
+class CodeGenCtx
+{
+public:
+
+    /// Information known about a temporary stack slot
+    struct Slot
+    {
+        Tag tag = TAG_UNKNOWN;
+
+        /// Local variable the value was read from, or -1
+        int32_t srcLocal = -1;
+
+        /// For has_tag results, the local variable tested, or -1,
+        /// and the tag it was tested against
+        int32_t testLocal = -1;
+        Tag testTag = TAG_UNKNOWN;
+
+        /// Known boolean value, or -1
+        int8_t boolVal = -1;
+
+        bool operator == (const Slot& that) const
+        {
+            return (
+                tag == that.tag &&
+                srcLocal == that.srcLocal &&
+                testLocal == that.testLocal &&
+                testTag == that.testTag &&
+                boolVal == that.boolVal
+            );
+        }
+    };
+
+    /// Temporary stack slots, the top of the stack is at the back.
+    /// Only the slots pushed since function entry are tracked.
+    std::vector<Slot> stack;
+
+    /// Local variable tags
+    std::vector<Tag> locals;
+
+    /// Context at function entry, parameter values are not known,
+    /// while the other locals are undefined
+    static CodeGenCtx entry(size_t numParams, size_t numLocals)
+    {
+        CodeGenCtx ctx;
+        ctx.locals.resize(numLocals, TAG_UNDEF);
+        for (size_t i = 0; i < numParams; ++i)
+            ctx.locals[i] = TAG_UNKNOWN;
+        return ctx;
+    }
+
+    bool operator == (const CodeGenCtx& that) const
+    {
+        return stack == that.stack && locals == that.locals;
+    }
+
+    /// Number of local variables of the function being compiled
+    uint32_t numLocals() const
+    {
+        return locals.size();
+    }
+
+    void push(Tag tag)
+    {
+        Slot slot;
+        slot.tag = tag;
+        stack.push_back(slot);
+    }
+
+    void push(Slot slot)
+    {
+        stack.push_back(slot);
+    }
+
+    Slot pop()
+    {
+        if (stack.empty())
+            return Slot();
+
+        auto slot = stack.back();
+        stack.pop_back();
+        return slot;
+    }
+
+    void pop(size_t numSlots)
+    {
+        for (size_t i = 0; i < numSlots; ++i)
+            pop();
+    }
+
+    /// Get a slot by index from the top of the stack
+    Slot get(size_t idx) const
+    {
+        if (idx >= stack.size())
+            return Slot();
+        return stack[stack.size() - 1 - idx];
+    }
+
+    void setLocal(size_t idx, Tag tag)
+    {
+        locals[idx] = tag;
+
+        // Stack slots read from this local no longer match its value
+        for (auto& slot : stack)
+        {
+            if (slot.srcLocal == (int32_t)idx)
+                slot.srcLocal = -1;
+            if (slot.testLocal == (int32_t)idx)
+                slot.testLocal = -1;
+        }
+    }
+
+    /// Refine the tag known for a local variable and the stack
+    /// slots holding its value
+    void refineLocal(size_t idx, Tag tag)
+    {
+        locals[idx] = tag;
+
+        for (auto& slot : stack)
+        {
+            if (slot.srcLocal == (int32_t)idx)
+                slot.tag = tag;
+        }
+    }
+
+    /// Get the context to enter a successor block with. Only the
+    /// tags are kept, which limits the number of versions.
+    CodeGenCtx exitCtx() const
+    {
+        CodeGenCtx ctx;
+        ctx.locals = locals;
+        for (auto& slot : stack)
+            ctx.push(slot.tag);
+        return ctx;
+    }
+
+    /// Get the generic context, where no types are known. No stack
+    /// slots are tracked, so that it fits any stack depth.
+    CodeGenCtx genericCtx() const
+    {
+        CodeGenCtx ctx;
+        ctx.locals.resize(locals.size(), TAG_UNKNOWN);
+        return ctx;
+    }
+
+    /// Test if this is the generic context
+    bool isGeneric() const
+    {
+        if (!stack.empty())
+            return false;
+
+        for (auto tag : locals)
+            if (tag != TAG_UNKNOWN)
+                return false;
+
+        return true;
+    }
+};
+
 class BlockVersion : public CodeFragment
 {
 public:
@@ -1051,104 +1990,292 @@ public:
     Object block;
 
     /// Code generation context at block entry
-    //CodeGenCtx ctx;
+    CodeGenCtx ctx;
+
+    /// Flag set on the version used when the block is entered by
+    /// a function call
+    bool isEntry = false;
+
+    /// Native code translated by the JIT, null until the version
+    /// is first run by JIT code. This is the optimized code once the
+    /// version is hot.
+    uint8_t* jitPtr = nullptr;
+
+    /// Entries into the baseline JIT code left until it is optimized
+    uint32_t optCountdown = 0;
+
+    /// Baseline JIT code once the version is optimized, and the entry
+    /// bytes overwritten by the jump to the optimized code
+    uint8_t* baseJitPtr = nullptr;
+    uint8_t baseEntryBytes[5];
+
+    /// Deoptimizations left until the optimized code is discarded
+    uint32_t deoptCountdown = 0;
 
-    BlockVersion(Object block)
-    : block(block)
+    /// Number of times the optimized code of the version was
+    /// discarded. It is then optimized again without speculating.
+    uint32_t numInvalidations = 0;
+
+    /// Entries into the version by the interpreter, through calls or
+    /// backward branches, counted until it runs in JIT code
+    uint32_t hotCount = 0;
+
+    BlockVersion(Object block, const CodeGenCtx& ctx)
+    : block(block),
+      ctx(ctx)
     {
     }
 };
 
 typedef std::vector<BlockVersion*> VersionList;
 
-/// Flat array of bytes into which code gets compiled
+/// Chunk of the code heap into which code currently gets compiled
 uint8_t* codeHeap = nullptr;
 
-/// Limit pointer for the code heap
+/// Limit pointer for the current code heap chunk
 uint8_t* codeHeapLimit = nullptr;
 
+/// Start and limit pointers of the full code heap chunks
+std::vector<std::pair<uint8_t*, uint8_t*>> fullCodeChunks;
+
 /// Current allocation pointer in the code heap
 uint8_t* codeHeapAlloc = nullptr;
 
 /// Map of block objects to lists of versions
 std::unordered_map<refptr, VersionList> versionMap;
 
-/// Size of the stack in words
-size_t stackSize = 0;
-
-/// Lower stack limit (stack pointer must be greater than this)
-Value* stackLimit = nullptr;
-
-/// Stack bottom (end of the stack memory array)
-Value* stackBottom = nullptr;
+/// Block versions by start address, to decode the branches which
+/// the interpreter has patched
+std::unordered_map<uint8_t*, BlockVersion*> versionStarts;
 
-/// Stack frame base pointer
-Value* basePtr = nullptr;
+/// Keys of the version map pointing into the nursery
+std::vector<refptr> youngBlockKeys;
 
-/// Current temp stack top pointer
-Value* stackPtr = nullptr;
+/// Heap references in the code heap pointing into the nursery
+std::vector<Value*> youngCodeRefs;
 
 // Current instruction pointer
 uint8_t* instrPtr = nullptr;
 
-/// Write a value to the code heap
-template <typename T> void writeCode(T val)
+/// Allocate a new code heap chunk
+void allocCodeChunk(size_t minSize)
+{
+    if (codeHeap)
+        fullCodeChunks.push_back(std::make_pair(codeHeap, codeHeapLimit));
+
+    auto size = std::max(CODE_HEAP_CHUNK_SIZE, minSize);
+    codeHeap = new uint8_t[size];
+    codeHeapLimit = codeHeap + size;
+    codeHeapAlloc = codeHeap;
+}
+
+/// Make room for code which must be contiguous. The code heap grows
+/// by a new chunk when the current one is full, and the code in full
+/// chunks stays in place since branches point to it.
+void reserveCode(size_t numBytes)
+{
+    if (codeHeapAlloc + numBytes > codeHeapLimit)
+        allocCodeChunk(numBytes);
+}
+
+/// Test if an address points into the code heap. Branch targets not
+/// compiled yet point to their block version instead.
+ALWAYS_INLINE bool inCodeHeap(const uint8_t* addr)
+{
+    if (addr >= codeHeap && addr < codeHeapLimit)
+        return true;
+
+    for (auto& chunk : fullCodeChunks)
+        if (addr >= chunk.first && addr < chunk.second)
+            return true;
+
+    return false;
+}
+
+/// Write a value to the code heap, and return its address
+template <typename T> T* writeCode(T val)
 {
-    assert (codeHeapAlloc < codeHeapLimit);
+    reserveCode(sizeof(T));
     T* heapPtr = (T*)codeHeapAlloc;
     *heapPtr = val;
     codeHeapAlloc += sizeof(T);
     assert (codeHeapAlloc <= codeHeapLimit);
+    return heapPtr;
 }
 
 /// Return a pointer to a value to read from the code stream
-template <typename T> T& readCode()
+template <typename T> ALWAYS_INLINE T& readCode()
 {
-    assert (instrPtr + sizeof(T) <= codeHeapLimit);
+    assert (inCodeHeap(instrPtr));
     T* valPtr = (T*)instrPtr;
     instrPtr += sizeof(T);
     return *valPtr;
 }
 
+/// Enumerate the GC roots held by the interpreters
+void visitInterpRoots()
+{
+    for (auto& val : charStrings)
+        vm.visitRoot(val);
+
+    for (auto valPtr = stackPtr; valPtr < stackBottom; ++valPtr)
+        vm.visitRoot(*valPtr);
+
+    // Names in the megamorphic caches may get moved, or freed once
+    // marking completes
+    for (size_t i = 0; i < MEGA_CACHE_SIZE; ++i)
+    {
+        megaLoadCache[i].shape = nullptr;
+        megaStoreCache[i].shape = nullptr;
+    }
+
+    // Blocks must stay live while their address is cached. During
+    // nursery collections, only the keys pointing into the nursery
+    // need to be visited and moved to their new address.
+    if (vm.isMinorGC())
+    {
+        for (auto key : youngBlockKeys)
+        {
+            auto versions = versionMap[key];
+            versionMap.erase(key);
+            vm.visitRoot(key);
+            versionMap[key] = versions;
+
+            for (auto version : versions)
+                vm.visitRoot(version->block);
+        }
+
+        for (auto key : youngDecodedKeys)
+        {
+            auto decoded = decodedBlocks[key];
+            decodedBlocks.erase(key);
+            vm.visitRoot(key);
+            decodedBlocks[key] = decoded;
+            vm.visitRoot(decoded->block);
+        }
+
+        for (auto val : youngDecodedVals)
+            vm.visitRoot(*val);
+
+        for (auto ref : youngCodeRefs)
+            vm.visitRoot(*ref);
+
+        for (auto name : youngICNames)
+            vm.visitRoot(*name);
+
+        for (auto callee : youngCallees)
+            vm.visitRoot(*callee);
+
+        // All young objects get promoted by nursery collections
+        youngBlockKeys.clear();
+        youngDecodedKeys.clear();
+        youngDecodedVals.clear();
+        youngICNames.clear();
+        youngCallees.clear();
+        youngCodeRefs.clear();
+    }
+    else
+    {
+        for (auto& pair : versionMap)
+        {
+            for (auto version : pair.second)
+                vm.visitRoot(version->block);
+        }
+
+        for (auto& pair : decodedBlocks)
+        {
+            auto decoded = pair.second;
+            vm.visitRoot(decoded->block);
+
+            for (auto& rec : decoded->instrs)
+                vm.visitRoot(rec.val);
+        }
+
+        for (auto ic : fieldICs)
+        {
+            for (size_t i = 0; i < ic->numEntries; ++i)
+                vm.visitRoot(ic->entries[i].name);
+        }
+
+        for (auto ic : callICs)
+            vm.visitRoot(ic->callee);
+    }
+}
+
+Value execCode();
+void initJit();
+
 /// Initialize the interpreter
 void initInterp()
 {
+    vm.addRootFn(visitInterpRoots);
+
     // Allocate the code heap
-    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
-    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
-    codeHeapAlloc = codeHeap;
+    allocCodeChunk(CODE_HEAP_CHUNK_SIZE);
 
     // Allocate the stack
     stackSize = STACK_INIT_SIZE;
     stackLimit = new Value[STACK_INIT_SIZE];
-    stackBottom = stackLimit + sizeof(Word);
+    stackBottom = stackLimit + STACK_INIT_SIZE;
     stackPtr = stackBottom;
+
+#ifdef THREADED_DISPATCH
+    // Get the instruction handler addresses
+    execCode();
+#endif
+
+    // The block versioning interpreter alone is slower than the call()
+    // interpreter, which runs the code on hosts where the JIT cannot be
+    // used. The --no-jit option still selects the former.
+    if (useJit)
+    {
+#ifdef HAVE_JIT
+        initJit();
+#else
+        useJit = false;
+#endif
+        if (!useJit)
+            useCallInterp = true;
+    }
 }
 
-// TODO: do we already need a versioning context?
-// we need to manage the temp stack size?
-// can technically just use the stack top for this?
+/// Maximum number of specialized versions per block
+size_t maxVersions = 4;
 
-/// Get a version of a block. This version will be a stub
-/// until compiled
-BlockVersion* getBlockVersion(Object block)
+/// Get a version of a block for a given context. This version will
+/// be a stub until compiled. Once a block has the maximum number of
+/// specialized versions, the generic version is used instead.
+BlockVersion* getBlockVersion(Object block, const CodeGenCtx& ctx)
 {
     auto blockPtr = (refptr)block;
 
-    auto versionItr = versionMap.find((refptr)block);
+    auto versionItr = versionMap.find(blockPtr);
 
     if (versionItr == versionMap.end())
     {
         versionMap[blockPtr] = VersionList();
+        if (vm.isYoung(blockPtr))
+            youngBlockKeys.push_back(blockPtr);
     }
     else
     {
-        auto versions = versionItr->second;
-        assert (versions.size() == 1);
-        return versions[0];
+        auto& versions = versionItr->second;
+
+        for (auto version : versions)
+            if (version->ctx == ctx)
+                return version;
+
+        // Count the specialized versions
+        size_t numSpecialized = 0;
+        for (auto version : versions)
+            if (!version->ctx.isGeneric())
+                numSpecialized++;
+
+        if (numSpecialized >= maxVersions && !ctx.isGeneric())
+            return getBlockVersion(block, ctx.genericCtx());
     }
 
-    auto newVersion = new BlockVersion(block);
+    auto newVersion = new BlockVersion(block, ctx);
 
     auto& versionList = versionMap[blockPtr];
     versionList.push_back(newVersion);
@@ -1156,271 +2283,5957 @@ BlockVersion* getBlockVersion(Object block)
     return newVersion;
 }
 
-void compile(BlockVersion* version)
+/// Get the version of a function entry block used by calls
+BlockVersion* getEntryVersion(Object block, size_t numParams, size_t numLocals)
 {
-    std::cout << "compiling version" << std::endl;
+    auto versionItr = versionMap.find((refptr)block);
 
-    auto block = version->block;
+    if (versionItr != versionMap.end())
+    {
+        for (auto version : versionItr->second)
+            if (version->isEntry)
+                return version;
+    }
+
+    auto ctx = CodeGenCtx::entry(numParams, numLocals);
+    auto version = getBlockVersion(block, ctx);
+    version->isEntry = true;
+
+    return version;
+}
+
+#ifdef THREADED_DISPATCH
+
+/// Addresses of the instruction handlers in execCode, indexed by opcode
+void** opHandlers = nullptr;
+
+#define OP_CASE(op) op##_handler:
+#define OP_NEXT() goto *readCode<void*>()
 
-    // Block name icache, for debugging
-    //if (block.hasField("name"))
-    //{
-    //    auto name = (String)
+#else
 
+#define OP_CASE(op) case op:
+#define OP_NEXT() break
+
+#endif
+
+/// Write an opcode to the code heap. With threaded dispatch, the
+/// address of the instruction handler is written instead.
+void writeOp(Opcode op)
+{
+#ifdef THREADED_DISPATCH
+    assert (opHandlers && opHandlers[op]);
+    writeCode(opHandlers[op]);
+#else
+    writeCode(op);
+#endif
+}
 
+/// Write a heap value to the code heap, making it visible to the GC
+Value* writeCodeVal(Value val)
+{
+    auto valPtr = writeCode(val);
+    if (val.isPointer() && vm.isYoung(val.getWord().ptr))
+        youngCodeRefs.push_back(valPtr);
+    return valPtr;
+}
 
+void compile(BlockVersion* version)
+{
+    auto block = version->block;
 
     // Get the instructions array
     static ICache instrsIC("instrs");
     Array instrs = instrsIC.getArr(block);
+    auto numInstrs = instrs.length();
+
+    if (numInstrs == 0)
+    {
+        throw RunError("target basic block is empty");
+    }
+
+    // Context at the current position in the block
+    auto ctx = version->ctx;
+
+    // Start of the last instruction written if it only pushes a value,
+    // and the value does not need to be visible to the GC. Such
+    // instructions are removed rather than followed by a pop.
+    uint8_t* lastPushPtr = nullptr;
+
+    // Flag set if the last instruction pushed an int64 constant,
+    // and the value of the last int64 constant pushed
+    bool lastPushInt = false;
+    int64_t pushIntVal = 0;
+
+    auto popPushed = [&lastPushPtr]()
+    {
+        if (lastPushPtr)
+            codeHeapAlloc = lastPushPtr;
+        else
+            writeOp(POP);
+    };
+
+    // The code of a version is contiguous, since the interpreter runs
+    // it from start to end
+    reserveCode(numInstrs * MAX_INSTR_CODE_SIZE);
 
     // Mark the block start
     version->startPtr = codeHeapAlloc;
+    versionStarts[version->startPtr] = version;
 
     // For each instruction
-    for (size_t i = 0; i < instrs.length(); ++i)
+    for (size_t i = 0; i < numInstrs; ++i)
     {
         auto instrVal = instrs.getElem(i);
         assert (instrVal.isObject());
         auto instr = (Object)instrVal;
 
-        static ICache opIC("op");
-        auto op = (std::string)opIC.getStr(instr);
-
-        std::cout << "op: " << op << std::endl;
-
-        if (op == "push")
-        {
-            static ICache valIC("val");
-            auto val = valIC.getField(instr);
-            writeCode(PUSH);
-            writeCode(val);
-            continue;
-        }
+        auto op = decode(instr);
 
-        if (op == "dup")
+        if ((op == JUMP || op == IF_TRUE || op == CALL) && i + 1 != numInstrs)
         {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt64(instr);
-            writeCode(DUP);
-            writeCode(idx);
-            continue;
+            throw RunError(
+                "only the last instruction in a block can be a branch ("
+                "instrIdx=" + std::to_string(i + 1) + ", " +
+                "numInstrs=" + std::to_string(numInstrs) + ")"
+            );
         }
 
-        if (op == "sub_i64")
-        {
-            writeCode(SUB_I64);
-            continue;
-        }
+        uint8_t* pushPtr = nullptr;
+        bool pushInt = false;
 
-        if (op == "gt_i64")
+        switch (op)
         {
-            writeCode(GT_I64);
-            continue;
-        }
+            case GET_LOCAL:
+            case SET_LOCAL:
+            {
+                static ICache idxIC("idx");
+                auto idx = idxIC.getInt64(instr);
 
-        if (op == "jump")
-        {
-            static ICache toIC("to");
-            auto dstBB = toIC.getObj(instr);
+                if (idx < 0 || idx >= ctx.numLocals())
+                    throw RunError("invalid local variable index");
 
-            auto dstVer = getBlockVersion(dstBB);
+                if (op == GET_LOCAL)
+                {
+                    pushPtr = codeHeapAlloc;
 
-            writeCode(JUMP);
-            writeCode(dstVer);
+                    CodeGenCtx::Slot slot;
+                    slot.tag = ctx.locals[idx];
+                    slot.srcLocal = idx;
+                    ctx.push(slot);
+                }
+                else
+                {
+                    ctx.setLocal(idx, ctx.pop().tag);
+                }
 
-            continue;
-        }
+                writeOp(op);
+                writeCode((uint32_t)idx);
+            }
+            break;
 
-        if (op == "if_true")
-        {
-            static ICache thenIC("then");
-            static ICache elseIC("else");
-            auto thenBB = thenIC.getObj(instr);
-            auto elseBB = elseIC.getObj(instr);
-            auto thenVer = getBlockVersion(thenBB);
-            auto elseVer = getBlockVersion(elseBB);
+            case PUSH:
+            {
+                static ICache valIC("val");
+                auto val = valIC.getField(instr);
+
+                if (!val.isPointer())
+                    pushPtr = codeHeapAlloc;
+                pushInt = val.isInt64();
+                pushIntVal = val.getWord().int64;
+
+                CodeGenCtx::Slot slot;
+                slot.tag = val.getTag();
+                if (val.isBool())
+                    slot.boolVal = (val == Value::TRUE);
+                ctx.push(slot);
+
+                writeOp(op);
+                writeCodeVal(val);
+            }
+            break;
 
-            writeCode(IF_TRUE);
-            writeCode(thenVer);
-            writeCode(elseVer);
+            case POP:
+            ctx.pop();
+            popPushed();
+            break;
 
-            continue;
-        }
+            case DUP:
+            {
+                static ICache idxIC("idx");
+                auto idx = idxIC.getInt64(instr);
+                pushPtr = codeHeapAlloc;
+                ctx.push(ctx.get(idx));
+                writeOp(op);
+                writeCode((uint32_t)idx);
+            }
+            break;
 
-        if (op == "ret")
-        {
-            writeCode(RET);
-            continue;
+            case SWAP:
+            {
+                auto slot0 = ctx.pop();
+                auto slot1 = ctx.pop();
+                ctx.push(slot0);
+                ctx.push(slot1);
+                writeOp(op);
+            }
+            break;
+
+            // Integer operations skip the operand type checks when
+            // both operands are known to be int64 values. A right
+            // operand just pushed from a constant or a local variable
+            // is read directly by the register form of the operation.
+            // The opcode variants are all in the same order.
+            case ADD_I64:
+            case SUB_I64:
+            case MUL_I64:
+            case LT_I64:
+            case LE_I64:
+            case GT_I64:
+            case GE_I64:
+            case EQ_I64:
+            {
+                auto arg1 = ctx.pop();
+                auto arg0 = ctx.pop();
+
+                if (lastPushPtr && lastPushInt)
+                {
+                    popPushed();
+                    writeOp((Opcode)(op - ADD_I64 + ADD_I64_IMM));
+                    writeCode(pushIntVal);
+                }
+                else if (lastPushPtr && arg1.srcLocal != -1)
+                {
+                    popPushed();
+                    writeOp((Opcode)(op - ADD_I64 + ADD_I64_LOC));
+                    writeCode((uint32_t)arg1.srcLocal);
+                }
+                else if (arg0.tag == TAG_INT64 && arg1.tag == TAG_INT64)
+                {
+                    writeOp((Opcode)(op - ADD_I64 + ADD_I64_UNCHECKED));
+                }
+                else
+                {
+                    writeOp(op);
+                }
+
+                // Past this point, the operands are int64 values
+                if (arg0.srcLocal != -1)
+                    ctx.refineLocal(arg0.srcLocal, TAG_INT64);
+                if (arg1.srcLocal != -1)
+                    ctx.refineLocal(arg1.srcLocal, TAG_INT64);
+
+                bool isArith = (op == ADD_I64 || op == SUB_I64 || op == MUL_I64);
+                ctx.push(isArith? TAG_INT64:TAG_BOOL);
+            }
+            break;
+
+            case STR_LEN:
+            ctx.pop();
+            ctx.push(TAG_INT64);
+            writeOp(op);
+            break;
+
+            case GET_CHAR:
+            case STR_CAT:
+            ctx.pop(2);
+            ctx.push(TAG_STRING);
+            writeOp(op);
+            break;
+
+            case GET_CHAR_CODE:
+            case STR_CMP:
+            ctx.pop(2);
+            ctx.push(TAG_INT64);
+            writeOp(op);
+            break;
+
+            case STR_SLICE:
+            ctx.pop(3);
+            ctx.push(TAG_STRING);
+            writeOp(op);
+            break;
+
+            case STR_FIND:
+            ctx.pop(3);
+            ctx.push(TAG_INT64);
+            writeOp(op);
+            break;
+
+            case STR_TO_I64:
+            ctx.pop();
+            ctx.push(TAG_UNKNOWN);
+            writeOp(op);
+            break;
+
+            case I64_TO_STR:
+            ctx.pop();
+            ctx.push(TAG_STRING);
+            writeOp(op);
+            break;
+
+            case EQ_STR:
+            case EQ_OBJ:
+            case EQ_BOOL:
+            ctx.pop(2);
+            ctx.push(TAG_BOOL);
+            writeOp(op);
+            break;
+
+            case NEW_OBJECT:
+            ctx.pop();
+            ctx.push(TAG_OBJECT);
+            writeOp(op);
+            break;
+
+            case HAS_FIELD:
+            case SET_FIELD:
+            case GET_FIELD:
+            if (op == SET_FIELD)
+            {
+                ctx.pop(3);
+            }
+            else
+            {
+                ctx.pop(2);
+                ctx.push(op == HAS_FIELD? TAG_BOOL:TAG_UNKNOWN);
+            }
+            writeOp(op);
+            writeCode(getFieldIC(instr));
+            break;
+
+            case NEW_ARRAY:
+            ctx.pop();
+            ctx.push(TAG_ARRAY);
+            writeOp(op);
+            break;
+
+            case ARRAY_LEN:
+            ctx.pop();
+            ctx.push(TAG_INT64);
+            writeOp(op);
+            break;
+
+            case ARRAY_PUSH:
+            ctx.pop(2);
+            writeOp(op);
+            break;
+
+            case SET_ELEM:
+            ctx.pop(3);
+            writeOp(op);
+            break;
+
+            case GET_ELEM:
+            ctx.pop(2);
+            ctx.push(TAG_UNKNOWN);
+            writeOp(op);
+            break;
+
+            // Tag tests on values of known types are evaluated
+            // at compilation time
+            case HAS_TAG:
+            {
+                static ICache tagIC("tag");
+                auto testTag = tagFromStr(tagIC.getStr(instr));
+                auto arg = ctx.pop();
+
+                CodeGenCtx::Slot slot;
+                slot.tag = TAG_BOOL;
+
+                switch (arg.tag)
+                {
+                    case TAG_UNDEF:
+                    case TAG_BOOL:
+                    case TAG_INT64:
+                    case TAG_STRING:
+                    case TAG_ARRAY:
+                    case TAG_OBJECT:
+                    {
+                        auto result = (arg.tag == testTag);
+                        popPushed();
+                        pushPtr = codeHeapAlloc;
+                        slot.boolVal = result;
+                        writeOp(PUSH);
+                        writeCode(result? Value::TRUE:Value::FALSE);
+                    }
+                    break;
+
+                    default:
+                    {
+                        if (testTag != TAG_NONE)
+                        {
+                            slot.testLocal = arg.srcLocal;
+                            slot.testTag = testTag;
+                        }
+
+                        writeOp(op);
+                        writeCode(testTag);
+                    }
+                }
+
+                ctx.push(slot);
+            }
+            break;
+
+            case JUMP:
+            {
+                static ICache toIC("to");
+                auto dstBB = toIC.getObj(instr);
+                writeOp(op);
+                writeCode(getBlockVersion(dstBB, ctx.exitCtx()));
+            }
+            break;
+
+            // Branches on known values become jumps, and the type
+            // tested by has_tag is known in the true branch
+            case IF_TRUE:
+            {
+                static ICache thenIC("then");
+                static ICache elseIC("else");
+                auto thenBB = thenIC.getObj(instr);
+                auto elseBB = elseIC.getObj(instr);
+
+                auto cond = ctx.pop();
+
+                if (cond.boolVal != -1)
+                {
+                    popPushed();
+                    writeOp(JUMP);
+                    writeCode(getBlockVersion(
+                        cond.boolVal? thenBB:elseBB,
+                        ctx.exitCtx()
+                    ));
+                    break;
+                }
+
+                auto thenCtx = ctx;
+                if (cond.testLocal != -1)
+                    thenCtx.refineLocal(cond.testLocal, cond.testTag);
+
+                writeOp(op);
+                writeCode(getBlockVersion(thenBB, thenCtx.exitCtx()));
+                writeCode(getBlockVersion(elseBB, ctx.exitCtx()));
+            }
+            break;
+
+            // The return block address is written last, since the
+            // address of this field is the return address of the call
+            case CALL:
+            {
+                static ICache numArgsIC("num_args");
+                static ICache retToIC("ret_to");
+                auto numArgs = numArgsIC.getInt64(instr);
+                auto retToBB = retToIC.getObj(instr);
+
+                // Pop the callee and arguments, the return value
+                // type is not known
+                ctx.pop(numArgs + 1);
+                ctx.push(TAG_UNKNOWN);
+
+                writeOp(op);
+                writeCode((uint32_t)numArgs);
+                writeCodeVal(instr);
+                writeCode(newCallIC());
+                writeCode(getBlockVersion(retToBB, ctx.exitCtx()));
+            }
+            break;
+
+            case RET:
+            writeOp(op);
+            writeCode(ctx.numLocals());
+            break;
+
+            case IMPORT:
+            ctx.pop();
+            ctx.push(TAG_UNKNOWN);
+            writeOp(op);
+            break;
+
+            case ABORT:
+            ctx.pop();
+            writeOp(op);
+            writeCodeVal(instr);
+            break;
+
+            default:
+            assert (false && "unhandled op in compile");
+        }
+
+        lastPushPtr = pushPtr;
+        lastPushInt = pushInt;
+    }
+
+    auto lastOp = decode(instrs.getElem(numInstrs - 1));
+    if (lastOp != JUMP && lastOp != IF_TRUE && lastOp != CALL &&
+        lastOp != RET && lastOp != ABORT)
+    {
+        throw RunError("basic block does not end with a branch");
+    }
+
+    // Mark the block end
+    version->endPtr = codeHeapAlloc;
+    assert (version->endPtr <= codeHeapLimit);
+}
+
+/// Get the code address of a branch target. Targets which are not
+/// compiled yet point to their block version, and the branch gets
+/// patched once the target is compiled.
+uint8_t* getTargetAddr(uint8_t*& dstAddr)
+{
+    if (!inCodeHeap(dstAddr))
+    {
+        auto dstVer = (BlockVersion*)dstAddr;
+        if (!dstVer->startPtr)
+            compile(dstVer);
+
+        // Patch the branch
+        dstAddr = dstVer->startPtr;
+    }
+
+    return dstAddr;
+}
+
+#ifdef HAVE_JIT
+
+/// Count an entry into a block version by the interpreter, and test
+/// if the version should now run in JIT code
+ALWAYS_INLINE bool countEntry(BlockVersion* version)
+{
+    if (version->hotCount < jitThreshold)
+    {
+        version->hotCount++;
+        return false;
+    }
+
+    return true;
+}
+
+Value runJit(uint8_t* entryAddr);
+uint8_t* getJitCode(BlockVersion* version);
+uint8_t* jitOsr(BlockVersion* version);
+
+#endif
+
+/// Get the code address of a branch target for the interpreter. When
+/// the JIT is used, branches to blocks already compiled, which include
+/// the back edges of loops, are left unpatched so that the entries into
+/// their target get counted. Null is returned once the target is hot
+/// and has been translated.
+ALWAYS_INLINE uint8_t* getBranchAddr(uint8_t*& dstAddr)
+{
+    if (inCodeHeap(dstAddr))
+        return dstAddr;
+
+#ifdef HAVE_JIT
+    auto dstVer = (BlockVersion*)dstAddr;
+    if (useJit && dstVer->startPtr)
+    {
+        if (countEntry(dstVer) && getJitCode(dstVer))
+            return nullptr;
+        return dstVer->startPtr;
+    }
+#endif
+
+    return getTargetAddr(dstAddr);
+}
+
+/// Start/continue execution beginning at a current instruction
+Value execCode()
+{
+#ifdef THREADED_DISPATCH
+    // The first call only publishes the handler addresses
+    if (!opHandlers)
+    {
+        static void* handlers[NUM_OPCODES] = {};
+
+        #define SET_HANDLER(op) handlers[op] = &&op##_handler
+        SET_HANDLER(GET_LOCAL);
+        SET_HANDLER(SET_LOCAL);
+        SET_HANDLER(PUSH);
+        SET_HANDLER(POP);
+        SET_HANDLER(DUP);
+        SET_HANDLER(SWAP);
+        SET_HANDLER(ADD_I64);
+        SET_HANDLER(SUB_I64);
+        SET_HANDLER(MUL_I64);
+        SET_HANDLER(LT_I64);
+        SET_HANDLER(LE_I64);
+        SET_HANDLER(GT_I64);
+        SET_HANDLER(GE_I64);
+        SET_HANDLER(EQ_I64);
+        SET_HANDLER(ADD_I64_UNCHECKED);
+        SET_HANDLER(SUB_I64_UNCHECKED);
+        SET_HANDLER(MUL_I64_UNCHECKED);
+        SET_HANDLER(LT_I64_UNCHECKED);
+        SET_HANDLER(LE_I64_UNCHECKED);
+        SET_HANDLER(GT_I64_UNCHECKED);
+        SET_HANDLER(GE_I64_UNCHECKED);
+        SET_HANDLER(EQ_I64_UNCHECKED);
+        SET_HANDLER(ADD_I64_IMM);
+        SET_HANDLER(SUB_I64_IMM);
+        SET_HANDLER(MUL_I64_IMM);
+        SET_HANDLER(LT_I64_IMM);
+        SET_HANDLER(LE_I64_IMM);
+        SET_HANDLER(GT_I64_IMM);
+        SET_HANDLER(GE_I64_IMM);
+        SET_HANDLER(EQ_I64_IMM);
+        SET_HANDLER(ADD_I64_LOC);
+        SET_HANDLER(SUB_I64_LOC);
+        SET_HANDLER(MUL_I64_LOC);
+        SET_HANDLER(LT_I64_LOC);
+        SET_HANDLER(LE_I64_LOC);
+        SET_HANDLER(GT_I64_LOC);
+        SET_HANDLER(GE_I64_LOC);
+        SET_HANDLER(EQ_I64_LOC);
+        SET_HANDLER(STR_LEN);
+        SET_HANDLER(GET_CHAR);
+        SET_HANDLER(GET_CHAR_CODE);
+        SET_HANDLER(STR_CAT);
+        SET_HANDLER(STR_SLICE);
+        SET_HANDLER(STR_CMP);
+        SET_HANDLER(STR_FIND);
+        SET_HANDLER(STR_TO_I64);
+        SET_HANDLER(I64_TO_STR);
+        SET_HANDLER(EQ_STR);
+        SET_HANDLER(NEW_OBJECT);
+        SET_HANDLER(HAS_FIELD);
+        SET_HANDLER(SET_FIELD);
+        SET_HANDLER(GET_FIELD);
+        SET_HANDLER(EQ_OBJ);
+        SET_HANDLER(NEW_ARRAY);
+        SET_HANDLER(ARRAY_LEN);
+        SET_HANDLER(ARRAY_PUSH);
+        SET_HANDLER(SET_ELEM);
+        SET_HANDLER(GET_ELEM);
+        SET_HANDLER(EQ_BOOL);
+        SET_HANDLER(HAS_TAG);
+        SET_HANDLER(JUMP);
+        SET_HANDLER(IF_TRUE);
+        SET_HANDLER(CALL);
+        SET_HANDLER(RET);
+        SET_HANDLER(IMPORT);
+        SET_HANDLER(ABORT);
+        SET_HANDLER(JIT_RETURN);
+        #undef SET_HANDLER
+
+        opHandlers = handlers;
+        return Value::UNDEF;
+    }
+#endif
+
+    assert (inCodeHeap(instrPtr));
+
+    static ICache entryIC("entry");
+
+#ifdef THREADED_DISPATCH
+    // Jump to the handler of the first instruction. Each handler
+    // then jumps directly to the handler of the next instruction.
+    OP_NEXT();
+    {
+        {
+#else
+    // For each instruction to execute
+    for (;;)
+    {
+        switch (readCode<Opcode>())
+        {
+#endif
+            // Read a local variable and push it on the stack
+            OP_CASE(GET_LOCAL)
+            {
+                auto idx = readCode<uint32_t>();
+                pushVal(basePtr[-(ptrdiff_t)idx]);
+            }
+            OP_NEXT();
+
+            // Set a local variable
+            OP_CASE(SET_LOCAL)
+            {
+                auto idx = readCode<uint32_t>();
+                basePtr[-(ptrdiff_t)idx] = popVal();
+            }
+            OP_NEXT();
+
+            OP_CASE(PUSH)
+            {
+                auto val = readCode<Value>();
+                pushVal(val);
+            }
+            OP_NEXT();
+
+            OP_CASE(POP)
+            {
+                popVal();
+            }
+            OP_NEXT();
+
+            // Duplicate a value on the stack
+            OP_CASE(DUP)
+            {
+                // Read the index of the value to duplicate
+                auto idx = readCode<uint32_t>();
+
+                if (stackPtr + idx >= stackBottom)
+                    throw RunError("stack undeflow, invalid index for dup");
+
+                auto val = stackPtr[idx];
+                pushVal(val);
+            }
+            OP_NEXT();
+
+            // Swap the topmost two stack elements
+            OP_CASE(SWAP)
+            {
+                auto v0 = popVal();
+                auto v1 = popVal();
+                pushVal(v0);
+                pushVal(v1);
+            }
+            OP_NEXT();
+
+            //
+            // 64-bit integer operations
+            //
+
+            OP_CASE(ADD_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 + arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(SUB_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 - arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(MUL_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 * arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(LT_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 < arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(LE_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 <= arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(GT_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 > arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(GE_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 >= arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 == arg1);
+            }
+            OP_NEXT();
+
+            // The operands of the unchecked integer operations are
+            // known to be int64 values
+            OP_CASE(ADD_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = Value(arg0 + arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(SUB_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = Value(arg0 - arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(MUL_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = Value(arg0 * arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(LT_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = (arg0 < arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(LE_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = (arg0 <= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GT_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = (arg0 > arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GE_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = (arg0 >= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_I64_UNCHECKED)
+            {
+                auto arg1 = stackPtr[0].getWord().int64;
+                auto arg0 = stackPtr[1].getWord().int64;
+                stackPtr++;
+                stackPtr[0] = (arg0 == arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            // The register forms operate on the top of the stack in
+            // place, and read their right operand from the code stream
+            // or from the frame
+            OP_CASE(ADD_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 + arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(SUB_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 - arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(MUL_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 * arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(LT_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 < arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(LE_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 <= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GT_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 > arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GE_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 >= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_I64_IMM)
+            {
+                auto arg1 = readCode<int64_t>();
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 == arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(ADD_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 + arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(SUB_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 - arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(MUL_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = Value(arg0 * arg1);
+            }
+            OP_NEXT();
+
+            OP_CASE(LT_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 < arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(LE_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 <= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GT_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 > arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(GE_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 >= arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_I64_LOC)
+            {
+                auto arg1 = localInt64(readCode<uint32_t>());
+                auto arg0 = topInt64();
+                stackPtr[0] = (arg0 == arg1)? Value::TRUE:Value::FALSE;
+            }
+            OP_NEXT();
+
+            //
+            // String operations
+            //
+
+            OP_CASE(STR_LEN)
+            {
+                auto str = popStr();
+                pushVal(str.length());
+            }
+            OP_NEXT();
+
+            OP_CASE(GET_CHAR)
+            {
+                auto idx = (size_t)popInt64();
+                auto str = popStr();
+
+                if (idx >= str.length())
+                {
+                    throw RunError(
+                        "get_char, index out of bounds"
+                    );
+                }
+
+                auto ch = str[idx];
+
+                // Cache single-character strings
+                if (charStrings[ch] == Value::FALSE)
+                {
+                    char buf[2] = { (char)str[idx], '\0' };
+                    charStrings[ch] = String(buf);
+                }
+
+                pushVal(charStrings[ch]);
+            }
+            OP_NEXT();
+
+            OP_CASE(GET_CHAR_CODE)
+            {
+                auto idx = (size_t)popInt64();
+                auto str = popStr();
+
+                if (idx >= str.length())
+                {
+                    throw RunError(
+                        "get_char_code, index out of bounds"
+                    );
+                }
+
+                pushVal((int64_t)str[idx]);
+            }
+            OP_NEXT();
+
+            OP_CASE(STR_CAT)
+            {
+                auto a = popStr();
+                auto b = popStr();
+                pushVal(String::concat(b, a));
+            }
+            OP_NEXT();
+
+            OP_CASE(STR_SLICE)
+            {
+                auto end = popInt64();
+                auto start = popInt64();
+                auto str = popStr();
+
+                if (start < 0 || start > end || end > str.length())
+                {
+                    throw RunError(
+                        "str_slice, index out of bounds"
+                    );
+                }
+
+                pushVal(String::slice(str, start, end));
+            }
+            OP_NEXT();
+
+            OP_CASE(STR_CMP)
+            {
+                auto arg1 = popStr();
+                auto arg0 = popStr();
+                auto cmp = String::compare(arg0, arg1);
+                pushVal(Value((int64_t)((cmp > 0) - (cmp < 0))));
+            }
+            OP_NEXT();
+
+            OP_CASE(STR_FIND)
+            {
+                auto startIdx = popInt64();
+                auto sub = popStr();
+                auto str = popStr();
+
+                if (startIdx < 0)
+                {
+                    throw RunError(
+                        "str_find, negative start index"
+                    );
+                }
+
+                pushVal(Value(str.find(sub, startIdx)));
+            }
+            OP_NEXT();
+
+            OP_CASE(STR_TO_I64)
+            {
+                auto str = popStr();
+
+                int64_t val;
+                if (parseInt64(str, val))
+                    pushVal(Value(val));
+                else
+                    pushVal(Value::FALSE);
+            }
+            OP_NEXT();
+
+            OP_CASE(I64_TO_STR)
+            {
+                auto val = popInt64();
+                pushVal(String(std::to_string(val)));
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_STR)
+            {
+                auto arg1 = popStr();
+                auto arg0 = popStr();
+                pushBool(arg0 == arg1);
+            }
+            OP_NEXT();
+
+            //
+            // Object operations
+            //
+
+            OP_CASE(NEW_OBJECT)
+            {
+                auto capacity = popInt64();
+                pushVal(Object::newObject(capacity));
+            }
+            OP_NEXT();
+
+            OP_CASE(HAS_FIELD)
+            {
+                auto ic = readCode<FieldIC*>();
+                auto fieldName = popStr();
+                auto obj = popObj();
+                Value val;
+                pushBool(lookupField(ic, obj, fieldName, val));
+            }
+            OP_NEXT();
+
+            OP_CASE(SET_FIELD)
+            {
+                auto ic = readCode<FieldIC*>();
+                auto val = popVal();
+                auto fieldName = popStr();
+                auto obj = popObj();
+                storeField(ic, obj, fieldName, val);
+            }
+            OP_NEXT();
+
+            // This instruction will abort execution if trying to
+            // access a field that is not present on an object.
+            // The running program is responsible for testing that
+            // fields exist before attempting to read them.
+            OP_CASE(GET_FIELD)
+            {
+                auto ic = readCode<FieldIC*>();
+                auto fieldName = popStr();
+                auto obj = popObj();
+
+                Value val;
+                if (!lookupField(ic, obj, fieldName, val))
+                {
+                    throw RunError(
+                        "get_field failed, missing field \"" +
+                        (std::string)fieldName + "\""
+                    );
+                }
+
+                pushVal(val);
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_OBJ)
+            {
+                Value arg1 = popVal();
+                Value arg0 = popVal();
+                pushBool(arg0 == arg1);
+            }
+            OP_NEXT();
+
+            //
+            // Array operations
+            //
+
+            OP_CASE(NEW_ARRAY)
+            {
+                auto len = popInt64();
+                pushVal(Array(len));
+            }
+            OP_NEXT();
+
+            OP_CASE(ARRAY_LEN)
+            {
+                auto arr = Array(popVal());
+                pushVal(arr.length());
+            }
+            OP_NEXT();
+
+            OP_CASE(ARRAY_PUSH)
+            {
+                auto val = popVal();
+                auto arr = Array(popVal());
+                arr.push(val);
+            }
+            OP_NEXT();
+
+            OP_CASE(SET_ELEM)
+            {
+                auto val = popVal();
+                auto idx = (size_t)popInt64();
+                auto arr = Array(popVal());
+
+                if (idx >= arr.length())
+                {
+                    throw RunError(
+                        "set_elem, index out of bounds"
+                    );
+                }
+
+                arr.setElem(idx, val);
+            }
+            OP_NEXT();
+
+            OP_CASE(GET_ELEM)
+            {
+                auto idx = (size_t)popInt64();
+                auto arr = Array(popVal());
+
+                if (idx >= arr.length())
+                {
+                    throw RunError(
+                        "get_elem, index out of bounds"
+                    );
+                }
+
+                pushVal(arr.getElem(idx));
+            }
+            OP_NEXT();
+
+            OP_CASE(EQ_BOOL)
+            {
+                auto arg1 = popBool();
+                auto arg0 = popBool();
+                pushBool(arg0 == arg1);
+            }
+            OP_NEXT();
+
+            // Test if a value has a given tag
+            OP_CASE(HAS_TAG)
+            {
+                auto testTag = readCode<Tag>();
+                auto tag = popVal().getTag();
+
+                switch (tag)
+                {
+                    case TAG_UNDEF:
+                    case TAG_BOOL:
+                    case TAG_INT64:
+                    case TAG_STRING:
+                    case TAG_ARRAY:
+                    case TAG_OBJECT:
+                    pushBool(tag == testTag);
+                    break;
+
+                    default:
+                    throw RunError(
+                        "unknown value type in has_tag"
+                    );
+                }
+            }
+            OP_NEXT();
+
+            OP_CASE(JUMP)
+            {
+                auto& dstAddr = readCode<uint8_t*>();
+                instrPtr = getBranchAddr(dstAddr);
+
+#ifdef HAVE_JIT
+                // Hot loops continue in JIT code until the function
+                // returns, and top-level functions return from here
+                if (!instrPtr)
+                {
+                    instrPtr = jitOsr((BlockVersion*)dstAddr);
+                    if (!instrPtr)
+                        return stackPtr[0];
+                }
+#endif
+
+                // Block entry is a GC safepoint
+                vm.safepoint();
+            }
+            OP_NEXT();
+
+            OP_CASE(IF_TRUE)
+            {
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg0 = popVal();
+
+                auto& dstAddr = (arg0 == Value::TRUE)? thenAddr:elseAddr;
+                instrPtr = getBranchAddr(dstAddr);
+
+#ifdef HAVE_JIT
+                if (!instrPtr)
+                {
+                    instrPtr = jitOsr((BlockVersion*)dstAddr);
+                    if (!instrPtr)
+                        return stackPtr[0];
+                }
+#endif
+
+                vm.safepoint();
+            }
+            OP_NEXT();
+
+            // Regular function call
+            OP_CASE(CALL)
+            {
+                auto numArgs = readCode<uint32_t>();
+                auto& instrVal = readCode<Value>();
+                auto ic = readCode<CallIC*>();
+                auto& retAddr = readCode<uint8_t*>();
+
+                auto callee = popVal();
+
+                if (stackPtr + numArgs > stackBottom)
+                {
+                    throw RunError(
+                        "stack underflow at call"
+                    );
+                }
+
+                // On a cache miss, check the callee and compile its
+                // entry block
+                if (callee != ic->callee)
+                {
+                    fillCallIC(ic, callee, numArgs, instrVal);
+
+                    if (!ic->hostFn)
+                    {
+                        auto entryVer = getEntryVersion(
+                            entryIC.getObj(callee),
+                            numArgs,
+                            ic->numLocals
+                        );
+
+                        if (!entryVer->startPtr)
+                            compile(entryVer);
+                        ic->entryVer = entryVer;
+                        ic->entryAddr = entryVer->startPtr;
+                    }
+
+                    ic->setCallee(callee);
+                }
+
+#ifdef HAVE_JIT
+                // Hot callees run in JIT code, and return here as host
+                // functions do
+                if (ic->entryAddr && useJit && countEntry(ic->entryVer) &&
+                    getJitCode(ic->entryVer))
+                {
+                    basePtr = pushFrame(
+                        callee,
+                        numArgs,
+                        ic->numLocals,
+                        nullptr
+                    );
+
+                    runJit(ic->entryVer->jitPtr);
+                    instrPtr = getTargetAddr(retAddr);
+                }
+                else
+#endif
+                if (ic->entryAddr)
+                {
+                    // The return address is that of the return block
+                    // field, so that the return branch can be patched
+                    basePtr = pushFrame(
+                        callee,
+                        numArgs,
+                        ic->numLocals,
+                        (uint8_t*)&retAddr
+                    );
+
+                    instrPtr = ic->entryAddr;
+                }
+                else
+                {
+                    auto retVal = callHostFn(ic->hostFn, numArgs);
+                    stackPtr += numArgs;
+                    pushVal(retVal);
+
+                    // Jump to the return basic block
+                    instrPtr = getTargetAddr(retAddr);
+                }
+
+                vm.safepoint();
+            }
+            OP_NEXT();
+
+            OP_CASE(RET)
+            {
+                auto numLocals = readCode<uint32_t>();
+
+                // Pop the return value
+                auto val = popVal();
+
+                // Get the return address and caller base pointer
+                auto retAddr = (uint8_t**)basePtr[-(ptrdiff_t)numLocals - 1].getWord().ptr;
+                auto prevBasePtr = (Value*)basePtr[-(ptrdiff_t)numLocals].getWord().ptr;
+
+                // Pop the frame, including the arguments
+                stackPtr = basePtr + 1;
+                basePtr = prevBasePtr;
+
+                pushVal(val);
+
+                // If this is a top-level return
+                if (retAddr == nullptr)
+                    return val;
+
+                instrPtr = getTargetAddr(*retAddr);
+                vm.safepoint();
+            }
+            OP_NEXT();
+
+            OP_CASE(IMPORT)
+            {
+                auto pkgName = (std::string)popStr();
+                pushVal(import(pkgName));
+            }
+            OP_NEXT();
+
+            OP_CASE(ABORT)
+            {
+                auto instr = Object(readCode<Value>());
+                auto errMsg = (std::string)popStr();
+
+                // If a source position was specified
+                if (instr.hasField("src_pos"))
+                {
+                    auto srcPos = instr.getField("src_pos");
+                    std::cout << posToString(srcPos) << " - ";
+                }
+
+                if (errMsg != "")
+                {
+                    std::cout << "aborting execution due to error: ";
+                    std::cout << errMsg << std::endl;
+                }
+                else
+                {
+                    std::cout << "aborting execution due to error" << std::endl;
+                }
+
+                exit(-1);
+            }
+            OP_NEXT();
+
+            OP_CASE(JIT_RETURN)
+            {
+                return Value::UNDEF;
+            }
+            OP_NEXT();
+
+#ifndef THREADED_DISPATCH
+            default:
+            assert (false && "unhandled instruction in interpreter loop");
+#endif
+        }
+
+    }
+
+    assert (false);
+}
+
+//============================================================================
+// Baseline JIT
+//============================================================================
+
+#ifdef HAVE_JIT
+
+/// Size of the address range reserved for the JIT heap. JIT code
+/// branches with 32-bit displacements, so the whole heap is kept in
+/// one range within their reach.
+const size_t JIT_HEAP_MAX_SIZE = 1 << 30;
+
+/// Size of the chunks of executable memory the JIT heap grows by
+const size_t JIT_CHUNK_SIZE = 1 << 24;
+
+/// Number of deoptimizations after which optimized code is discarded
+const uint32_t DEOPT_THRESHOLD = 100;
+
+/// Number of times the optimized code of a version can be discarded
+/// before the version keeps its baseline code. The code discarded is
+/// not reclaimed, this bounds the JIT heap space it takes.
+const uint32_t MAX_REOPTIMIZATIONS = 4;
+
+/// Maximum number of successor versions compiled into optimized code
+const size_t MAX_CHAINED_VERSIONS = 8;
+
+/// Maximum number of callee instructions inlined at a call site, and
+/// depth of the calls inlined into inlined code
+const size_t MAX_INLINED_INSTRS = 32;
+const size_t MAX_INLINE_DEPTH = 2;
+
+/// Constant array indices read inline by optimized code are below this
+const int64_t MAX_CONST_ELEM_IDX = 1 << 24;
+
+/// Baseline JIT code of each instruction, by address of the instruction
+/// in the code heap. Optimized code deoptimizes to these addresses.
+std::unordered_map<uint8_t*, uint8_t*> baseOpAddrs;
+
+/// Executable memory into which native code gets written
+uint8_t* jitHeap = nullptr;
+
+/// Limit pointer for the chunks of the JIT heap mapped so far, and
+/// end of the address range reserved for it
+uint8_t* jitHeapLimit = nullptr;
+uint8_t* jitHeapEnd = nullptr;
+
+/// Current allocation pointer in the JIT heap
+uint8_t* jitAlloc = nullptr;
+
+/// Flag set once the JIT heap cannot grow. Versions not translated
+/// by then stay in the interpreter.
+bool jitHeapFull = false;
+
+/// Raised when the JIT heap cannot grow, the code being translated
+/// is then discarded
+struct JitHeapFull {};
+
+/// Trampoline running JIT code from C++, until it returns from the
+/// function called, and the address JIT code jumps to to return
+void (*jitEnter)(uint8_t* entryAddr) = nullptr;
+uint8_t* jitExit = nullptr;
+
+/// Error raised by a helper called from JIT code, and the context of
+/// runJit to report it to. Exceptions are not thrown through JIT code,
+/// since it has no unwinding information.
+std::string jitErrorMsg;
+jmp_buf* jitErrorBuf = nullptr;
+
+/// Opcodes of the instruction handlers, to decode threaded code
+std::unordered_map<void*, Opcode> handlerOps;
+
+/// x86-64 general-purpose registers
+enum Reg : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/// Condition codes of the jcc and setcc instructions
+enum Cond : uint8_t
+{
+    CC_O  = 0x0,
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_S  = 0x8,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF
+};
+
+/// JIT code keeps the stack and base pointers in callee-saved
+/// registers, and writes them back to the interpreter globals, whose
+/// addresses are also kept in registers, before calling C++ code
+const Reg REG_SP = R12;
+const Reg REG_BP = R13;
+const Reg REG_SP_ADDR = R14;
+const Reg REG_BP_ADDR = R15;
+
+/// Size of stack values, and offset of the tag in a value
+const int32_t VAL_SIZE = sizeof(Value);
+const int32_t VAL_TAG = sizeof(Word);
+
+/// Number of word slots optimized code can spill registers to, in the
+/// native frame of jitEnter
+const int32_t JIT_SPILL_SLOTS = 32;
+
+/// Map the next chunk of the address range reserved for the JIT heap
+void growJitHeap()
+{
+    if (jitHeapLimit + JIT_CHUNK_SIZE > jitHeapEnd)
+        throw JitHeapFull();
+
+    auto mem = mmap(
+        jitHeapLimit,
+        JIT_CHUNK_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+        throw JitHeapFull();
+
+    jitHeapLimit += JIT_CHUNK_SIZE;
+}
+
+void jitByte(uint8_t byte)
+{
+    if (jitAlloc >= jitHeapLimit)
+        growJitHeap();
+    *(jitAlloc++) = byte;
+}
+
+template <typename T> void jitWrite(T val)
+{
+    for (size_t i = 0; i < sizeof(T); ++i)
+        jitByte(((uint8_t*)&val)[i]);
+}
+
+/// Write a REX prefix, if one is needed
+void jitRex(bool wide, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex = 0x40 | (wide? 8:0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        jitByte(rex);
+}
+
+/// Write an opcode, which may be one or two bytes long
+void jitOpcode(uint16_t opcode)
+{
+    if (opcode > 0xFF)
+        jitByte(opcode >> 8);
+    jitByte(opcode & 0xFF);
+}
+
+/// Write an instruction with register operands. The reg field may
+/// also hold an opcode extension.
+void jitRegOp(bool wide, uint16_t opcode, uint8_t reg, uint8_t rm)
+{
+    jitRex(wide, reg, rm);
+    jitOpcode(opcode);
+    jitByte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/// Write an instruction with a [base + disp] memory operand, and
+/// return the address of the displacement. The displacement is 32
+/// bits wide if it may get patched.
+uint8_t* jitMemOp(
+    bool wide,
+    uint16_t opcode,
+    uint8_t reg,
+    Reg base,
+    int32_t disp,
+    bool wideDisp = false
+)
+{
+    bool shortDisp = !wideDisp && disp >= -128 && disp <= 127;
+
+    jitRex(wide, reg, base);
+    jitOpcode(opcode);
+    jitByte((shortDisp? 0x40:0x80) | ((reg & 7) << 3) | (base & 7));
+
+    // The rsp and r12 bases need a SIB byte
+    if ((base & 7) == RSP)
+        jitByte(0x24);
+
+    auto dispPtr = jitAlloc;
+    if (shortDisp)
+        jitByte((int8_t)disp);
+    else
+        jitWrite(disp);
+
+    return dispPtr;
+}
+
+void jitMovImm(Reg dst, uint64_t imm)
+{
+    jitRex(true, 0, dst);
+    jitByte(0xB8 | (dst & 7));
+    jitWrite(imm);
+}
+
+void jitLoad(Reg dst, Reg base, int32_t disp)
+{
+    jitMemOp(true, 0x8B, dst, base, disp);
+}
+
+void jitStore(Reg base, int32_t disp, Reg src)
+{
+    jitMemOp(true, 0x89, src, base, disp);
+}
+
+void jitLea(Reg dst, Reg base, int32_t disp)
+{
+    jitMemOp(true, 0x8D, dst, base, disp);
+}
+
+/// Copy a value through xmm0, using an unaligned 16-byte move
+void jitLoadVal(Reg base, int32_t disp)
+{
+    jitMemOp(false, 0x0F10, 0, base, disp);
+}
+
+void jitStoreVal(Reg base, int32_t disp)
+{
+    jitMemOp(false, 0x0F11, 0, base, disp);
+}
+
+void jitStoreTag(Reg base, int32_t disp, Tag tag)
+{
+    jitMemOp(false, 0xC6, 0, base, disp + VAL_TAG);
+    jitByte(tag);
+}
+
+void jitCmpTag(Reg base, int32_t disp, Tag tag)
+{
+    jitMemOp(false, 0x80, 7, base, disp + VAL_TAG);
+    jitByte(tag);
+}
+
+/// Write a jump or conditional jump, and return the address of its
+/// 32-bit displacement, to be patched with jitPatch
+uint8_t* jitJmp()
+{
+    jitByte(0xE9);
+    auto site = jitAlloc;
+    jitWrite<int32_t>(0);
+    return site;
+}
+
+uint8_t* jitJcc(Cond cond)
+{
+    jitByte(0x0F);
+    jitByte(0x80 | cond);
+    auto site = jitAlloc;
+    jitWrite<int32_t>(0);
+    return site;
+}
+
+/// Set the destination of a jump
+void jitPatch(uint8_t* site, uint8_t* dst)
+{
+    auto disp = dst - (site + 4);
+    assert (disp >= INT32_MIN && disp <= INT32_MAX);
+    *(int32_t*)site = (int32_t)disp;
+}
+
+void jitJmpReg(Reg reg)
+{
+    jitRegOp(false, 0xFF, 4, reg);
+}
+
+/// Write the stack and base pointers back to the interpreter globals
+void jitSpill()
+{
+    jitStore(REG_SP_ADDR, 0, REG_SP);
+    jitStore(REG_BP_ADDR, 0, REG_BP);
+}
+
+void jitReload()
+{
+    jitLoad(REG_SP, REG_SP_ADDR, 0);
+    jitLoad(REG_BP, REG_BP_ADDR, 0);
+}
+
+/// Call a C++ helper from JIT code. The helper may change the stack
+/// and base pointers, and its return value is left in rax.
+void jitCallHelper(void* helper, uint64_t arg0, uint64_t arg1 = 0)
+{
+    jitSpill();
+    jitMovImm(RDI, arg0);
+    jitMovImm(RSI, arg1);
+    jitMovImm(RAX, (uint64_t)helper);
+    jitRegOp(false, 0xFF, 2, RAX);
+    jitReload();
+}
+
+/// Run the body of a helper called from JIT code. Errors are reported
+/// to runJit, which throws them again from C++ code.
+template <typename Fn> uint8_t* jitGuard(Fn fn)
+{
+    try
+    {
+        return fn();
+    }
+    catch (RunError& e)
+    {
+        jitErrorMsg = e.toString();
+    }
+
+    longjmp(*jitErrorBuf, 1);
+}
+
+/// Read an operand from the code stream of a block version
+template <typename T> T& jitOperand(uint8_t*& ptr)
+{
+    T* valPtr = (T*)ptr;
+    ptr += sizeof(T);
+    return *valPtr;
+}
+
+Opcode jitReadOp(uint8_t*& ptr)
+{
+#ifdef THREADED_DISPATCH
+    return handlerOps[jitOperand<void*>(ptr)];
+#else
+    return jitOperand<Opcode>(ptr);
+#endif
+}
+
+/// Read a branch target operand, which the interpreter may have
+/// patched to point to the code of the target
+BlockVersion* jitTarget(uint8_t*& ptr)
+{
+    auto dstAddr = jitOperand<uint8_t*>(ptr);
+
+    if (inCodeHeap(dstAddr))
+    {
+        assert (versionStarts.count(dstAddr));
+        return versionStarts[dstAddr];
+    }
+
+    return (BlockVersion*)dstAddr;
+}
+
+void jitCompile(BlockVersion* version);
+
+/// Get the native code of a block version, translating it if needed.
+/// Returns null once the JIT heap is full, the version is then run by
+/// the interpreter.
+uint8_t* getJitCode(BlockVersion* version)
+{
+    if (!version->startPtr)
+        compile(version);
+
+    if (!version->jitPtr && !jitHeapFull)
+    {
+        auto startAddr = jitAlloc;
+
+        try
+        {
+            jitCompile(version);
+        }
+        catch (JitHeapFull&)
+        {
+            jitAlloc = startAddr;
+            jitHeapFull = true;
+        }
+    }
+
+    return version->jitPtr;
+}
+
+/// Run the JIT code of a function whose frame has been pushed, and
+/// return the value it returns, left on top of the stack
+Value runJit(uint8_t* entryAddr)
+{
+    jmp_buf errorBuf;
+    auto prevErrorBuf = jitErrorBuf;
+    jitErrorBuf = &errorBuf;
+
+    if (setjmp(errorBuf))
+    {
+        jitErrorBuf = prevErrorBuf;
+        throw RunError(jitErrorMsg);
+    }
+
+    jitEnter(entryAddr);
+
+    jitErrorBuf = prevErrorBuf;
+    return stackPtr[0];
+}
+
+/// Continue the execution of the current function in the JIT code of
+/// a block version entered by the interpreter. Frames are laid out the
+/// same way by both, and the frame gets the null return address of a
+/// top-level call, so that the JIT code returns here. Returns the address
+/// at which the interpreter resumes, or null for top-level calls.
+uint8_t* jitOsr(BlockVersion* version)
+{
+    auto& retSlot = basePtr[-(ptrdiff_t)version->ctx.numLocals() - 1];
+    auto retAddr = (uint8_t**)retSlot.getWord().ptr;
+    retSlot = Value((refptr)nullptr, TAG_RETADDR);
+
+    runJit(version->jitPtr);
+
+    if (retAddr == nullptr)
+        return nullptr;
+
+    return getTargetAddr(*retAddr);
+}
+
+/// Block entry is a GC safepoint
+uint8_t* jitSafepoint(uint64_t, uint64_t)
+{
+    return jitGuard([]() {
+        vm.safepoint();
+        return (uint8_t*)nullptr;
+    });
+}
+
+uint8_t* jitStackError(uint64_t overflow, uint64_t)
+{
+    return jitGuard([=]() -> uint8_t* {
+        if (overflow)
+            throw RunError("stack overflow");
+        throw RunError("op cannot pop value, stack empty");
+    });
+}
+
+/// Run an instruction copied to the code heap with the interpreter
+uint8_t* jitExecOp(uint8_t* snippet, uint64_t)
+{
+    return jitGuard([=]() {
+        instrPtr = snippet;
+        execCode();
+        return (uint8_t*)nullptr;
+    });
+}
+
+/// Run the rest of the current function with the interpreter, from a
+/// block version which could not be translated, and get the address
+/// at which JIT code continues once the function returns. The frame
+/// gets a null return address for the interpreter to return here.
+uint8_t* jitInterpret(BlockVersion* version)
+{
+    auto& retSlot = basePtr[-(ptrdiff_t)version->ctx.numLocals() - 1];
+    auto retCell = (uint8_t**)retSlot.getWord().ptr;
+    retSlot = Value((refptr)nullptr, TAG_RETADDR);
+
+    instrPtr = version->startPtr;
+    execCode();
+
+    return retCell? *retCell:jitExit;
+}
+
+/// Stub for a branch whose target had no JIT code yet. The branch is
+/// patched to jump directly to the target from now on.
+uint8_t* jitBranchStub(uint8_t* site, BlockVersion* target)
+{
+    return jitGuard([=]() {
+        auto dstAddr = getJitCode(target);
+        if (!dstAddr)
+            return jitInterpret(target);
+
+        jitPatch(site, dstAddr);
+        return dstAddr;
+    });
+}
+
+/// Stub for a return to a block which had no JIT code yet. The return
+/// address cell is updated to point to the block code.
+uint8_t* jitRetStub(uint8_t** retCell, BlockVersion* target)
+{
+    return jitGuard([=]() {
+        auto dstAddr = getJitCode(target);
+        if (!dstAddr)
+            return jitInterpret(target);
+
+        *retCell = dstAddr;
+        return dstAddr;
+    });
+}
+
+/// Perform a call for JIT code, and return the address to jump to.
+/// Function calls push a frame whose return address is a cell holding
+/// the code address of the return block.
+uint8_t* jitCall(uint8_t* operands, uint8_t** retCell)
+{
+    return jitGuard([=]() {
+        static ICache entryIC("entry");
+
+        auto ptr = operands;
+        auto numArgs = jitOperand<uint32_t>(ptr);
+        auto& instrVal = jitOperand<Value>(ptr);
+        auto ic = jitOperand<CallIC*>(ptr);
+
+        auto callee = popVal();
+
+        if (stackPtr + numArgs > stackBottom)
+        {
+            throw RunError(
+                "stack underflow at call"
+            );
+        }
+
+        if (callee != ic->callee)
+        {
+            fillCallIC(ic, callee, numArgs, instrVal);
+
+            if (!ic->hostFn)
+            {
+                ic->entryVer = getEntryVersion(
+                    entryIC.getObj(callee),
+                    numArgs,
+                    ic->numLocals
+                );
+            }
+
+            ic->setCallee(callee);
+        }
+
+        // The cache may have been filled by the interpreter
+        if (ic->entryVer && !ic->jitEntry)
+        {
+            ic->jitEntry = getJitCode(ic->entryVer);
+            ic->entryAddr = ic->entryVer->startPtr;
+        }
+
+        if (ic->jitEntry)
+        {
+            basePtr = pushFrame(
+                callee,
+                numArgs,
+                ic->numLocals,
+                (uint8_t*)retCell
+            );
+
+            return ic->jitEntry;
+        }
+
+        // Callees which could not be translated are run by the
+        // interpreter, and return here as host functions do
+        if (ic->entryVer)
+        {
+            basePtr = pushFrame(
+                callee,
+                numArgs,
+                ic->numLocals,
+                nullptr
+            );
+
+            instrPtr = ic->entryVer->startPtr;
+            execCode();
+            return *retCell;
+        }
+
+        auto retVal = callHostFn(ic->hostFn, numArgs);
+        stackPtr += numArgs;
+        pushVal(retVal);
+
+        return *retCell;
+    });
+}
+
+/// Write a stub calling a helper with two arguments, then jumping
+/// to the address it returns
+uint8_t* jitStub(void* helper, uint64_t arg0, uint64_t arg1)
+{
+    auto stubAddr = jitAlloc;
+    jitCallHelper(helper, arg0, arg1);
+    jitJmpReg(RAX);
+    return stubAddr;
+}
+
+/// Copy an instruction to the code heap, followed by jit_return, so
+/// that the interpreter can run it for JIT code
+uint8_t* copyInstr(Opcode op, uint8_t* opPtr, uint8_t* opEnd)
+{
+    reserveCode((opEnd - opPtr) + MAX_INSTR_CODE_SIZE);
+    auto copyPtr = codeHeapAlloc;
+
+    for (auto ptr = opPtr; ptr < opEnd; ++ptr)
+        writeCode(*ptr);
+
+    // The instruction object of abort must stay visible to the GC
+    if (op == ABORT)
+    {
+        auto valPtr = (Value*)(codeHeapAlloc - sizeof(Value));
+        if (valPtr->isPointer() && vm.isYoung(valPtr->getWord().ptr))
+            youngCodeRefs.push_back(valPtr);
+    }
+
+    writeOp(JIT_RETURN);
+
+    return copyPtr;
+}
+
+/// Get the number of stack values an instruction reads, and the
+/// number it leaves in their place
+void getStackEffect(Opcode op, uint8_t* operands, size_t& numIn, size_t& numOut)
+{
+    switch (op)
+    {
+        case GET_LOCAL:
+        case PUSH:
+        numIn = 0;
+        numOut = 1;
+        break;
+
+        case DUP:
+        numIn = *(uint32_t*)operands + 1;
+        numOut = numIn + 1;
+        break;
+
+        case SWAP:
+        numIn = 2;
+        numOut = 2;
+        break;
+
+        case JUMP:
+        case CALL:
+        numIn = 0;
+        numOut = 0;
+        break;
+
+        case SET_LOCAL:
+        case POP:
+        case IF_TRUE:
+        case RET:
+        case ABORT:
+        numIn = 1;
+        numOut = 0;
+        break;
+
+        case ARRAY_PUSH:
+        numIn = 2;
+        numOut = 0;
+        break;
+
+        case SET_FIELD:
+        case SET_ELEM:
+        numIn = 3;
+        numOut = 0;
+        break;
+
+        case STR_SLICE:
+        case STR_FIND:
+        numIn = 3;
+        numOut = 1;
+        break;
+
+        case STR_LEN:
+        case STR_TO_I64:
+        case I64_TO_STR:
+        case NEW_OBJECT:
+        case NEW_ARRAY:
+        case ARRAY_LEN:
+        case HAS_TAG:
+        case IMPORT:
+        numIn = 1;
+        numOut = 1;
+        break;
+
+        default:
+        if (op >= ADD_I64_IMM && op <= EQ_I64_LOC)
+            numIn = 1;
+        else
+            numIn = 2;
+        numOut = 1;
+    }
+}
+
+/// Out-of-line path running an instruction with the interpreter,
+/// when its inline code does not handle the operand values
+struct JitSlowPath
+{
+    /// Jumps to the slow path
+    std::vector<uint8_t*> sites;
+
+    /// Instruction in the code stream
+    Opcode op;
+    uint8_t* opPtr;
+    uint8_t* opEnd;
+
+    /// Code following the inline code of the instruction
+    uint8_t* resumeAddr;
+};
+
+/// Jump to a slow path unless a value has a given tag
+void jitCheckTag(Reg base, int32_t disp, Tag tag, JitSlowPath& slowPath)
+{
+    jitCmpTag(base, disp, tag);
+    slowPath.sites.push_back(jitJcc(CC_NE));
+}
+
+/// Emit the inline code of an integer instruction. The operand
+/// variants of each operation are all in the same order. Operand
+/// type errors and overflows are left for the interpreter to report,
+/// so the stack is only changed once the result is known.
+void jitIntOp(Opcode op, uint8_t*& ptr, JitSlowPath& slowPath)
+{
+    Opcode baseOp;
+
+    // Displacement of the result from the stack pointer
+    int32_t dstDisp = 0;
+
+    if (op >= ADD_I64_IMM && op <= EQ_I64_IMM)
+    {
+        baseOp = (Opcode)(op - ADD_I64_IMM + ADD_I64);
+        auto imm = jitOperand<int64_t>(ptr);
+
+        jitCheckTag(REG_SP, 0, TAG_INT64, slowPath);
+        jitLoad(RAX, REG_SP, 0);
+        jitMovImm(RCX, imm);
+    }
+    else if (op >= ADD_I64_LOC && op <= EQ_I64_LOC)
+    {
+        baseOp = (Opcode)(op - ADD_I64_LOC + ADD_I64);
+        auto disp = -VAL_SIZE * (int32_t)jitOperand<uint32_t>(ptr);
+
+        jitCheckTag(REG_SP, 0, TAG_INT64, slowPath);
+        jitCheckTag(REG_BP, disp, TAG_INT64, slowPath);
+        jitLoad(RAX, REG_SP, 0);
+        jitLoad(RCX, REG_BP, disp);
+    }
+    else
+    {
+        if (op >= ADD_I64_UNCHECKED)
+        {
+            baseOp = (Opcode)(op - ADD_I64_UNCHECKED + ADD_I64);
+        }
+        else
+        {
+            baseOp = op;
+            jitCheckTag(REG_SP, 0, TAG_INT64, slowPath);
+            jitCheckTag(REG_SP, VAL_SIZE, TAG_INT64, slowPath);
+        }
+
+        jitLoad(RAX, REG_SP, VAL_SIZE);
+        jitLoad(RCX, REG_SP, 0);
+        dstDisp = VAL_SIZE;
+    }
+
+    switch (baseOp)
+    {
+        case ADD_I64:
+        jitRegOp(true, 0x01, RCX, RAX);
+        slowPath.sites.push_back(jitJcc(CC_O));
+        break;
+
+        case SUB_I64:
+        jitRegOp(true, 0x29, RCX, RAX);
+        slowPath.sites.push_back(jitJcc(CC_O));
+        break;
+
+        case MUL_I64:
+        jitRegOp(true, 0x0FAF, RAX, RCX);
+        slowPath.sites.push_back(jitJcc(CC_O));
+        break;
+
+        default:
+        {
+            Cond cond;
+            switch (baseOp)
+            {
+                case LT_I64: cond = CC_L; break;
+                case LE_I64: cond = CC_LE; break;
+                case GT_I64: cond = CC_G; break;
+                case GE_I64: cond = CC_GE; break;
+                default: cond = CC_E;
+            }
+
+            // cmp rax, rcx; setcc al; movzx eax, al
+            jitRegOp(true, 0x39, RCX, RAX);
+            jitRegOp(false, 0x0F90 | cond, 0, RAX);
+            jitRegOp(false, 0x0FB6, RAX, RAX);
+            jitStoreTag(REG_SP, dstDisp, TAG_BOOL);
+        }
+    }
+
+    jitStore(REG_SP, dstDisp, RAX);
+
+    if (dstDisp)
+        jitLea(REG_SP, REG_SP, dstDisp);
+}
+
+/**
+Branches and return address cells of a block being translated. Those
+whose target block has no native code yet go through stubs, written
+after the block code.
+*/
+class JitLinks
+{
+    std::vector<std::pair<uint8_t*, BlockVersion*>> branches;
+    std::vector<std::pair<uint8_t**, BlockVersion*>> retCells;
+
+public:
+
+    /// Link a jump to a block version
+    void branch(uint8_t* site, BlockVersion* target)
+    {
+        if (target->jitPtr)
+            jitPatch(site, target->jitPtr);
+        else
+            branches.push_back(std::make_pair(site, target));
+    }
+
+    /// Allocate the return address cell of a call in the code heap
+    uint8_t** retCell(BlockVersion* target)
+    {
+        auto cell = writeCode(target->jitPtr);
+
+        if (!target->jitPtr)
+            retCells.push_back(std::make_pair(cell, target));
+
+        return cell;
+    }
+
+    void writeStubs()
+    {
+        for (auto& branch : branches)
+        {
+            auto stubAddr = jitStub(
+                (void*)jitBranchStub,
+                (uint64_t)branch.first,
+                (uint64_t)branch.second
+            );
+            jitPatch(branch.first, stubAddr);
+        }
+
+        for (auto& cell : retCells)
+        {
+            *cell.first = jitStub(
+                (void*)jitRetStub,
+                (uint64_t)cell.first,
+                (uint64_t)cell.second
+            );
+        }
+    }
+};
+
+/**
+GC safepoint poll and stack bounds checks done at block entry. The
+bounds checked are patched once the stack depth reached by the block
+is known, and the calls to the runtime are written after the block.
+*/
+class JitEntryChecks
+{
+    uint8_t* safepointSite;
+    uint8_t* checksAddr;
+    uint8_t* pushDisp;
+    uint8_t* popDisp;
+    uint8_t* overflowSite;
+    uint8_t* underflowSite;
+
+    /// Stack depth relative to block entry, and its bounds
+    ptrdiff_t depth = 0;
+    ptrdiff_t minDepth = 0;
+    ptrdiff_t maxDepth = 0;
+
+public:
+
+    void writeChecks()
+    {
+        jitMovImm(RAX, (uint64_t)vm.getSafepointFlag());
+        jitMemOp(false, 0x80, 7, RAX, 0);
+        jitByte(0);
+        safepointSite = jitJcc(CC_NE);
+        checksAddr = jitAlloc;
+
+        pushDisp = jitMemOp(true, 0x8D, RAX, REG_SP, 0, true);
+        jitMovImm(RCX, (uint64_t)&stackLimit);
+        jitMemOp(true, 0x3B, RAX, RCX, 0);
+        overflowSite = jitJcc(CC_B);
+        popDisp = jitMemOp(true, 0x8D, RAX, REG_SP, 0, true);
+        jitMovImm(RCX, (uint64_t)&stackBottom);
+        jitMemOp(true, 0x3B, RAX, RCX, 0);
+        underflowSite = jitJcc(CC_A);
+    }
+
+    /// Account for the stack values used by an instruction
+    void addInstr(Opcode op, uint8_t* operands)
+    {
+        size_t numIn, numOut;
+        getStackEffect(op, operands, numIn, numOut);
+        addEffect(numIn, numOut);
+    }
+
+    /// Account for stack values popped, and values pushed in their place
+    void addEffect(size_t numIn, size_t numOut)
+    {
+        minDepth = std::min(minDepth, depth - (ptrdiff_t)numIn);
+        depth += (ptrdiff_t)numOut - (ptrdiff_t)numIn;
+        maxDepth = std::max(maxDepth, depth);
+    }
+
+    void writeSlowPaths()
+    {
+        *(int32_t*)pushDisp = -VAL_SIZE * (int32_t)maxDepth;
+        *(int32_t*)popDisp = -VAL_SIZE * (int32_t)minDepth;
+
+        jitPatch(safepointSite, jitAlloc);
+        jitCallHelper((void*)jitSafepoint, 0);
+        jitPatch(jitJmp(), checksAddr);
+
+        jitPatch(overflowSite, jitAlloc);
+        jitCallHelper((void*)jitStackError, 1);
+        jitPatch(underflowSite, jitAlloc);
+        jitCallHelper((void*)jitStackError, 0);
+    }
+};
+
+uint8_t* jitOptimize(BlockVersion* version, uint64_t);
+
+/**
+Translate the code of a block version to native code. Stack, local
+variable and integer instructions, as well as branches, have inline
+code, and other instructions are run by the interpreter. The entries
+into the block are counted, and the block gets recompiled by the
+optimizing tier once it becomes hot.
+*/
+void jitCompile(BlockVersion* version)
+{
+    assert (version->startPtr);
+    assert (!version->jitPtr);
+
+    auto entryAddr = jitAlloc;
+
+    JitLinks links;
+    JitEntryChecks checks;
+    std::vector<JitSlowPath> slowPaths;
+
+    // Count down the entries into the block. This first instruction
+    // is overwritten with a jump to the optimized code.
+    version->optCountdown = std::max(optThreshold, (uint32_t)1);
+    jitMovImm(RAX, (uint64_t)&version->optCountdown);
+    jitMemOp(false, 0xFF, 1, RAX, 0);
+    auto hotSite = jitJcc(CC_E);
+
+    checks.writeChecks();
+
+    // Baseline code of each instruction, recorded once the translation
+    // is complete
+    std::vector<std::pair<uint8_t*, uint8_t*>> opAddrs;
+
+    for (auto ptr = version->startPtr; ptr < version->endPtr;)
+    {
+        auto opPtr = ptr;
+        auto op = jitReadOp(ptr);
+        checks.addInstr(op, ptr);
+        opAddrs.push_back(std::make_pair(opPtr, jitAlloc));
+
+        JitSlowPath slowPath;
+        switch (op)
+        {
+            case GET_LOCAL:
+            {
+                auto idx = jitOperand<uint32_t>(ptr);
+                jitLoadVal(REG_BP, -VAL_SIZE * (int32_t)idx);
+                jitStoreVal(REG_SP, -VAL_SIZE);
+                jitLea(REG_SP, REG_SP, -VAL_SIZE);
+            }
+            break;
+
+            case SET_LOCAL:
+            {
+                auto idx = jitOperand<uint32_t>(ptr);
+                jitLoadVal(REG_SP, 0);
+                jitStoreVal(REG_BP, -VAL_SIZE * (int32_t)idx);
+                jitLea(REG_SP, REG_SP, VAL_SIZE);
+            }
+            break;
+
+            // Heap references are loaded from the code stream, where
+            // the GC updates them
+            case PUSH:
+            {
+                auto& val = jitOperand<Value>(ptr);
+
+                if (val.isPointer())
+                {
+                    jitMovImm(RAX, (uint64_t)&val);
+                    jitLoadVal(RAX, 0);
+                    jitStoreVal(REG_SP, -VAL_SIZE);
+                }
+                else
+                {
+                    jitMovImm(RAX, val.getWord().int64);
+                    jitStore(REG_SP, -VAL_SIZE, RAX);
+                    jitStoreTag(REG_SP, -VAL_SIZE, val.getTag());
+                }
+
+                jitLea(REG_SP, REG_SP, -VAL_SIZE);
+            }
+            break;
+
+            case POP:
+            jitLea(REG_SP, REG_SP, VAL_SIZE);
+            break;
+
+            case DUP:
+            {
+                auto idx = jitOperand<uint32_t>(ptr);
+                jitLoadVal(REG_SP, VAL_SIZE * (int32_t)idx);
+                jitStoreVal(REG_SP, -VAL_SIZE);
+                jitLea(REG_SP, REG_SP, -VAL_SIZE);
+            }
+            break;
+
+            // Swap through xmm0 and xmm1
+            case SWAP:
+            jitLoadVal(REG_SP, 0);
+            jitMemOp(false, 0x0F10, 1, REG_SP, VAL_SIZE);
+            jitMemOp(false, 0x0F11, 1, REG_SP, 0);
+            jitStoreVal(REG_SP, VAL_SIZE);
+            break;
+
+            case ADD_I64:
+            case SUB_I64:
+            case MUL_I64:
+            case LT_I64:
+            case LE_I64:
+            case GT_I64:
+            case GE_I64:
+            case EQ_I64:
+            case ADD_I64_UNCHECKED:
+            case SUB_I64_UNCHECKED:
+            case MUL_I64_UNCHECKED:
+            case LT_I64_UNCHECKED:
+            case LE_I64_UNCHECKED:
+            case GT_I64_UNCHECKED:
+            case GE_I64_UNCHECKED:
+            case EQ_I64_UNCHECKED:
+            case ADD_I64_IMM:
+            case SUB_I64_IMM:
+            case MUL_I64_IMM:
+            case LT_I64_IMM:
+            case LE_I64_IMM:
+            case GT_I64_IMM:
+            case GE_I64_IMM:
+            case EQ_I64_IMM:
+            case ADD_I64_LOC:
+            case SUB_I64_LOC:
+            case MUL_I64_LOC:
+            case LT_I64_LOC:
+            case LE_I64_LOC:
+            case GT_I64_LOC:
+            case GE_I64_LOC:
+            case EQ_I64_LOC:
+            jitIntOp(op, ptr, slowPath);
+            break;
+
+            // Values with tags unknown to has_tag are left for the
+            // interpreter to report. The valid tags are all below 8.
+            case HAS_TAG:
+            {
+                auto testTag = jitOperand<Tag>(ptr);
+                uint32_t validTags =
+                    (1 << TAG_UNDEF) | (1 << TAG_BOOL) | (1 << TAG_INT64) |
+                    (1 << TAG_STRING) | (1 << TAG_ARRAY) | (1 << TAG_OBJECT);
+
+                // movzx eax, byte [sp + tag]; cmp eax, 7; ja slow
+                jitMemOp(false, 0x0FB6, RAX, REG_SP, VAL_TAG);
+                jitRegOp(false, 0x83, 7, RAX);
+                jitByte(7);
+                slowPath.sites.push_back(jitJcc(CC_A));
+
+                // mov ecx, validTags; bt ecx, eax; jnc slow
+                jitByte(0xB8 | RCX);
+                jitWrite(validTags);
+                jitRegOp(false, 0x0FA3, RAX, RCX);
+                slowPath.sites.push_back(jitJcc(CC_AE));
+
+                // cmp eax, testTag; sete al; movzx eax, al
+                jitRegOp(false, 0x81, 7, RAX);
+                jitWrite((uint32_t)testTag);
+                jitRegOp(false, 0x0F90 | CC_E, 0, RAX);
+                jitRegOp(false, 0x0FB6, RAX, RAX);
+                jitStore(REG_SP, 0, RAX);
+                jitStoreTag(REG_SP, 0, TAG_BOOL);
+            }
+            break;
+
+            case JUMP:
+            links.branch(jitJmp(), jitTarget(ptr));
+            break;
+
+            // The condition is true if its word is 1 and its tag is
+            // that of booleans
+            case IF_TRUE:
+            {
+                auto thenVer = jitTarget(ptr);
+                auto elseVer = jitTarget(ptr);
+
+                // mov rax, [sp]; movzx ecx, byte [sp + tag]
+                jitLoad(RAX, REG_SP, 0);
+                jitMemOp(false, 0x0FB6, RCX, REG_SP, VAL_TAG);
+                jitLea(REG_SP, REG_SP, VAL_SIZE);
+
+                // sub rax, 1; xor ecx, TAG_BOOL; or rax, rcx
+                jitRegOp(true, 0x83, 5, RAX);
+                jitByte(1);
+                jitRegOp(false, 0x83, 6, RCX);
+                jitByte(TAG_BOOL);
+                jitRegOp(true, 0x09, RCX, RAX);
+
+                links.branch(jitJcc(CC_NE), elseVer);
+                links.branch(jitJmp(), thenVer);
+            }
+            break;
+
+            // The return address cell points to a stub until the
+            // return block is translated
+            case CALL:
+            {
+                auto operands = ptr;
+                jitOperand<uint32_t>(ptr);
+                jitOperand<Value>(ptr);
+                jitOperand<CallIC*>(ptr);
+                auto retVer = jitTarget(ptr);
+
+                auto retCell = links.retCell(retVer);
+
+                jitCallHelper((void*)jitCall, (uint64_t)operands, (uint64_t)retCell);
+                jitJmpReg(RAX);
+            }
+            break;
+
+            // The frame is popped inline, and a null return address
+            // leaves JIT code
+            case RET:
+            {
+                auto numLocals = (int32_t)jitOperand<uint32_t>(ptr);
+
+                jitLoadVal(REG_SP, 0);
+                jitLoad(RAX, REG_BP, -VAL_SIZE * (numLocals + 1));
+                jitLoad(RCX, REG_BP, -VAL_SIZE * numLocals);
+                jitLea(REG_SP, REG_BP, VAL_SIZE);
+                jitRegOp(true, 0x8B, REG_BP, RCX);
+                jitStoreVal(REG_SP, -VAL_SIZE);
+                jitLea(REG_SP, REG_SP, -VAL_SIZE);
+
+                // test rax, rax; jz exit; jmp [rax]
+                jitRegOp(true, 0x85, RAX, RAX);
+                jitPatch(jitJcc(CC_E), jitExit);
+                jitByte(0xFF);
+                jitByte(0x20);
+            }
+            break;
+
+            // Other instructions are run by the interpreter. The copy
+            // of abort never returns, and is followed by a trap.
+            default:
+            {
+                if (op == HAS_FIELD || op == SET_FIELD || op == GET_FIELD)
+                    jitOperand<FieldIC*>(ptr);
+                else if (op == ABORT)
+                    jitOperand<Value>(ptr);
+
+                auto copyPtr = copyInstr(op, opPtr, ptr);
+                jitCallHelper((void*)jitExecOp, (uint64_t)copyPtr);
+
+                if (op == ABORT)
+                    jitByte(0xCC);
+            }
+        }
+
+        if (!slowPath.sites.empty())
+        {
+            slowPath.op = op;
+            slowPath.opPtr = opPtr;
+            slowPath.opEnd = ptr;
+            slowPath.resumeAddr = jitAlloc;
+            slowPaths.push_back(slowPath);
+        }
+    }
+
+    // The out-of-line code follows the block code
+    jitPatch(hotSite, jitAlloc);
+    jitCallHelper((void*)jitOptimize, (uint64_t)version);
+    jitJmpReg(RAX);
+
+    checks.writeSlowPaths();
+
+    for (auto& slowPath : slowPaths)
+    {
+        for (auto site : slowPath.sites)
+            jitPatch(site, jitAlloc);
+
+        auto copyPtr = copyInstr(slowPath.op, slowPath.opPtr, slowPath.opEnd);
+        jitCallHelper((void*)jitExecOp, (uint64_t)copyPtr);
+        jitPatch(jitJmp(), slowPath.resumeAddr);
+    }
+
+    links.writeStubs();
+
+    baseOpAddrs.insert(opAddrs.begin(), opAddrs.end());
+    version->jitPtr = entryAddr;
+}
+
+/// Set a register to 1 if a condition holds, and to 0 otherwise.
+/// The REX prefix is always written, so that the low bytes of rsi
+/// and rdi can be used.
+void jitSetcc(Cond cond, Reg reg)
+{
+    jitByte(0x40 | (reg >> 3));
+    jitOpcode(0x0F90 | cond);
+    jitByte(0xC0 | (reg & 7));
+
+    // movzx reg, reg8
+    jitByte(0x48 | ((reg >> 3) << 2) | (reg >> 3));
+    jitOpcode(0x0FB6);
+    jitByte(0xC0 | ((reg & 7) << 3) | (reg & 7));
+}
+
+void jitMovImm32(Reg dst, uint32_t imm)
+{
+    jitRex(false, 0, dst);
+    jitByte(0xB8 | (dst & 7));
+    jitWrite(imm);
+}
+
+/// Test if a constant fits in a sign-extended 32-bit immediate
+bool isImm32(int64_t imm)
+{
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+/// Tags accepted by has_tag
+bool isValidTag(Tag tag)
+{
+    switch (tag)
+    {
+        case TAG_UNDEF:
+        case TAG_BOOL:
+        case TAG_INT64:
+        case TAG_STRING:
+        case TAG_ARRAY:
+        case TAG_OBJECT:
+        return true;
+
+        default:
+        return false;
+    }
+}
+
+/// Absent word operand of an IR instruction
+const uint32_t NO_REF = UINT32_MAX;
+
+/**
+Value of a stack slot or local variable while building the IR of the
+optimizing tier. Values are only written to memory once needed there.
+*/
+struct IRVal
+{
+    enum Kind : uint8_t
+    {
+        // Word produced by an IR instruction, with a known tag
+        REF,
+
+        // Heap reference constant, read from its code heap cell
+        CELL,
+
+        // Value of a local variable, in the frame
+        LOCAL,
+
+        // On the stack, at a displacement from the stack pointer
+        MEM
+    };
+
+    Kind kind = MEM;
+    Tag tag = TAG_UNKNOWN;
+    uint32_t ref = NO_REF;
+    uint32_t idx = 0;
+    int32_t disp = 0;
+    Value* cell = nullptr;
+
+    static IRVal word(uint32_t ref, Tag tag)
+    {
+        IRVal val;
+        val.kind = REF;
+        val.ref = ref;
+        val.tag = tag;
+        return val;
+    }
+
+    static IRVal fromCell(Value* cell)
+    {
+        IRVal val;
+        val.kind = CELL;
+        val.cell = cell;
+        val.tag = cell->getTag();
+        return val;
+    }
+
+    static IRVal local(uint32_t idx)
+    {
+        IRVal val;
+        val.kind = LOCAL;
+        val.idx = idx;
+        return val;
+    }
+
+    static IRVal mem(int32_t disp, Tag tag = TAG_UNKNOWN)
+    {
+        IRVal val;
+        val.kind = MEM;
+        val.disp = disp;
+        val.tag = tag;
+        return val;
+    }
+};
+
+/// Operations of the IR of the optimizing tier
+enum IROp : uint8_t
+{
+    // Instruction removed
+    IR_NOP,
+
+    // Constant word (imm), without heap references
+    IR_CONST,
+
+    // Word of a local variable or stack value (src)
+    IR_LOAD,
+
+    // Word of a local variable (src) carried around the loop of the
+    // region, read on entry, and set to a new word (b) at the back
+    // edge. The word read is checked to be non-negative if imm is set.
+    IR_PHI,
+
+    // Int64 arithmetic, exiting on overflow
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+
+    // Int64 comparison (cond), producing a boolean
+    IR_CMP,
+
+    // Test if a value (src) has a tag (imm), producing a boolean. The
+    // tags has_tag does not accept exit.
+    IR_TEST_TAG,
+
+    // Test if a value (src) is the boolean true
+    IR_IS_TRUE,
+
+    // Exit unless a value (src) has a tag
+    IR_GUARD_TAG,
+
+    // Exit unless a boolean (a) has a value (imm)
+    IR_GUARD,
+
+    // Exit unless a value (src) is the function in a code heap cell (ptr)
+    IR_GUARD_CALLEE,
+
+    // Get a pointer to an object (src) of a shape (ptr), exiting for
+    // other values. The tag is also checked if imm is set.
+    IR_GUARD_SHAPE,
+
+    // Write a slot (imm) of an object (a) to the stack (disp)
+    IR_LOAD_SLOT,
+
+    // Get a pointer to an array (src) read at a memory version (idx),
+    // and the length of an array (a)
+    IR_ARRAY_PTR,
+    IR_ARRAY_LEN,
+
+    // Exit unless an index (a) is below an array length (b)
+    IR_BOUNDS_CHECK,
+
+    // Write an element (b) of an array (a) to the stack (disp)
+    IR_LOAD_ELEM,
+
+    // Write a value (src) to a local variable (idx) or the stack (disp).
+    // Local writes of the word of their phi are skipped if imm is set,
+    // and the frame holds that word.
+    IR_STORE_LOCAL,
+    IR_STORE_STACK,
+
+    // Swap the two values on top of the stack
+    IR_SWAP,
+
+    // Move the stack pointer by a displacement (disp)
+    IR_ADJUST_SP,
+
+    // Run an instruction copy (ptr) with the interpreter
+    IR_EXEC_OP,
+
+    // Start of the loop body, and back edge to it
+    IR_LOOP_HEADER,
+    IR_LOOP,
+
+    // Region exits: jump, branch on a boolean (a), call whose operands
+    // are at ptr, return of a value (src) from a frame of imm locals,
+    // and trap after an abort
+    IR_JUMP,
+    IR_BRANCH,
+    IR_CALL,
+    IR_RET,
+    IR_TRAP
+};
+
+/**
+Instruction of the IR of the optimizing tier. The IR of a region is in
+SSA form: the instructions producing a word are referred to by their
+index, and their word never changes once produced.
+*/
+struct IRInstr
+{
+    IROp op;
+
+    /// Tag of the word produced, or tag checked
+    Tag tag = TAG_UNKNOWN;
+
+    /// Condition of comparisons
+    Cond cond = CC_E;
+
+    /// Word operands
+    uint32_t a = NO_REF;
+    uint32_t b = NO_REF;
+
+    /// Constant, or other integer operand
+    int64_t imm = 0;
+
+    /// Value read, and the local variable or stack slot written
+    IRVal src;
+    uint32_t idx = 0;
+    int32_t disp = 0;
+
+    /// Pointer operand
+    void* ptr = nullptr;
+
+    /// Exit taken by guards
+    int32_t snap = -1;
+
+    /// Branch targets, and return address cell of calls
+    BlockVersion* target0 = nullptr;
+    BlockVersion* target1 = nullptr;
+    uint8_t** retCell = nullptr;
+
+    IRInstr(IROp op) : op(op) {}
+};
+
+/**
+Exit of the optimized code, taken when a guard fails. The stack values
+tracked and the local variables not written to the frame at the guard
+are written to memory, and execution continues in the baseline code.
+*/
+struct Snapshot
+{
+    enum Kind : uint8_t
+    {
+        // Continue in the baseline code of an instruction, which uses
+        // the same frame layout
+        DEOPT,
+
+        // Continue in a branch target the region did not follow
+        BRANCH,
+
+        // Make the call whose inlined code failed a guard, with the
+        // arguments and callee on the stack
+        CALL
+    };
+
+    Kind kind = DEOPT;
+
+    /// Stack values tracked, stack pointer displacement, and values of
+    /// the locals not in the frame
+    std::vector<IRVal> stack;
+    int32_t spOff = 0;
+    std::vector<std::pair<uint32_t, IRVal>> locals;
+
+    /// Locals holding the word of their phi, which the frame holds
+    /// unless the phi changes around the loop
+    std::vector<uint32_t> phiLocals;
+
+    /// Baseline code, branch target, or call operands and return
+    /// address cell, depending on the kind of exit
+    uint8_t* baseAddr = nullptr;
+    BlockVersion* target = nullptr;
+    uint8_t* operands = nullptr;
+    uint8_t** retCell = nullptr;
+
+    /// Jumps to the exit
+    std::vector<uint8_t*> sites;
+};
+
+/// Raised to give up inlining a call, once the callee code reaches an
+/// instruction which cannot be inlined
+struct InlineAbort {};
+
+/// Raised to give up optimizing a version, which keeps its baseline code
+struct OptAbort {};
+
+/// Test if a comparison of two constants holds
+bool evalCond(Cond cond, int64_t x, int64_t y)
+{
+    switch (cond)
+    {
+        case CC_L: return x < y;
+        case CC_LE: return x <= y;
+        case CC_G: return x > y;
+        case CC_GE: return x >= y;
+        case CC_NE: return x != y;
+        default: return x == y;
+    }
+}
+
+/// Get the condition testing the operands of a comparison swapped
+Cond swapCond(Cond cond)
+{
+    switch (cond)
+    {
+        case CC_L: return CC_G;
+        case CC_LE: return CC_GE;
+        case CC_G: return CC_L;
+        case CC_GE: return CC_LE;
+        default: return cond;
+    }
+}
+
+/// Get the condition which holds when another does not
+Cond negateCond(Cond cond)
+{
+    return (Cond)(cond ^ 1);
+}
+
+/**
+Builder of the IR of a region of hot code, from the instructions of
+the block versions compiled from the image's block and instruction
+objects. The region starts with the version optimized, and follows the
+successors taken most so far, into which the other branch sides exit.
+Branches back to the first version close a loop, around which the
+int64 and boolean locals of its context are carried as phis.
+
+Stack values and local variables are tracked at compilation time, and
+only written to memory when needed there. Values are numbered as they
+get built, so that loads, arithmetic, tag checks, shape guards and
+bounds checks computing the same value are only emitted once. Calls to
+the callee seen by the call site inline cache are inlined along the
+path their callee versions took so far, with their arguments in place
+of their locals. The guards of inlined code make the call instead.
+*/
+class IRBuilder
+{
+public:
+
+    /// Version optimized, first of the region
+    BlockVersion* version;
+
+    JitLinks* links;
+    JitEntryChecks checks;
+
+    std::vector<IRInstr> ir;
+    std::vector<Snapshot> snaps;
+
+    /// Phi of each local variable, or NO_REF
+    std::vector<uint32_t> phis;
+
+    /// Flag set once the region loops back to its first version
+    bool loops = false;
+
+    /// Flags set for the locals the region writes to the frame
+    std::vector<bool> localStored;
+
+private:
+
+    /// Successor versions compiled into the region
+    std::vector<BlockVersion*> chained;
+
+    /// Locals of an inlined callee, stack depth below the stack pointer
+    /// register with its arguments and callee pushed, and argument count
+    struct InlineFrame
+    {
+        std::vector<IRVal> locals;
+        int32_t callDepth;
+        int32_t numArgs;
+    };
+
+    /// Calls being inlined, innermost last, the callee versions and
+    /// instructions inlined, and the exit making the outermost call
+    std::vector<InlineFrame> inlineFrames;
+    std::vector<BlockVersion*> inlinedVersions;
+    size_t numInlinedInstrs = 0;
+    int32_t inlineSnap = -1;
+
+    /// Values tracked above the stack top, the top is at the back
+    std::vector<IRVal> stack;
+
+    /// Displacement of the stack top from the stack pointer register,
+    /// and total displacement of the stack pointer register
+    int32_t spOff = 0;
+    int32_t spMoved = 0;
+
+    /// Values of the local variables, which are LOCAL values while the
+    /// frame holds them, and tags known of the frame slots
+    std::vector<IRVal> locals;
+    std::vector<Tag> localTags;
+
+    /// Values numbered so far, and versions of the memory they read
+    std::map<std::vector<int64_t>, uint32_t> valueTable;
+    std::vector<uint32_t> localVersions;
+    uint32_t stackVersion = 0;
+    uint32_t heapVersion = 0;
+
+    /// Exit to the baseline code of the instruction being built, and
+    /// its index once a guard uses it
+    Snapshot opSnap;
+    int32_t opSnapIdx = -1;
+
+    /// Flag set once the code built always leaves the region
+    bool deadEnd = false;
+
+    bool inlining() const
+    {
+        return !inlineFrames.empty();
+    }
+
+    uint32_t emit(const IRInstr& instr)
+    {
+        ir.push_back(instr);
+        return (uint32_t)ir.size() - 1;
+    }
+
+    /// Emit an instruction, unless one computing the same value was
+    /// emitted already, whose word is then reused
+    uint32_t emitNumbered(const IRInstr& instr, const std::vector<int64_t>& key)
+    {
+        auto itr = valueTable.find(key);
+        if (itr != valueTable.end())
+            return itr->second;
+
+        auto ref = emit(instr);
+        valueTable[key] = ref;
+        return ref;
+    }
+
+    /// Add the memory a value is read from, and its version, to the key
+    /// of a numbered instruction
+    void addSrcKey(std::vector<int64_t>& key, const IRVal& val)
+    {
+        key.push_back(val.kind);
+
+        switch (val.kind)
+        {
+            case IRVal::LOCAL:
+            key.push_back(val.idx);
+            key.push_back(localVersions[val.idx]);
+            break;
+
+            case IRVal::MEM:
+            key.push_back(val.disp);
+            key.push_back(stackVersion);
+            break;
+
+            case IRVal::CELL:
+            key.push_back((int64_t)val.cell);
+            break;
+
+            case IRVal::REF:
+            key.push_back(val.ref);
+            break;
+        }
+    }
+
+    /// Version of the memory a value is read from
+    uint32_t memVersion(const IRVal& val)
+    {
+        if (val.kind == IRVal::LOCAL)
+            return localVersions[val.idx];
+        return stackVersion;
+    }
+
+    uint32_t constWord(int64_t imm, Tag tag)
+    {
+        IRInstr instr(IR_CONST);
+        instr.imm = imm;
+        instr.tag = tag;
+        return emitNumbered(instr, { IR_CONST, imm, tag });
+    }
+
+    IRVal constVal(int64_t imm, Tag tag)
+    {
+        return IRVal::word(constWord(imm, tag), tag);
+    }
+
+    bool isConst(uint32_t ref)
+    {
+        return ir[ref].op == IR_CONST;
+    }
+
+    Tag tagOf(const IRVal& val)
+    {
+        if (val.kind == IRVal::LOCAL)
+            return localTags[val.idx];
+        return val.tag;
+    }
+
+    /// Record the tag of a value once checked
+    void refineTag(const IRVal& val, Tag tag)
+    {
+        if (val.kind == IRVal::LOCAL)
+            localTags[val.idx] = tag;
+
+        if (val.kind != IRVal::MEM)
+            return;
+
+        auto refine = [&](IRVal& other) {
+            if (other.kind == IRVal::MEM && other.disp == val.disp)
+                other.tag = tag;
+        };
+
+        for (auto& other : stack)
+            refine(other);
+        for (auto& frame : inlineFrames)
+            for (auto& local : frame.locals)
+                refine(local);
+    }
+
+    void push(const IRVal& val)
+    {
+        stack.push_back(val);
+    }
+
+    IRVal pop()
+    {
+        if (!stack.empty())
+        {
+            auto val = stack.back();
+            stack.pop_back();
+            return val;
+        }
+
+        auto val = IRVal::mem(spOff);
+        spOff += VAL_SIZE;
+        return val;
+    }
+
+    /// Get a stack value without popping it
+    IRVal peek(size_t depth)
+    {
+        if (depth < stack.size())
+            return stack[stack.size() - 1 - depth];
+
+        auto memIdx = (int32_t)(depth - stack.size());
+        return IRVal::mem(spOff + VAL_SIZE * memIdx);
+    }
+
+    /// Depth of the stack top below the stack pointer register
+    int32_t stackDepth()
+    {
+        return VAL_SIZE * (int32_t)stack.size() - spOff;
+    }
+
+    /// Write the values tracked at the bottom of the stack to it
+    void flush(size_t count)
+    {
+        assert (count <= stack.size());
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            spOff -= VAL_SIZE;
+            IRInstr store(IR_STORE_STACK);
+            store.src = stack[i];
+            store.disp = spOff;
+            emit(store);
+        }
+
+        stack.erase(stack.begin(), stack.begin() + count);
+        if (count > 0)
+            stackVersion++;
+    }
+
+    /// Write all the values tracked to the stack, and update the stack
+    /// pointer register, as needed before leaving the inline code
+    void flushAll()
+    {
+        // Inlined code keeps the arguments of the call in place
+        if (inlining())
+            throw InlineAbort();
+
+        flush(stack.size());
+
+        if (spOff != 0)
+        {
+            IRInstr adjust(IR_ADJUST_SP);
+            adjust.disp = spOff;
+            emit(adjust);
+            spMoved += spOff;
+            spOff = 0;
+            stackVersion++;
+        }
+    }
+
+    /// Test if a local holds the word of its phi, and was not written
+    /// to the frame since the region entry
+    bool isEntryPhiWord(uint32_t idx)
+    {
+        return (
+            phis[idx] != NO_REF &&
+            locals[idx].kind == IRVal::REF &&
+            locals[idx].ref == phis[idx] &&
+            localVersions[idx] == 0
+        );
+    }
+
+    /// Write the local variables not in the frame to it, except those
+    /// carried around the loop if keepPhis is set
+    void storeLocals(bool keepPhis)
+    {
+        for (uint32_t idx = 0; idx < locals.size(); ++idx)
+        {
+            auto val = locals[idx];
+            if (val.kind == IRVal::LOCAL)
+                continue;
+            if (keepPhis && phis[idx] != NO_REF)
+                continue;
+
+            IRInstr store(IR_STORE_LOCAL);
+            store.src = val;
+            store.idx = idx;
+            store.imm = isEntryPhiWord(idx);
+            emit(store);
+
+            if (!store.imm)
+                localStored[idx] = true;
+
+            locals[idx] = IRVal::local(idx);
+            localTags[idx] = val.tag;
+            localVersions[idx]++;
+        }
+    }
+
+    Snapshot makeSnap(Snapshot::Kind kind)
+    {
+        Snapshot snap;
+        snap.kind = kind;
+        snap.stack = stack;
+        snap.spOff = spOff;
+
+        for (uint32_t idx = 0; idx < locals.size(); ++idx)
+        {
+            if (isEntryPhiWord(idx))
+                snap.phiLocals.push_back(idx);
+            else if (locals[idx].kind != IRVal::LOCAL)
+                snap.locals.push_back(std::make_pair(idx, locals[idx]));
+        }
+
+        return snap;
+    }
+
+    /// Record the state before an instruction, for its guards to
+    /// deoptimize to
+    void beginInstr(uint8_t* opPtr)
+    {
+        opSnapIdx = -1;
+        if (inlining())
+            return;
+
+        assert (baseOpAddrs.count(opPtr));
+        opSnap = makeSnap(Snapshot::DEOPT);
+        opSnap.baseAddr = baseOpAddrs[opPtr];
+    }
+
+    /// Get the exit of the guards of the instruction being built. The
+    /// guards of inlined code make the call instead.
+    int32_t useSnap()
+    {
+        if (inlining())
+            return inlineSnap;
+
+        if (opSnapIdx < 0)
+        {
+            opSnapIdx = (int32_t)snaps.size();
+            snaps.push_back(opSnap);
+        }
+
+        return opSnapIdx;
+    }
+
+    /// Leave the region, at code which would always fail a guard
+    void exitAlways()
+    {
+        if (inlining())
+            throw InlineAbort();
+
+        IRInstr guard(IR_GUARD);
+        guard.a = constWord(0, TAG_BOOL);
+        guard.imm = 1;
+        guard.snap = useSnap();
+        emit(guard);
+        deadEnd = true;
+    }
+
+    /// Exit unless a value has a tag. Returns false if it never has it.
+    bool guardTag(const IRVal& val, Tag tag)
+    {
+        auto known = tagOf(val);
+
+        if (known == tag)
+            return true;
+
+        if (known != TAG_UNKNOWN)
+        {
+            exitAlways();
+            return false;
+        }
+
+        assert (val.kind == IRVal::LOCAL || val.kind == IRVal::MEM);
+        IRInstr guard(IR_GUARD_TAG);
+        guard.src = val;
+        guard.tag = tag;
+        guard.snap = useSnap();
+        emit(guard);
+
+        refineTag(val, tag);
+        return true;
+    }
+
+    /// Exit unless a boolean has a value, and record the tag tested by
+    /// the guard once it holds
+    void guard(uint32_t cond, bool expected)
+    {
+        IRInstr guard(IR_GUARD);
+        guard.a = cond;
+        guard.imm = expected;
+        guard.snap = useSnap();
+        emit(guard);
+
+        auto& test = ir[cond];
+        if (!expected || test.idx != memVersion(test.src))
+            return;
+
+        if (test.op == IR_TEST_TAG)
+            refineTag(test.src, (Tag)test.imm);
+        else if (test.op == IR_IS_TRUE)
+            refineTag(test.src, TAG_BOOL);
+    }
+
+    /// Get the word of a value of known tag
+    uint32_t wordOf(const IRVal& val)
+    {
+        if (val.kind == IRVal::REF)
+            return val.ref;
+
+        assert (val.kind == IRVal::LOCAL || val.kind == IRVal::MEM);
+        IRInstr load(IR_LOAD);
+        load.src = val;
+        load.tag = tagOf(val);
+
+        std::vector<int64_t> key = { IR_LOAD };
+        addSrcKey(key, val);
+        return emitNumbered(load, key);
+    }
+
+    /// Get the value of a local variable. In inlined code, the values
+    /// of the callee locals are those of the call arguments.
+    IRVal localVal(uint32_t idx)
+    {
+        if (!inlining())
+            return locals[idx];
+
+        auto& frameLocals = inlineFrames.back().locals;
+        if (idx >= frameLocals.size())
+            throw InlineAbort();
+        return frameLocals[idx];
+    }
+
+    /// Test if a successor version can be compiled into the region.
+    /// Its baseline code is needed to deoptimize into it.
+    bool canChain(BlockVersion* target)
+    {
+        return (
+            target != version &&
+            target->startPtr &&
+            baseOpAddrs.count(target->startPtr) &&
+            chained.size() < MAX_CHAINED_VERSIONS &&
+            std::find(chained.begin(), chained.end(), target) == chained.end()
+        );
+    }
+
+    bool canFollow(BlockVersion* target)
+    {
+        return canChain(target) || (target == version && canCloseLoop());
+    }
+
+    /// Number of entries into the JIT code of a version so far, to
+    /// pick the side of a branch to follow. Optimized versions count
+    /// as the hottest.
+    uint32_t entryCount(BlockVersion* ver)
+    {
+        if (!ver->jitPtr)
+            return 0;
+
+        if (ver->baseJitPtr && ver->jitPtr != ver->baseJitPtr)
+            return UINT32_MAX;
+
+        auto threshold = std::max(optThreshold, (uint32_t)1);
+        return threshold - std::min(ver->optCountdown, threshold);
+    }
+
+    uint32_t emitArith(IROp op, uint32_t a, uint32_t b);
+    uint32_t emitCmp(Cond cond, uint32_t a, uint32_t b);
+    uint32_t arrayPtr(const IRVal& arr);
+    uint32_t arrayLen(uint32_t arrPtr);
+    bool canCloseLoop();
+    bool closeLoop();
+    BlockVersion* follow(BlockVersion* target);
+    BlockVersion* compileVersion(BlockVersion* ver);
+    void compileIntOp(Opcode op, uint8_t*& ptr);
+    void compileHasTag(uint8_t*& ptr);
+    BlockVersion* compileIfTrue(uint8_t*& ptr);
+    BlockVersion* compileCall(uint8_t*& ptr);
+    bool inlineCall(uint8_t* operands, CallIC* ic, BlockVersion* retVer);
+    void finishInline();
+    bool constFieldEntry(FieldIC* ic, FieldIC::Entry& entry);
+    uint32_t guardShape(const IRVal& obj, Shape* shape);
+    bool compileGetField(FieldIC* ic);
+    bool compileHasField(FieldIC* ic);
+    bool compileGetElem();
+    bool compileArrayLen();
+    bool compileEqStr();
+
+public:
+
+    IRBuilder(BlockVersion* version, JitLinks* links)
+    : version(version),
+      links(links),
+      phis(version->ctx.numLocals(), NO_REF),
+      localStored(version->ctx.numLocals(), false),
+      locals(version->ctx.numLocals()),
+      localTags(version->ctx.locals),
+      localVersions(version->ctx.numLocals(), 0)
+    {
+    }
+
+    void build();
+};
+
+uint32_t IRBuilder::emitArith(IROp op, uint32_t a, uint32_t b)
+{
+    // Constant operands are kept on the right
+    if (op != IR_SUB && isConst(a) && !isConst(b))
+        std::swap(a, b);
+
+    if (isConst(b))
+    {
+        auto y = ir[b].imm;
+
+        if (isConst(a))
+        {
+            int64_t r;
+            bool overflow = (
+                op == IR_ADD? __builtin_add_overflow(ir[a].imm, y, &r):
+                op == IR_SUB? __builtin_sub_overflow(ir[a].imm, y, &r):
+                __builtin_mul_overflow(ir[a].imm, y, &r)
+            );
+
+            if (!overflow)
+                return constWord(r, TAG_INT64);
+        }
+        else if ((op == IR_MUL && y == 1) || (op != IR_MUL && y == 0))
+        {
+            return a;
+        }
+    }
+
+    IRInstr instr(op);
+    instr.a = a;
+    instr.b = b;
+    instr.tag = TAG_INT64;
+    instr.snap = useSnap();
+    return emitNumbered(instr, { op, a, b });
+}
+
+uint32_t IRBuilder::emitCmp(Cond cond, uint32_t a, uint32_t b)
+{
+    if (isConst(a) && isConst(b))
+        return constWord(evalCond(cond, ir[a].imm, ir[b].imm), TAG_BOOL);
+
+    if (a == b)
+        return constWord(evalCond(cond, 0, 0), TAG_BOOL);
+
+    if (isConst(a))
+    {
+        std::swap(a, b);
+        cond = swapCond(cond);
+    }
+
+    IRInstr instr(IR_CMP);
+    instr.cond = cond;
+    instr.a = a;
+    instr.b = b;
+    instr.tag = TAG_BOOL;
+    return emitNumbered(instr, { IR_CMP, cond, a, b });
+}
+
+/// Get a pointer to the object holding the elements of an array.
+/// Arrays which were extended point to their new object.
+uint32_t IRBuilder::arrayPtr(const IRVal& arr)
+{
+    IRInstr instr(IR_ARRAY_PTR);
+    instr.src = arr;
+    instr.idx = memVersion(arr);
+
+    std::vector<int64_t> key = { IR_ARRAY_PTR, heapVersion };
+    addSrcKey(key, arr);
+    return emitNumbered(instr, key);
+}
+
+uint32_t IRBuilder::arrayLen(uint32_t arrPtr)
+{
+    IRInstr instr(IR_ARRAY_LEN);
+    instr.a = arrPtr;
+    instr.tag = TAG_INT64;
+    return emitNumbered(instr, { IR_ARRAY_LEN, arrPtr, heapVersion });
+}
+
+/// Test if the region can loop back to its first version. The stack
+/// pointer must be back where it was on entry, and the locals carried
+/// around the loop must hold words of their tag.
+bool IRBuilder::canCloseLoop()
+{
+    if (loops || inlining() || spMoved - stackDepth() != 0)
+        return false;
+
+    for (uint32_t idx = 0; idx < locals.size(); ++idx)
+    {
+        if (phis[idx] == NO_REF)
+            continue;
+
+        auto& val = locals[idx];
+        auto tag = ir[phis[idx]].tag;
+
+        if (val.kind == IRVal::LOCAL)
+        {
+            if (localTags[idx] != tag && localTags[idx] != TAG_UNKNOWN)
+                return false;
+        }
+        else if (val.kind != IRVal::REF || val.tag != tag)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Branch back to the loop header, with the words of the locals
+/// carried around the loop as the new values of their phis. The
+/// locals in the frame have the tags of the first version context,
+/// as for any branch to it.
+bool IRBuilder::closeLoop()
+{
+    if (!canCloseLoop())
+        return false;
+
+    flushAll();
+
+    std::vector<uint32_t> backRefs(locals.size(), NO_REF);
+    for (uint32_t idx = 0; idx < locals.size(); ++idx)
+    {
+        if (phis[idx] == NO_REF)
+            continue;
+
+        auto& val = locals[idx];
+        backRefs[idx] = (val.kind == IRVal::LOCAL)? wordOf(val):val.ref;
+    }
+
+    storeLocals(true);
+
+    for (uint32_t idx = 0; idx < locals.size(); ++idx)
+        if (phis[idx] != NO_REF)
+            ir[phis[idx]].b = backRefs[idx];
+
+    emit(IRInstr(IR_LOOP));
+    loops = true;
+    return true;
+}
+
+/// Continue with the code of a branch target if it can be followed,
+/// or jump to it
+BlockVersion* IRBuilder::follow(BlockVersion* target)
+{
+    if (inlining())
+    {
+        if (!target->startPtr ||
+            std::find(inlinedVersions.begin(), inlinedVersions.end(), target) !=
+            inlinedVersions.end())
+            throw InlineAbort();
+
+        return target;
+    }
+
+    if (target == version && closeLoop())
+        return nullptr;
+
+    if (canChain(target))
+    {
+        chained.push_back(target);
+        return target;
+    }
+
+    flushAll();
+    storeLocals(false);
+
+    IRInstr jump(IR_JUMP);
+    jump.target0 = target;
+    emit(jump);
+    return nullptr;
+}
+
+void IRBuilder::compileIntOp(Opcode op, uint8_t*& ptr)
+{
+    bool isImm = (op >= ADD_I64_IMM && op <= EQ_I64_IMM);
+    bool isLoc = (op >= ADD_I64_LOC && op <= EQ_I64_LOC);
+    bool isUnchecked = (op >= ADD_I64_UNCHECKED && op <= EQ_I64_UNCHECKED);
+
+    Opcode baseOp;
+    if (isImm)
+        baseOp = (Opcode)(op - ADD_I64_IMM + ADD_I64);
+    else if (isLoc)
+        baseOp = (Opcode)(op - ADD_I64_LOC + ADD_I64);
+    else if (isUnchecked)
+        baseOp = (Opcode)(op - ADD_I64_UNCHECKED + ADD_I64);
+    else
+        baseOp = op;
+
+    auto arg1 = (
+        isImm? constVal(jitOperand<int64_t>(ptr), TAG_INT64):
+        isLoc? localVal(jitOperand<uint32_t>(ptr)):
+        pop()
+    );
+    auto arg0 = pop();
+
+    if (!isUnchecked &&
+        (!guardTag(arg0, TAG_INT64) || !guardTag(arg1, TAG_INT64)))
+        return;
+
+    auto a = wordOf(arg0);
+    auto b = wordOf(arg1);
+
+    Cond cond;
+    switch (baseOp)
+    {
+        case ADD_I64:
+        push(IRVal::word(emitArith(IR_ADD, a, b), TAG_INT64));
+        return;
+
+        case SUB_I64:
+        push(IRVal::word(emitArith(IR_SUB, a, b), TAG_INT64));
+        return;
+
+        case MUL_I64:
+        push(IRVal::word(emitArith(IR_MUL, a, b), TAG_INT64));
+        return;
+
+        case LT_I64: cond = CC_L; break;
+        case LE_I64: cond = CC_LE; break;
+        case GT_I64: cond = CC_G; break;
+        case GE_I64: cond = CC_GE; break;
+        default: cond = CC_E;
+    }
+
+    push(IRVal::word(emitCmp(cond, a, b), TAG_BOOL));
+}
+
+void IRBuilder::compileHasTag(uint8_t*& ptr)
+{
+    auto testTag = jitOperand<Tag>(ptr);
+    auto arg = pop();
+    auto tag = tagOf(arg);
+
+    // Tests on values of known types are evaluated at compilation time,
+    // and the branch testing them becomes a jump
+    if (tag != TAG_UNKNOWN)
+    {
+        // Values with invalid tags are reported by the baseline code
+        if (!isValidTag(tag))
+        {
+            exitAlways();
+            return;
+        }
+
+        push(constVal(tag == testTag, TAG_BOOL));
+        return;
+    }
+
+    IRInstr test(IR_TEST_TAG);
+    test.src = arg;
+    test.imm = testTag;
+    test.idx = memVersion(arg);
+    test.tag = TAG_BOOL;
+    test.snap = useSnap();
+
+    std::vector<int64_t> key = { IR_TEST_TAG, testTag };
+    addSrcKey(key, arg);
+    push(IRVal::word(emitNumbered(test, key), TAG_BOOL));
+}
+
+/// Get the shape and slot of a field accessed by a constant name. The
+/// current shape of constant objects is used, such as the global
+/// object, and otherwise the single entry the cache holds for the name.
+bool IRBuilder::constFieldEntry(FieldIC* ic, FieldIC::Entry& found)
+{
+    if (stack.size() < 2)
+        return false;
+
+    auto& name = stack.back();
+    if (name.kind != IRVal::CELL || name.tag != TAG_STRING)
+        return false;
+
+    auto& obj = stack[stack.size() - 2];
+    if (obj.kind == IRVal::CELL && obj.tag == TAG_OBJECT)
+    {
+        auto shape = Object(*obj.cell).getShape();
+        if (shape == Shape::dict())
+            return false;
+
+        found.shape = shape;
+        found.slotIdx = shape->getSlotIdx(String(*name.cell));
+        return true;
+    }
+
+    if (ic->megamorphic)
+        return false;
+
+    bool isFound = false;
+
+    for (size_t i = 0; i < ic->numEntries; ++i)
+    {
+        auto& entry = ic->entries[i];
+        if (entry.name.getWord().ptr != name.cell->getWord().ptr)
+            continue;
+
+        if (isFound)
+            return false;
+        found = entry;
+        isFound = true;
+    }
+
+    return isFound;
+}
+
+/// Get a pointer to an object of a given shape, exiting for other
+/// values. Returns NO_REF if the value is never an object.
+uint32_t IRBuilder::guardShape(const IRVal& obj, Shape* shape)
+{
+    auto tag = tagOf(obj);
+
+    if (tag != TAG_UNKNOWN && tag != TAG_OBJECT)
+    {
+        exitAlways();
+        return NO_REF;
+    }
+
+    IRInstr instr(IR_GUARD_SHAPE);
+    instr.src = obj;
+    instr.ptr = shape;
+    instr.imm = (tag == TAG_UNKNOWN);
+    instr.snap = useSnap();
+
+    std::vector<int64_t> key = { IR_GUARD_SHAPE, heapVersion, (int64_t)shape };
+    addSrcKey(key, obj);
+    auto ref = emitNumbered(instr, key);
+
+    refineTag(obj, TAG_OBJECT);
+    return ref;
+}
+
+/// Field reads on objects of the shape known for their constant field
+/// name read the slot inline. Other objects deoptimize, and the
+/// baseline code updates the cache.
+bool IRBuilder::compileGetField(FieldIC* ic)
+{
+    if (version->numInvalidations > 0 && !inlining())
+        return false;
+
+    FieldIC::Entry entry;
+    if (!constFieldEntry(ic, entry) || entry.slotIdx == Shape::NOT_FOUND)
+        return false;
+
+    if (peek(1).kind == IRVal::REF)
+        return false;
+
+    pop();
+    auto obj = pop();
+    auto objPtr = guardShape(obj, entry.shape);
+    if (objPtr == NO_REF)
+        return true;
+
+    // The field tag is not known, so the value goes on the stack
+    flush(stack.size());
+    spOff -= VAL_SIZE;
+
+    IRInstr load(IR_LOAD_SLOT);
+    load.a = objPtr;
+    load.imm = entry.slotIdx;
+    load.disp = spOff;
+    emit(load);
+    stackVersion++;
+    return true;
+}
+
+/// Field tests on objects of the shape known for their constant field
+/// name are known once the shape is checked
+bool IRBuilder::compileHasField(FieldIC* ic)
+{
+    if (version->numInvalidations > 0 && !inlining())
+        return false;
+
+    FieldIC::Entry entry;
+    if (!constFieldEntry(ic, entry) || peek(1).kind == IRVal::REF)
+        return false;
+
+    pop();
+    auto obj = pop();
+    if (guardShape(obj, entry.shape) == NO_REF)
+        return true;
+
+    push(constVal(entry.slotIdx != Shape::NOT_FOUND, TAG_BOOL));
+    return true;
+}
+
+/// Element reads check the index against the array length inline.
+/// Bounds checks on an index already checked against the same array
+/// are eliminated, since arrays do not shrink.
+bool IRBuilder::compileGetElem()
+{
+    if (version->numInvalidations > 0 && !inlining())
+        return false;
+
+    auto idx = peek(0);
+    auto arr = peek(1);
+
+    if (arr.kind != IRVal::LOCAL && arr.kind != IRVal::MEM)
+        return false;
+
+    // Constant indices are kept in 32-bit displacements
+    if (idx.kind == IRVal::REF && isConst(idx.ref) &&
+        (ir[idx.ref].imm < 0 || ir[idx.ref].imm >= MAX_CONST_ELEM_IDX))
+        return false;
+
+    pop();
+    pop();
+    if (!guardTag(idx, TAG_INT64) || !guardTag(arr, TAG_ARRAY))
+        return true;
+
+    auto idxRef = wordOf(idx);
+    auto arrPtr = arrayPtr(arr);
+    auto lenRef = arrayLen(arrPtr);
+
+    IRInstr check(IR_BOUNDS_CHECK);
+    check.a = idxRef;
+    check.b = lenRef;
+    check.snap = useSnap();
+    std::vector<int64_t> key = { IR_BOUNDS_CHECK, idxRef };
+    addSrcKey(key, arr);
+    emitNumbered(check, key);
+
+    flush(stack.size());
+    spOff -= VAL_SIZE;
+
+    IRInstr load(IR_LOAD_ELEM);
+    load.a = arrPtr;
+    load.b = idxRef;
+    load.disp = spOff;
+    emit(load);
+    stackVersion++;
+    return true;
+}
+
+bool IRBuilder::compileArrayLen()
+{
+    auto arr = peek(0);
+    if (arr.kind != IRVal::LOCAL && arr.kind != IRVal::MEM)
+        return false;
+
+    pop();
+    if (!guardTag(arr, TAG_ARRAY))
+        return true;
+
+    push(IRVal::word(arrayLen(arrayPtr(arr)), TAG_INT64));
+    return true;
+}
+
+/// String comparisons of constants are evaluated at compilation time
+bool IRBuilder::compileEqStr()
+{
+    auto arg1 = peek(0);
+    auto arg0 = peek(1);
+
+    if (arg0.kind != IRVal::CELL || arg0.tag != TAG_STRING ||
+        arg1.kind != IRVal::CELL || arg1.tag != TAG_STRING)
+        return false;
+
+    pop();
+    pop();
+    push(constVal(String(*arg0.cell) == String(*arg1.cell), TAG_BOOL));
+    return true;
+}
+
+/// Branches on known values continue with their target. Others follow
+/// the side taken most so far, and exit to the other side. The region
+/// ends once the side to follow cannot be compiled into it.
+BlockVersion* IRBuilder::compileIfTrue(uint8_t*& ptr)
+{
+    auto thenVer = jitTarget(ptr);
+    auto elseVer = jitTarget(ptr);
+
+    auto cond = pop();
+    auto tag = tagOf(cond);
+
+    if (cond.kind == IRVal::REF && isConst(cond.ref))
+        return follow((tag == TAG_BOOL && ir[cond.ref].imm == 1)? thenVer:elseVer);
+
+    if (tag != TAG_UNKNOWN && tag != TAG_BOOL)
+        return follow(elseVer);
+
+    // Values of unknown tags are true if their word is 1 and their tag
+    // is that of booleans
+    uint32_t condRef;
+    if (tag == TAG_BOOL)
+    {
+        condRef = wordOf(cond);
+    }
+    else
+    {
+        IRInstr test(IR_IS_TRUE);
+        test.src = cond;
+        test.idx = memVersion(cond);
+        test.tag = TAG_BOOL;
+
+        std::vector<int64_t> key = { IR_IS_TRUE };
+        addSrcKey(key, cond);
+        condRef = emitNumbered(test, key);
+    }
+
+    bool expected;
+    if (inlining())
+    {
+        // Inlined code follows the side the callee took so far. Tag
+        // tests follow the side taken most, and other conditions must
+        // have taken a single side.
+        bool isTagTest = (
+            ir[condRef].op == IR_TEST_TAG || ir[condRef].op == IR_IS_TRUE
+        );
+
+        if ((!thenVer->startPtr && !elseVer->startPtr) ||
+            (thenVer->startPtr && elseVer->startPtr && !isTagTest))
+            throw InlineAbort();
+
+        expected = (
+            elseVer->startPtr?
+            entryCount(thenVer) > entryCount(elseVer):
+            true
+        );
+    }
+    else
+    {
+        expected = entryCount(thenVer) >= entryCount(elseVer);
+
+        if (!canFollow(expected? thenVer:elseVer))
+        {
+            flushAll();
+            storeLocals(false);
+
+            IRInstr branch(IR_BRANCH);
+            branch.a = condRef;
+            branch.target0 = thenVer;
+            branch.target1 = elseVer;
+            emit(branch);
+            return nullptr;
+        }
+
+        opSnap = makeSnap(Snapshot::BRANCH);
+        opSnap.target = expected? elseVer:thenVer;
+        opSnapIdx = -1;
+    }
+
+    guard(condRef, expected);
+    return follow(expected? thenVer:elseVer);
+}
+
+/// Calls to the function last seen by the call site are inlined if
+/// possible. Otherwise, they leave the region.
+BlockVersion* IRBuilder::compileCall(uint8_t*& ptr)
+{
+    auto operands = ptr;
+    jitOperand<uint32_t>(ptr);
+    jitOperand<Value>(ptr);
+    auto ic = jitOperand<CallIC*>(ptr);
+    auto retVer = jitTarget(ptr);
+
+    // Calls in inlined code are inlined too, up to a depth
+    if (inlining())
+    {
+        if (inlineFrames.size() >= MAX_INLINE_DEPTH ||
+            !inlineCall(operands, ic, retVer))
+            throw InlineAbort();
+
+        return follow(retVer);
+    }
+
+    // The IR built while trying to inline is discarded if the callee
+    // cannot be inlined
+    auto saved = *this;
+
+    try
+    {
+        if (inlineCall(operands, ic, retVer))
+            return follow(retVer);
+    }
+    catch (InlineAbort&)
+    {
+        *this = saved;
+    }
+
+    flushAll();
+    storeLocals(false);
+
+    IRInstr call(IR_CALL);
+    call.ptr = operands;
+    call.retCell = links->retCell(retVer);
+    emit(call);
+    return nullptr;
+}
+
+/// Inline a call to a function object, with the arguments left on the
+/// stack. Returns false if the call cannot be inlined, and raises
+/// InlineAbort if its callee code cannot.
+bool IRBuilder::inlineCall(
+    uint8_t* operands,
+    CallIC* ic,
+    BlockVersion* retVer
+)
+{
+    auto numArgs = (int32_t)*(uint32_t*)operands;
+
+    if (!ic->callee.isObject() || ic->hostFn || !ic->entryVer ||
+        !ic->entryVer->startPtr || ic->numLocals < (uint32_t)numArgs)
+        return false;
+
+    // Values of the arguments and callee, with their known tags
+    std::vector<IRVal> vals;
+    for (int32_t i = 0; i <= numArgs; ++i)
+    {
+        auto val = peek(numArgs - i);
+        val.tag = tagOf(val);
+        vals.push_back(val);
+    }
+
+    // The outermost call is made when a guard of the inlined code
+    // fails, with its arguments written to the stack
+    if (!inlining())
+    {
+        flushAll();
+
+        auto snap = makeSnap(Snapshot::CALL);
+        snap.operands = operands;
+        snap.retCell = links->retCell(retVer);
+        inlineSnap = (int32_t)snaps.size();
+        snaps.push_back(snap);
+
+        inlinedVersions.clear();
+        numInlinedInstrs = 0;
+
+        // Values other than words and constants are read from the stack
+        for (int32_t i = 0; i <= numArgs; ++i)
+        {
+            if (vals[i].kind == IRVal::MEM)
+                vals[i] = IRVal::mem(VAL_SIZE * (numArgs - i), vals[i].tag);
+        }
+    }
+
+    auto& callee = vals[numArgs];
+    if (callee.kind == IRVal::REF)
+        throw InlineAbort();
+
+    if (callee.kind != IRVal::CELL ||
+        callee.cell->getWord().ptr != ic->callee.getWord().ptr)
+    {
+        IRInstr guard(IR_GUARD_CALLEE);
+        guard.src = callee;
+        guard.ptr = writeCodeVal(ic->callee);
+        guard.snap = inlineSnap;
+        emit(guard);
+    }
+
+    InlineFrame frame;
+    frame.callDepth = stackDepth();
+    frame.numArgs = numArgs;
+    frame.locals.assign(vals.begin(), vals.begin() + numArgs);
+    for (auto i = (uint32_t)numArgs; i < ic->numLocals; ++i)
+        frame.locals.push_back(constVal(0, TAG_UNDEF));
+
+    auto depth = inlineFrames.size();
+    inlineFrames.push_back(frame);
+
+    for (auto ver = ic->entryVer; ver; ver = compileVersion(ver));
+
+    assert (inlineFrames.size() == depth);
+    return true;
+}
+
+/// Replace the arguments and callee of an inlined call by its return
+/// value, once the callee returns
+void IRBuilder::finishInline()
+{
+    auto frame = inlineFrames.back();
+    inlineFrames.pop_back();
+
+    auto val = pop();
+
+    // Values left on the stack by the callee are discarded with its
+    // frame, along with the arguments and callee
+    auto numLeft = (stackDepth() - frame.callDepth) / VAL_SIZE;
+    for (int32_t i = 0; i < numLeft + frame.numArgs + 1; ++i)
+        pop();
+    checks.addEffect(numLeft + frame.numArgs + 1, 1);
+
+    // Values read from the stack are written where the arguments were
+    if (val.kind == IRVal::MEM)
+    {
+        if (!stack.empty())
+            throw InlineAbort();
+
+        spOff -= VAL_SIZE;
+        if (val.disp != spOff)
+        {
+            IRInstr store(IR_STORE_STACK);
+            store.src = val;
+            store.disp = spOff;
+            emit(store);
+            stackVersion++;
+        }
+    }
+    else
+    {
+        push(val);
+    }
+}
+
+/// Build the IR of the region, from its first version
+void IRBuilder::build()
+{
+    for (uint32_t idx = 0; idx < locals.size(); ++idx)
+        locals[idx] = IRVal::local(idx);
+
+    // Speculations on the values of the phis exit at the region entry
+    beginInstr(version->startPtr);
+    auto entrySnap = useSnap();
+
+    // The int64 and boolean locals are carried around the loop, if
+    // the region loops
+    for (uint32_t idx = 0; idx < locals.size(); ++idx)
+    {
+        auto tag = localTags[idx];
+        if (tag != TAG_INT64 && tag != TAG_BOOL)
+            continue;
+
+        IRInstr phi(IR_PHI);
+        phi.src = IRVal::local(idx);
+        phi.tag = tag;
+        phi.snap = entrySnap;
+        phis[idx] = emit(phi);
+        locals[idx] = IRVal::word(phis[idx], tag);
+    }
+
+    emit(IRInstr(IR_LOOP_HEADER));
+
+    for (auto ver = version; ver; ver = compileVersion(ver));
+}
+
+/// Build the IR of a version, and get the successor to continue with,
+/// or null once the region ends
+BlockVersion* IRBuilder::compileVersion(BlockVersion* ver)
+{
+    if (inlining())
+        inlinedVersions.push_back(ver);
+
+    auto endPtr = ver->endPtr;
+
+    for (auto ptr = ver->startPtr; ptr < endPtr;)
+    {
+        if (inlining() && ++numInlinedInstrs > MAX_INLINED_INSTRS)
+            throw InlineAbort();
+
+        if (deadEnd)
+            return nullptr;
+
+        auto opPtr = ptr;
+        auto op = jitReadOp(ptr);
+        checks.addInstr(op, ptr);
+        beginInstr(opPtr);
+
+        switch (op)
+        {
+            case GET_LOCAL:
+            push(localVal(jitOperand<uint32_t>(ptr)));
+            break;
+
+            // Words and constants written to locals are kept tracked.
+            // Other values are written to the frame, once the values
+            // read from the local before are written to the stack.
+            case SET_LOCAL:
+            {
+                auto idx = jitOperand<uint32_t>(ptr);
+                auto val = pop();
+
+                if (inlining())
+                    throw InlineAbort();
+
+                // The frame still holds the value read before
+                if (val.kind == IRVal::LOCAL && val.idx == idx)
+                {
+                    locals[idx] = val;
+                    break;
+                }
+
+                if (val.kind == IRVal::REF || val.kind == IRVal::CELL)
+                {
+                    locals[idx] = val;
+                    break;
+                }
+
+                size_t numReads = 0;
+                for (size_t i = 0; i < stack.size(); ++i)
+                    if (stack[i].kind == IRVal::LOCAL && stack[i].idx == idx)
+                        numReads = i + 1;
+                flush(numReads);
+
+                IRInstr store(IR_STORE_LOCAL);
+                store.src = val;
+                store.idx = idx;
+                emit(store);
+
+                locals[idx] = IRVal::local(idx);
+                localTags[idx] = tagOf(val);
+                localVersions[idx]++;
+                localStored[idx] = true;
+            }
+            break;
+
+            case PUSH:
+            {
+                auto& val = jitOperand<Value>(ptr);
+
+                if (val.isPointer())
+                    push(IRVal::fromCell(&val));
+                else
+                    push(constVal(val.getWord().int64, val.getTag()));
+            }
+            break;
+
+            case POP:
+            pop();
+            break;
+
+            // Values below the stack top are copied once the copy is
+            // written to the stack
+            case DUP:
+            push(peek(jitOperand<uint32_t>(ptr)));
+            break;
+
+            case SWAP:
+            if (stack.size() >= 2)
+            {
+                std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+            }
+            else
+            {
+                flushAll();
+                emit(IRInstr(IR_SWAP));
+                stackVersion++;
+            }
+            break;
+
+            case ADD_I64:
+            case SUB_I64:
+            case MUL_I64:
+            case LT_I64:
+            case LE_I64:
+            case GT_I64:
+            case GE_I64:
+            case EQ_I64:
+            case ADD_I64_UNCHECKED:
+            case SUB_I64_UNCHECKED:
+            case MUL_I64_UNCHECKED:
+            case LT_I64_UNCHECKED:
+            case LE_I64_UNCHECKED:
+            case GT_I64_UNCHECKED:
+            case GE_I64_UNCHECKED:
+            case EQ_I64_UNCHECKED:
+            case ADD_I64_IMM:
+            case SUB_I64_IMM:
+            case MUL_I64_IMM:
+            case LT_I64_IMM:
+            case LE_I64_IMM:
+            case GT_I64_IMM:
+            case GE_I64_IMM:
+            case EQ_I64_IMM:
+            case ADD_I64_LOC:
+            case SUB_I64_LOC:
+            case MUL_I64_LOC:
+            case LT_I64_LOC:
+            case LE_I64_LOC:
+            case GT_I64_LOC:
+            case GE_I64_LOC:
+            case EQ_I64_LOC:
+            compileIntOp(op, ptr);
+            break;
+
+            case HAS_TAG:
+            compileHasTag(ptr);
+            break;
+
+            case JUMP:
+            return follow(jitTarget(ptr));
+
+            case IF_TRUE:
+            return compileIfTrue(ptr);
+
+            case CALL:
+            return compileCall(ptr);
+
+            case RET:
+            {
+                auto numLocals = jitOperand<uint32_t>(ptr);
+
+                if (inlining())
+                {
+                    finishInline();
+                    return nullptr;
+                }
+
+                IRInstr ret(IR_RET);
+                ret.src = pop();
+                ret.imm = numLocals;
+                emit(ret);
+            }
+            return nullptr;
+
+            // Other instructions are run by the interpreter, unless
+            // they have inline code for the operands they get
+            default:
+            {
+                FieldIC* ic = nullptr;
+                if (op == GET_FIELD || op == HAS_FIELD || op == SET_FIELD)
+                    ic = jitOperand<FieldIC*>(ptr);
+                else if (op == ABORT)
+                    jitOperand<Value>(ptr);
+
+                bool inlined = (
+                    (op == GET_FIELD && compileGetField(ic)) ||
+                    (op == HAS_FIELD && compileHasField(ic)) ||
+                    (op == GET_ELEM && compileGetElem()) ||
+                    (op == ARRAY_LEN && compileArrayLen()) ||
+                    (op == EQ_STR && compileEqStr())
+                );
+
+                if (inlined)
+                    break;
+
+                flushAll();
+
+                IRInstr exec(IR_EXEC_OP);
+                exec.ptr = copyInstr(op, opPtr, ptr);
+                emit(exec);
+                stackVersion++;
+                heapVersion++;
+
+                if (op == ABORT)
+                {
+                    emit(IRInstr(IR_TRAP));
+                    return nullptr;
+                }
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+uint8_t* jitInvalidate(BlockVersion* version, uint64_t);
+
+/**
+Optimizing tier, which recompiles hot block versions. The IR of the
+region starting at the version is built in SSA form with value
+numbering, then bounds checks implied by earlier guards are eliminated,
+unused values are removed, and comparisons are fused with the guards
+and branches testing them. Words get registers by linear scan, and
+those which do not fit, or live across the instructions run by the
+interpreter without fitting in rbx, get slots in the native frame.
+*/
+class OptCompiler
+{
+    /// Location of a word, in a register or a native frame slot
+    struct Loc
+    {
+        int8_t reg = -1;
+        int32_t slot = -1;
+
+        bool operator == (const Loc& other) const
+        {
+            return reg == other.reg && slot == other.slot;
+        }
+    };
+
+    JitLinks links;
+    IRBuilder builder;
+
+    BlockVersion* version;
+    std::vector<IRInstr>& ir;
+    std::vector<Snapshot>& snaps;
+
+    /// Location of each word, comparisons fused with the next guard
+    /// or branch, and number of uses of each word
+    std::vector<Loc> locs;
+    std::vector<bool> fused;
+    std::vector<uint32_t> numUses;
+
+    /// Loop header, and safepoint poll sites at the header
+    uint8_t* headerAddr = nullptr;
+    uint8_t* safepointSite = nullptr;
+
+    /// Test if a phi holds the word read on entry throughout the region
+    bool isTrivialPhi(uint32_t ref)
+    {
+        auto& phi = ir[ref];
+        return !builder.loops || (phi.b == ref && !builder.localStored[phi.src.idx]);
+    }
+
+    /// Call a function on each word used by an instruction, including
+    /// the words its exit writes to memory
+    template <typename Fn> void forEachUse(uint32_t i, Fn fn)
+    {
+        auto& instr = ir[i];
+
+        if (instr.a != NO_REF)
+            fn(instr.a);
+        if (instr.b != NO_REF && instr.op != IR_PHI)
+            fn(instr.b);
+
+        if (instr.src.kind == IRVal::REF)
+        {
+            bool skipped = (
+                instr.op == IR_STORE_LOCAL && instr.imm &&
+                isTrivialPhi(instr.src.ref)
+            );
+            if (!skipped)
+                fn(instr.src.ref);
+        }
+
+        if (instr.snap >= 0)
+        {
+            auto& snap = snaps[instr.snap];
+            for (auto& val : snap.stack)
+                if (val.kind == IRVal::REF)
+                    fn(val.ref);
+            for (auto& local : snap.locals)
+                if (local.second.kind == IRVal::REF)
+                    fn(local.second.ref);
+            for (auto idx : snap.phiLocals)
+                if (!isTrivialPhi(builder.phis[idx]))
+                    fn(builder.phis[idx]);
+        }
+
+        if (instr.op == IR_LOOP)
+        {
+            for (auto phi : builder.phis)
+                if (phi != NO_REF && ir[phi].op == IR_PHI && ir[phi].b != phi)
+                    fn(ir[phi].b);
+        }
+    }
+
+    bool isConst(uint32_t ref)
+    {
+        return ir[ref].op == IR_CONST;
+    }
+
+    /// Test if a word produced by an instruction gets a location
+    bool hasLoc(uint32_t ref)
+    {
+        switch (ir[ref].op)
+        {
+            case IR_LOAD:
+            case IR_PHI:
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_GUARD_SHAPE:
+            case IR_ARRAY_PTR:
+            case IR_ARRAY_LEN:
+            return true;
+
+            case IR_CMP:
+            case IR_TEST_TAG:
+            case IR_IS_TRUE:
+            return !fused[ref];
+
+            default:
+            return false;
+        }
+    }
+
+    void eliminateBoundsChecks();
+    void removeDeadCode();
+    void fuseCompares();
+    void allocRegs();
+
+    int32_t slotDisp(int32_t slot)
+    {
+        return (int32_t)sizeof(Word) * slot;
+    }
+
+    /// Get the address of a value in the frame or on the stack
+    void getAddr(const IRVal& val, Reg& base, int32_t& disp)
+    {
+        assert (val.kind == IRVal::MEM || val.kind == IRVal::LOCAL);
+
+        if (val.kind == IRVal::MEM)
+        {
+            base = REG_SP;
+            disp = val.disp;
+        }
+        else
+        {
+            base = REG_BP;
+            disp = -VAL_SIZE * (int32_t)val.idx;
+        }
+    }
+
+    void loadImm(Reg dst, int64_t imm)
+    {
+        if (imm >= 0 && imm <= UINT32_MAX)
+        {
+            jitMovImm32(dst, (uint32_t)imm);
+        }
+        else if (isImm32(imm))
+        {
+            jitRegOp(true, 0xC7, 0, dst);
+            jitWrite((int32_t)imm);
+        }
+        else
+        {
+            jitMovImm(dst, imm);
+        }
+    }
+
+    void move(const Loc& dst, const Loc& src)
+    {
+        if (dst == src)
+            return;
+
+        if (dst.reg >= 0 && src.reg >= 0)
+            jitRegOp(true, 0x8B, dst.reg, src.reg);
+        else if (dst.reg >= 0)
+            jitLoad((Reg)dst.reg, RSP, slotDisp(src.slot));
+        else if (src.reg >= 0)
+            jitStore(RSP, slotDisp(dst.slot), (Reg)src.reg);
+        else
+        {
+            jitLoad(R11, RSP, slotDisp(src.slot));
+            jitStore(RSP, slotDisp(dst.slot), R11);
+        }
+    }
+
+    void loadRef(uint32_t ref, Reg dst)
+    {
+        if (isConst(ref))
+        {
+            loadImm(dst, ir[ref].imm);
+            return;
+        }
+
+        Loc dstLoc;
+        dstLoc.reg = dst;
+        move(dstLoc, locs[ref]);
+    }
+
+    /// Get the register holding a word, loading it into a scratch
+    /// register if needed
+    Reg useReg(uint32_t ref, Reg scratch)
+    {
+        if (!isConst(ref) && locs[ref].reg >= 0)
+            return (Reg)locs[ref].reg;
+
+        loadRef(ref, scratch);
+        return scratch;
+    }
+
+    /// Get the register to produce a word into, which is r11 for
+    /// words in frame slots, written back by defineFrom
+    Reg defReg(uint32_t ref)
+    {
+        return (locs[ref].reg >= 0)? (Reg)locs[ref].reg:R11;
+    }
+
+    void defineFrom(uint32_t ref, Reg src)
+    {
+        Loc srcLoc;
+        srcLoc.reg = src;
+        move(locs[ref], srcLoc);
+    }
+
+    /// Write an arithmetic or comparison instruction with a register
+    /// as left operand, and a word as right operand
+    void aluOp(IROp op, Reg dst, uint32_t ref)
+    {
+        uint16_t regOp = (
+            op == IR_ADD? 0x03:
+            op == IR_SUB? 0x2B:
+            op == IR_MUL? 0x0FAF:
+            0x3B
+        );
+
+        if (isConst(ref) && isImm32(ir[ref].imm))
+        {
+            if (op == IR_MUL)
+                jitRegOp(true, 0x69, dst, dst);
+            else
+                jitRegOp(true, 0x81, op == IR_ADD? 0:(op == IR_SUB? 5:7), dst);
+            jitWrite((int32_t)ir[ref].imm);
+        }
+        else if (isConst(ref))
+        {
+            jitMovImm(RAX, ir[ref].imm);
+            jitRegOp(true, regOp, dst, RAX);
+        }
+        else if (locs[ref].reg >= 0)
+        {
+            jitRegOp(true, regOp, dst, locs[ref].reg);
+        }
+        else
+        {
+            jitMemOp(true, regOp, dst, RSP, slotDisp(locs[ref].slot));
+        }
+    }
+
+    /// Write a value to a stack or frame slot. This leaves the flags
+    /// unchanged.
+    void storeVal(const IRVal& val, Reg base, int32_t disp)
+    {
+        switch (val.kind)
+        {
+            case IRVal::REF:
+            if (isConst(val.ref) && isImm32(ir[val.ref].imm))
+            {
+                jitMemOp(true, 0xC7, 0, base, disp);
+                jitWrite((int32_t)ir[val.ref].imm);
+            }
+            else
+            {
+                jitStore(base, disp, useReg(val.ref, R11));
+            }
+            jitStoreTag(base, disp, val.tag);
+            break;
+
+            case IRVal::CELL:
+            jitMovImm(R11, (uint64_t)val.cell);
+            jitLoadVal(R11, 0);
+            jitStoreVal(base, disp);
+            break;
+
+            case IRVal::MEM:
+            case IRVal::LOCAL:
+            {
+                Reg srcBase;
+                int32_t srcDisp;
+                getAddr(val, srcBase, srcDisp);
+                jitLoadVal(srcBase, srcDisp);
+                jitStoreVal(base, disp);
+            }
+            break;
+        }
+    }
+
+    /// Load the word of a value in memory or in a code heap cell
+    void loadWord(const IRVal& val, Reg dst)
+    {
+        if (val.kind == IRVal::CELL)
+        {
+            jitMovImm(dst, (uint64_t)val.cell);
+            jitLoad(dst, dst, 0);
+            return;
+        }
+
+        Reg base;
+        int32_t disp;
+        getAddr(val, base, disp);
+        jitLoad(dst, base, disp);
+    }
+
+    /// Follow the next pointer of an object in rax, if it has one
+    void followNext()
+    {
+        jitMemOp(false, 0xF7, 0, RAX, 0);
+        jitWrite((uint32_t)HEADER_MSK_NEXT);
+        auto skipSite = jitJcc(CC_E);
+        jitLoad(RAX, RAX, OBJ_OF_NEXT);
+        jitPatch(skipSite, jitAlloc);
+    }
+
+    /// Write an instruction with a [base + index * 2^scale + disp]
+    /// memory operand
+    void jitIndexOp(
+        bool wide,
+        uint16_t opcode,
+        uint8_t reg,
+        Reg base,
+        Reg index,
+        uint8_t scale,
+        int32_t disp
+    )
+    {
+        jitByte(
+            0x40 | (wide? 8:0) | ((reg >> 3) << 2) |
+            ((index >> 3) << 1) | (base >> 3)
+        );
+        jitOpcode(opcode);
+        jitByte(0x84 | ((reg & 7) << 3));
+        jitByte((scale << 6) | ((index & 7) << 3) | (base & 7));
+        jitWrite(disp);
+    }
+
+    /// Jump to the exit of an instruction
+    void exitIf(const IRInstr& instr, Cond cond)
+    {
+        snaps[instr.snap].sites.push_back(jitJcc(cond));
+    }
+
+    void exitAlways(const IRInstr& instr)
+    {
+        snaps[instr.snap].sites.push_back(jitJmp());
+    }
+
+    /// Condition holding when a fused comparison is true
+    Cond fusedCond(uint32_t ref)
+    {
+        return (ir[ref].op == IR_CMP)? ir[ref].cond:CC_E;
+    }
+
+    void writeInstr(uint32_t i);
+    void writeLoopMoves();
+    void writeCall(const IRInstr& instr);
+    void writeRet(const IRInstr& instr);
+    void writeExits();
+
+public:
+
+    OptCompiler(BlockVersion* version)
+    : builder(version, &links),
+      version(version),
+      ir(builder.ir),
+      snaps(builder.snaps)
+    {
+    }
+
+    uint8_t* compile();
+};
+
+/// Remove the bounds checks of indices known to be non-negative and
+/// below the length of the array, from the guards on comparisons
+/// before them. Since arrays do not shrink, a check against a length
+/// read earlier from the same array also holds. Loop counters starting
+/// at a non-negative value and counting up are speculated to be
+/// non-negative, which is checked on entry.
+void OptCompiler::eliminateBoundsChecks()
+{
+    std::vector<std::pair<uint32_t, uint32_t>> below;
+    std::vector<bool> nonNeg(ir.size(), false);
+
+    std::function<bool(uint32_t)> isNonNeg = [&](uint32_t ref) {
+        auto& instr = ir[ref];
+        switch (instr.op)
+        {
+            case IR_CONST:
+            return instr.imm >= 0;
+
+            case IR_ARRAY_LEN:
+            return true;
+
+            case IR_PHI:
+            return nonNeg[ref] || instr.imm != 0;
+
+            case IR_ADD:
+            case IR_MUL:
+            return nonNeg[ref] || (isNonNeg(instr.a) && isNonNeg(instr.b));
+
+            default:
+            return (bool)nonNeg[ref];
+        }
+    };
+
+    auto sameArray = [&](uint32_t len0, uint32_t len1) {
+        if (len0 == len1)
+            return true;
+        if (ir[len0].op != IR_ARRAY_LEN || ir[len1].op != IR_ARRAY_LEN)
+            return false;
+
+        auto& ptr0 = ir[ir[len0].a];
+        auto& ptr1 = ir[ir[len1].a];
+        return (
+            ptr0.src.kind == ptr1.src.kind &&
+            (ptr0.src.kind == IRVal::LOCAL || ptr0.src.kind == IRVal::MEM) &&
+            ptr0.src.idx == ptr1.src.idx &&
+            ptr0.src.disp == ptr1.src.disp &&
+            ptr0.idx == ptr1.idx
+        );
+    };
+
+    // Phis counting up from their entry word around the loop
+    auto isCounter = [&](uint32_t ref) {
+        auto& phi = ir[ref];
+        if (phi.op != IR_PHI || phi.b == NO_REF || phi.b == ref)
+            return phi.op == IR_PHI;
+
+        auto& next = ir[phi.b];
+        return (
+            next.op == IR_ADD && next.a == ref &&
+            isConst(next.b) && ir[next.b].imm >= 0
+        );
+    };
+
+    bool speculate = version->numInvalidations == 0;
+
+    for (uint32_t i = 0; i < ir.size(); ++i)
+    {
+        auto& instr = ir[i];
+
+        if (instr.op == IR_GUARD && ir[instr.a].op == IR_CMP)
+        {
+            auto& cmp = ir[instr.a];
+            auto cond = instr.imm? cmp.cond:negateCond(cmp.cond);
+            auto x = cmp.a;
+            auto y = cmp.b;
+
+            switch (cond)
+            {
+                case CC_L:
+                below.push_back(std::make_pair(x, y));
+                break;
+
+                case CC_G:
+                below.push_back(std::make_pair(y, x));
+                if (isNonNeg(y) || (isConst(y) && ir[y].imm >= -1))
+                    nonNeg[x] = true;
+                break;
+
+                case CC_GE:
+                if (isNonNeg(y))
+                    nonNeg[x] = true;
+                break;
+
+                case CC_LE:
+                if (isNonNeg(x))
+                    nonNeg[y] = true;
+                break;
+
+                default:
+                break;
+            }
+        }
+
+        if (instr.op != IR_BOUNDS_CHECK)
+            continue;
+
+        auto idx = instr.a;
+        bool isBelow = false;
+        for (auto& fact : below)
+            if (fact.first == idx && sameArray(fact.second, instr.b))
+                isBelow = true;
+
+        if (isBelow && !isNonNeg(idx) && speculate)
+        {
+            auto counter = idx;
+            if (ir[idx].op == IR_ADD && isConst(ir[idx].b) && ir[ir[idx].b].imm >= 0)
+                counter = ir[idx].a;
+            if (isCounter(counter))
+                ir[counter].imm = 1;
+        }
+
+        // The check also holds for the code after it
+        if (isBelow && isNonNeg(idx))
+            instr.op = IR_NOP;
+        else
+        {
+            below.push_back(std::make_pair(idx, instr.b));
+            nonNeg[idx] = true;
+        }
+    }
+}
+
+/// Remove the instructions computing words which are not used
+void OptCompiler::removeDeadCode()
+{
+    std::vector<bool> live(ir.size(), false);
+
+    for (auto i = ir.size(); i-- > 0;)
+    {
+        auto& instr = ir[i];
+
+        bool pure = (
+            instr.op == IR_CONST ||
+            instr.op == IR_LOAD ||
+            (instr.op == IR_PHI && !instr.imm) ||
+            instr.op == IR_CMP ||
+            instr.op == IR_IS_TRUE ||
+            instr.op == IR_ARRAY_PTR ||
+            instr.op == IR_ARRAY_LEN
+        );
+
+        if (instr.op == IR_NOP || (pure && !live[i]))
+        {
+            instr.op = IR_NOP;
+            continue;
+        }
+
+        forEachUse(i, [&](uint32_t ref) { live[ref] = true; });
+    }
+}
+
+/// Fuse the comparisons used only by the next guard or branch with
+/// it, when the instructions between them leave the flags unchanged
+void OptCompiler::fuseCompares()
+{
+    numUses.assign(ir.size(), 0);
+    for (uint32_t i = 0; i < ir.size(); ++i)
+        forEachUse(i, [&](uint32_t ref) { numUses[ref]++; });
+
+    fused.assign(ir.size(), false);
+
+    for (uint32_t i = 0; i < ir.size(); ++i)
+    {
+        auto op = ir[i].op;
+        if ((op != IR_CMP && op != IR_TEST_TAG && op != IR_IS_TRUE) ||
+            numUses[i] != 1)
+            continue;
+
+        auto j = i + 1;
+        while (j < ir.size() && (
+            ir[j].op == IR_NOP ||
+            ir[j].op == IR_CONST ||
+            ir[j].op == IR_STORE_LOCAL ||
+            ir[j].op == IR_STORE_STACK ||
+            ir[j].op == IR_ADJUST_SP))
+            ++j;
+
+        if (j < ir.size() && ir[j].a == i &&
+            (ir[j].op == IR_GUARD || ir[j].op == IR_BRANCH))
+            fused[i] = true;
+    }
+}
+
+/// Assign locations to the words by linear scan. The words live into
+/// the loop stay live until its back edge. Helper calls preserve rbx
+/// only, so words live across them otherwise get frame slots.
+void OptCompiler::allocRegs()
+{
+    uint32_t headerPos = 0;
+    uint32_t loopPos = 0;
+    std::vector<uint32_t> callPos;
+
+    for (uint32_t i = 0; i < ir.size(); ++i)
+    {
+        if (ir[i].op == IR_LOOP_HEADER)
+            headerPos = i;
+        else if (ir[i].op == IR_LOOP)
+            loopPos = i;
+        else if (ir[i].op == IR_EXEC_OP)
+            callPos.push_back(i);
+    }
+
+    std::vector<uint32_t> ends(ir.size(), 0);
+    for (uint32_t i = 0; i < ir.size(); ++i)
+    {
+        ends[i] = std::max(ends[i], i);
+        forEachUse(i, [&](uint32_t ref) { ends[ref] = std::max(ends[ref], i); });
+    }
+
+    if (builder.loops)
+    {
+        for (uint32_t i = 0; i < headerPos; ++i)
+        {
+            bool carried = (ir[i].op == IR_PHI && !isTrivialPhi(i));
+            if (carried || ends[i] > headerPos)
+                ends[i] = loopPos;
+        }
+    }
+
+    locs.assign(ir.size(), Loc());
+
+    static const Reg allRegs[] = { RCX, RDX, RSI, RDI, R8, R9, R10, RBX };
+    std::vector<Reg> freeRegs(std::begin(allRegs), std::end(allRegs));
+    std::vector<int32_t> freeSlots;
+    int32_t numSlots = 0;
+    std::vector<uint32_t> active;
+
+    auto allocSlot = [&]() {
+        if (!freeSlots.empty())
+        {
+            auto slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        }
+
+        if (numSlots >= JIT_SPILL_SLOTS)
+            throw OptAbort();
+        return numSlots++;
+    };
+
+    for (uint32_t i = 0; i < ir.size(); ++i)
+    {
+        if (ir[i].op == IR_NOP || !hasLoc(i))
+            continue;
+
+        // Free the locations of the words no longer live
+        for (size_t k = 0; k < active.size();)
+        {
+            auto ref = active[k];
+            if (ends[ref] >= i)
+            {
+                ++k;
+                continue;
+            }
+
+            if (locs[ref].reg >= 0)
+                freeRegs.push_back((Reg)locs[ref].reg);
+            else
+                freeSlots.push_back(locs[ref].slot);
+            active.erase(active.begin() + k);
+        }
+
+        auto callItr = std::upper_bound(callPos.begin(), callPos.end(), i);
+        bool crossesCall = (callItr != callPos.end() && *callItr < ends[i]);
+
+        auto allowed = [&](Reg reg) {
+            return !crossesCall || reg == RBX;
+        };
+
+        // Registers other than rbx are taken first, so that rbx stays
+        // free for the words live across calls
+        auto regItr = std::find_if(freeRegs.begin(), freeRegs.end(), allowed);
+        if (regItr != freeRegs.end() && !crossesCall)
+        {
+            auto other = std::find_if(freeRegs.begin(), freeRegs.end(),
+                [](Reg reg) { return reg != RBX; });
+            if (other != freeRegs.end())
+                regItr = other;
+        }
+
+        if (regItr != freeRegs.end())
+        {
+            locs[i].reg = *regItr;
+            freeRegs.erase(regItr);
+        }
+        else
+        {
+            // Spill the word live the longest, whose register may hold
+            // this word
+            int64_t victim = -1;
+            for (auto ref : active)
+            {
+                if (locs[ref].reg < 0 || !allowed((Reg)locs[ref].reg))
+                    continue;
+                if (victim < 0 || ends[ref] > ends[victim])
+                    victim = ref;
+            }
+
+            if (victim >= 0 && ends[victim] > ends[i])
+            {
+                locs[i].reg = locs[victim].reg;
+                locs[victim].reg = -1;
+                locs[victim].slot = allocSlot();
+            }
+            else
+            {
+                locs[i].slot = allocSlot();
+            }
+        }
+
+        active.push_back(i);
+    }
+}
+
+void OptCompiler::writeInstr(uint32_t i)
+{
+    auto& instr = ir[i];
+
+    switch (instr.op)
+    {
+        case IR_NOP:
+        case IR_CONST:
+        break;
+
+        case IR_LOAD:
+        {
+            auto dst = defReg(i);
+            loadWord(instr.src, dst);
+            defineFrom(i, dst);
+        }
+        break;
+
+        case IR_PHI:
+        {
+            auto dst = defReg(i);
+            loadWord(instr.src, dst);
+            defineFrom(i, dst);
+
+            if (instr.imm)
+            {
+                jitRegOp(true, 0x85, dst, dst);
+                exitIf(instr, CC_S);
+            }
+        }
+        break;
+
+        // The operands stay unchanged until the overflow check, since
+        // they may get written to the stack when exiting
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        {
+            auto dst = defReg(i);
+            loadRef(instr.a, dst);
+            aluOp(instr.op, dst, instr.b);
+            exitIf(instr, CC_O);
+            defineFrom(i, dst);
+        }
+        break;
+
+        case IR_CMP:
+        {
+            auto lhs = useReg(instr.a, R11);
+            aluOp(IR_CMP, lhs, instr.b);
+
+            if (!fused[i])
+            {
+                auto dst = defReg(i);
+                jitSetcc(instr.cond, dst);
+                defineFrom(i, dst);
+            }
+        }
+        break;
+
+        case IR_TEST_TAG:
+        {
+            Reg base;
+            int32_t disp;
+            getAddr(instr.src, base, disp);
+
+            // movzx eax, byte [tag]; cmp eax, 7; ja exit
+            jitMemOp(false, 0x0FB6, RAX, base, disp + VAL_TAG);
+            jitRegOp(false, 0x83, 7, RAX);
+            jitByte(7);
+            exitIf(instr, CC_A);
+
+            // mov r11d, validTags; bt r11d, eax; jnc exit
+            uint32_t validTags = 0;
+            for (uint32_t tag = 0; tag < 8; ++tag)
+                if (isValidTag((Tag)tag))
+                    validTags |= 1 << tag;
+            jitMovImm32(R11, validTags);
+            jitRegOp(false, 0x0FA3, RAX, R11);
+            exitIf(instr, CC_AE);
+
+            jitRegOp(false, 0x81, 7, RAX);
+            jitWrite((uint32_t)instr.imm);
+
+            if (!fused[i])
+            {
+                auto dst = defReg(i);
+                jitSetcc(CC_E, dst);
+                defineFrom(i, dst);
+            }
+        }
+        break;
+
+        // The value is true if its word is 1 and its tag is that of
+        // booleans, which sets the zero flag
+        case IR_IS_TRUE:
+        {
+            Reg base;
+            int32_t disp;
+            getAddr(instr.src, base, disp);
+            jitLoad(RAX, base, disp);
+            jitMemOp(false, 0x0FB6, R11, base, disp + VAL_TAG);
+
+            // sub rax, 1; xor r11d, TAG_BOOL; or rax, r11
+            jitRegOp(true, 0x83, 5, RAX);
+            jitByte(1);
+            jitRegOp(false, 0x83, 6, R11);
+            jitByte(TAG_BOOL);
+            jitRegOp(true, 0x09, R11, RAX);
+
+            if (!fused[i])
+            {
+                auto dst = defReg(i);
+                jitSetcc(CC_E, dst);
+                defineFrom(i, dst);
+            }
+        }
+        break;
+
+        case IR_GUARD_TAG:
+        {
+            Reg base;
+            int32_t disp;
+            getAddr(instr.src, base, disp);
+            jitCmpTag(base, disp, instr.tag);
+            exitIf(instr, CC_NE);
+        }
+        break;
+
+        case IR_GUARD:
+        {
+            auto cond = instr.a;
+
+            if (fused[cond])
+            {
+                auto cc = fusedCond(cond);
+                exitIf(instr, instr.imm? negateCond(cc):cc);
+            }
+            else if (isConst(cond))
+            {
+                if (ir[cond].imm != instr.imm)
+                    exitAlways(instr);
+            }
+            else
+            {
+                auto reg = useReg(cond, RAX);
+                jitRegOp(true, 0x85, reg, reg);
+                exitIf(instr, instr.imm? CC_E:CC_NE);
+            }
+        }
+        break;
+
+        // The callee is compared to the function seen, kept in a code
+        // heap cell where the GC updates it
+        case IR_GUARD_CALLEE:
+        {
+            if (instr.src.kind == IRVal::CELL)
+            {
+                if (instr.src.tag != TAG_OBJECT)
+                {
+                    exitAlways(instr);
+                    break;
+                }
+            }
+            else
+            {
+                Reg base;
+                int32_t disp;
+                getAddr(instr.src, base, disp);
+                jitCmpTag(base, disp, TAG_OBJECT);
+                exitIf(instr, CC_NE);
+            }
+
+            loadWord(instr.src, RAX);
+            jitMovImm(R11, (uint64_t)instr.ptr);
+            jitMemOp(true, 0x3B, RAX, R11, 0);
+            exitIf(instr, CC_NE);
         }
+        break;
 
-        throw RunError("unhandled opcode in basic block \"" + op + "\"");
-    }
+        case IR_GUARD_SHAPE:
+        {
+            if (instr.imm)
+            {
+                Reg base;
+                int32_t disp;
+                getAddr(instr.src, base, disp);
+                jitCmpTag(base, disp, TAG_OBJECT);
+                exitIf(instr, CC_NE);
+            }
 
-    // Mark the block end
-    version->endPtr = codeHeapAlloc;
+            loadWord(instr.src, RAX);
+            followNext();
+
+            jitMovImm(R11, (uint64_t)instr.ptr);
+            jitMemOp(true, 0x3B, R11, RAX, Object::OF_SHAPE);
+            exitIf(instr, CC_NE);
+            defineFrom(i, RAX);
+        }
+        break;
+
+        case IR_LOAD_SLOT:
+        {
+            loadRef(instr.a, RAX);
+
+            auto slotDisp = (int32_t)(Object::OF_FIELDS + instr.imm * sizeof(Word));
+            jitLoad(R11, RAX, slotDisp);
+            jitStore(REG_SP, instr.disp, R11);
+
+            // mov r11d, [rax + cap]; movzx r11d, byte [rax + r11 * 8 + tags]
+            jitMemOp(false, 0x8B, R11, RAX, Object::OF_CAP);
+            jitIndexOp(
+                false, 0x0FB6, R11, RAX, R11, 3,
+                (int32_t)(Object::OF_FIELDS + instr.imm)
+            );
+            jitMemOp(false, 0x88, R11, REG_SP, instr.disp + VAL_TAG);
+        }
+        break;
+
+        // Arrays which were extended point to their new object
+        case IR_ARRAY_PTR:
+        loadWord(instr.src, RAX);
+        followNext();
+        defineFrom(i, RAX);
+        break;
+
+        case IR_ARRAY_LEN:
+        {
+            auto ptr = useReg(instr.a, RAX);
+            auto dst = defReg(i);
+            jitMemOp(false, 0x8B, dst, ptr, Array::OF_LEN);
+            defineFrom(i, dst);
+        }
+        break;
+
+        // Negative indices are above the length as unsigned integers
+        case IR_BOUNDS_CHECK:
+        if (isConst(instr.a))
+        {
+            auto len = useReg(instr.b, RAX);
+            jitRegOp(true, 0x81, 7, len);
+            jitWrite((int32_t)ir[instr.a].imm);
+            exitIf(instr, CC_BE);
+        }
+        else
+        {
+            auto idx = useReg(instr.a, RAX);
+            aluOp(IR_CMP, idx, instr.b);
+            exitIf(instr, CC_AE);
+        }
+        break;
+
+        // The tags of the elements follow their words
+        case IR_LOAD_ELEM:
+        {
+            loadRef(instr.a, RAX);
+
+            if (isConst(instr.b))
+            {
+                auto elemIdx = (int32_t)ir[instr.b].imm;
+                jitLoad(R11, RAX, Array::OF_DATA + sizeof(Word) * elemIdx);
+                jitStore(REG_SP, instr.disp, R11);
+                jitMemOp(false, 0x8B, R11, RAX, Array::OF_CAP);
+                jitIndexOp(
+                    false, 0x0FB6, R11, RAX, R11, 3,
+                    Array::OF_DATA + elemIdx
+                );
+            }
+            else
+            {
+                loadRef(instr.b, R11);
+                jitIndexOp(true, 0x8B, R11, RAX, R11, 3, Array::OF_DATA);
+                jitStore(REG_SP, instr.disp, R11);
+
+                // mov r11d, [rax + cap]; shl r11, 3; add r11, idx
+                jitMemOp(false, 0x8B, R11, RAX, Array::OF_CAP);
+                jitRegOp(true, 0xC1, 4, R11);
+                jitByte(3);
+                aluOp(IR_ADD, R11, instr.b);
+                jitIndexOp(false, 0x0FB6, R11, RAX, R11, 0, Array::OF_DATA);
+            }
+
+            jitMemOp(false, 0x88, R11, REG_SP, instr.disp + VAL_TAG);
+        }
+        break;
+
+        case IR_STORE_LOCAL:
+        if (!instr.imm || !isTrivialPhi(instr.src.ref))
+            storeVal(instr.src, REG_BP, -VAL_SIZE * (int32_t)instr.idx);
+        break;
+
+        case IR_STORE_STACK:
+        storeVal(instr.src, REG_SP, instr.disp);
+        break;
+
+        case IR_SWAP:
+        jitLoadVal(REG_SP, 0);
+        jitMemOp(false, 0x0F10, 1, REG_SP, VAL_SIZE);
+        jitMemOp(false, 0x0F11, 1, REG_SP, 0);
+        jitStoreVal(REG_SP, VAL_SIZE);
+        break;
+
+        case IR_ADJUST_SP:
+        jitLea(REG_SP, REG_SP, instr.disp);
+        break;
+
+        case IR_EXEC_OP:
+        jitCallHelper((void*)jitExecOp, (uint64_t)instr.ptr);
+        break;
+
+        // Loops poll for GC safepoints at their header
+        case IR_LOOP_HEADER:
+        if (builder.loops)
+        {
+            headerAddr = jitAlloc;
+            jitMovImm(RAX, (uint64_t)vm.getSafepointFlag());
+            jitMemOp(false, 0x80, 7, RAX, 0);
+            jitByte(0);
+            safepointSite = jitJcc(CC_NE);
+        }
+        break;
+
+        case IR_LOOP:
+        writeLoopMoves();
+        jitPatch(jitJmp(), headerAddr);
+        break;
+
+        case IR_JUMP:
+        links.branch(jitJmp(), instr.target0);
+        break;
+
+        case IR_BRANCH:
+        {
+            auto cond = instr.a;
+            Cond cc;
+
+            if (fused[cond])
+            {
+                cc = fusedCond(cond);
+            }
+            else
+            {
+                auto reg = useReg(cond, RAX);
+                jitRegOp(true, 0x85, reg, reg);
+                cc = CC_NE;
+            }
+
+            links.branch(jitJcc(cc), instr.target0);
+            links.branch(jitJmp(), instr.target1);
+        }
+        break;
+
+        case IR_CALL:
+        writeCall(instr);
+        break;
+
+        case IR_RET:
+        writeRet(instr);
+        break;
+
+        case IR_TRAP:
+        jitByte(0xCC);
+        break;
+    }
 }
 
-/// Push a value on the stack
-void pushVal(Value val)
+/// Give the phis their words for the next iteration. The moves form a
+/// permutation of the locations, whose cycles are broken through rax.
+void OptCompiler::writeLoopMoves()
 {
-    assert (stackPtr > stackLimit);
-    stackPtr--;
-    stackPtr[0] = val;
+    struct Move
+    {
+        Loc dst;
+        Loc src;
+        uint32_t constRef;
+    };
+
+    std::vector<Move> moves;
+    std::vector<Move> constMoves;
+
+    for (auto phi : builder.phis)
+    {
+        if (phi == NO_REF || ir[phi].op != IR_PHI || ir[phi].b == phi)
+            continue;
+
+        Move move;
+        move.dst = locs[phi];
+        move.constRef = NO_REF;
+
+        if (isConst(ir[phi].b))
+        {
+            move.constRef = ir[phi].b;
+            constMoves.push_back(move);
+        }
+        else if (!(locs[ir[phi].b] == locs[phi]))
+        {
+            move.src = locs[ir[phi].b];
+            moves.push_back(move);
+        }
+    }
+
+    while (!moves.empty())
+    {
+        // Moves to a location no other move reads from come first
+        auto itr = std::find_if(moves.begin(), moves.end(), [&](const Move& m) {
+            return std::none_of(moves.begin(), moves.end(), [&](const Move& other) {
+                return other.src == m.dst;
+            });
+        });
+
+        if (itr != moves.end())
+        {
+            this->move(itr->dst, itr->src);
+            moves.erase(itr);
+            continue;
+        }
+
+        Loc tmp;
+        tmp.reg = RAX;
+        this->move(tmp, moves.front().src);
+        moves.front().src = tmp;
+    }
+
+    for (auto& move : constMoves)
+    {
+        if (move.dst.reg >= 0)
+        {
+            loadImm((Reg)move.dst.reg, ir[move.constRef].imm);
+        }
+        else
+        {
+            loadImm(R11, ir[move.constRef].imm);
+            jitStore(RSP, slotDisp(move.dst.slot), R11);
+        }
+    }
 }
 
-Value popVal()
+/// Calls to the function last seen by the call site push its frame
+/// inline, and jump directly to its entry block. Other callees go
+/// through the runtime.
+void OptCompiler::writeCall(const IRInstr& instr)
 {
-    assert (stackPtr < stackBottom);
-    auto val = stackPtr[0];
-    stackPtr++;
-    return val;
+    auto ptr = (uint8_t*)instr.ptr;
+    auto operands = ptr;
+    auto numArgs = (int32_t)jitOperand<uint32_t>(ptr);
+    jitOperand<Value>(ptr);
+    auto ic = jitOperand<CallIC*>(ptr);
+    auto retCell = instr.retCell;
+
+    std::vector<uint8_t*> missSites;
+
+    if (ic->callee.isObject() && ic->jitEntry)
+    {
+        auto numLocals = (int32_t)ic->numLocals;
+
+        auto calleeCell = writeCodeVal(ic->callee);
+        jitMovImm(R11, (uint64_t)calleeCell);
+        jitLoad(RAX, REG_SP, 0);
+        jitMemOp(true, 0x3B, RAX, R11, 0);
+        missSites.push_back(jitJcc(CC_NE));
+        jitCmpTag(REG_SP, 0, TAG_OBJECT);
+        missSites.push_back(jitJcc(CC_NE));
+
+        // Stack overflows are reported by the runtime. The frame is
+        // pushed once the callee is popped.
+        auto frameSize = numLocals - numArgs + 3;
+        auto frameDisp = VAL_SIZE - VAL_SIZE * frameSize;
+        jitLea(RAX, REG_SP, frameDisp);
+        jitMovImm(R11, (uint64_t)&stackLimit);
+        jitMemOp(true, 0x3B, RAX, R11, 0);
+        missSites.push_back(jitJcc(CC_BE));
+
+        jitLoadVal(REG_SP, 0);
+
+        for (int32_t i = 1; i <= numLocals - numArgs; ++i)
+        {
+            jitMemOp(true, 0xC7, 0, REG_SP, VAL_SIZE - VAL_SIZE * i);
+            jitWrite((int32_t)0);
+            jitStoreTag(REG_SP, VAL_SIZE - VAL_SIZE * i, TAG_UNDEF);
+        }
+
+        auto prevBaseDisp = frameDisp + 2 * VAL_SIZE;
+        jitStore(REG_SP, prevBaseDisp, REG_BP);
+        jitStoreTag(REG_SP, prevBaseDisp, TAG_RETADDR);
+        jitMovImm(R11, (uint64_t)retCell);
+        jitStore(REG_SP, prevBaseDisp - VAL_SIZE, R11);
+        jitStoreTag(REG_SP, prevBaseDisp - VAL_SIZE, TAG_RETADDR);
+        jitStoreVal(REG_SP, frameDisp);
+
+        jitLea(REG_BP, REG_SP, VAL_SIZE * numArgs);
+        jitLea(REG_SP, REG_SP, frameDisp);
+        jitPatch(jitJmp(), ic->jitEntry);
+    }
+
+    for (auto site : missSites)
+        jitPatch(site, jitAlloc);
+
+    jitCallHelper((void*)jitCall, (uint64_t)operands, (uint64_t)retCell);
+    jitJmpReg(RAX);
 }
 
-/// Start/continue execution beginning at a current instruction
-Value execCode()
+/// The return value is written over the frame once the return address
+/// and caller base pointer are read
+void OptCompiler::writeRet(const IRInstr& instr)
 {
-    assert (instrPtr >= codeHeap);
-    assert (instrPtr < codeHeapLimit);
+    auto numLocals = (int32_t)instr.imm;
+    auto& val = instr.src;
 
-    // For each instruction to execute
-    for (;;)
+    bool inRcx = (
+        val.kind == IRVal::REF && !isConst(val.ref) && locs[val.ref].reg == RCX
+    );
+    auto prevBaseReg = inRcx? RDX:RCX;
+
+    jitLoad(RAX, REG_BP, -VAL_SIZE * (numLocals + 1));
+    jitLoad(prevBaseReg, REG_BP, -VAL_SIZE * numLocals);
+    storeVal(val, REG_BP, 0);
+
+    jitLea(REG_SP, REG_BP, 0);
+    jitRegOp(true, 0x8B, REG_BP, prevBaseReg);
+
+    // test rax, rax; jz exit; jmp [rax]
+    jitRegOp(true, 0x85, RAX, RAX);
+    jitPatch(jitJcc(CC_E), jitExit);
+    jitByte(0xFF);
+    jitByte(0x20);
+}
+
+/// Write the exits of the guards. The stack values tracked and the
+/// locals not in the frame are written to memory, the stack values
+/// first since they may be read from the frame.
+void OptCompiler::writeExits()
+{
+    for (auto& snap : snaps)
     {
-        auto& op = readCode<Opcode>();
+        if (snap.sites.empty())
+            continue;
 
-        switch (op)
+        for (auto site : snap.sites)
+            jitPatch(site, jitAlloc);
+
+        auto numVals = snap.stack.size();
+        for (size_t i = 0; i < numVals; ++i)
         {
-            case PUSH:
-            {
-                auto val = readCode<Value>();
-                pushVal(val);
-            }
-            break;
+            storeVal(
+                snap.stack[i],
+                REG_SP,
+                snap.spOff - VAL_SIZE * (int32_t)(i + 1)
+            );
+        }
 
-            case DUP:
+        for (auto& local : snap.locals)
+            storeVal(local.second, REG_BP, -VAL_SIZE * (int32_t)local.first);
+
+        for (auto idx : snap.phiLocals)
+        {
+            auto phi = builder.phis[idx];
+            if (!isTrivialPhi(phi))
             {
-                // Read the index of the value to duplicate
-                auto idx = readCode<uint16_t>();
-                auto val = stackPtr[idx];
-                pushVal(val);
+                storeVal(
+                    IRVal::word(phi, ir[phi].tag),
+                    REG_BP,
+                    -VAL_SIZE * (int32_t)idx
+                );
             }
+        }
+
+        auto stackOff = snap.spOff - VAL_SIZE * (int32_t)numVals;
+        if (stackOff != 0)
+            jitLea(REG_SP, REG_SP, stackOff);
+
+        switch (snap.kind)
+        {
+            // Count down the deoptimizations of the version, the last
+            // one discards the optimized code
+            case Snapshot::DEOPT:
+            jitMovImm(RAX, (uint64_t)&version->deoptCountdown);
+            jitMemOp(false, 0xFF, 1, RAX, 0);
+            jitPatch(jitJcc(CC_NE), snap.baseAddr);
+            jitCallHelper((void*)jitInvalidate, (uint64_t)version);
+            jitPatch(jitJmp(), snap.baseAddr);
             break;
 
-            case SUB_I64:
-            {
-                auto arg1 = popVal();
-                auto arg0 = popVal();
-                pushVal((int64_t)arg0 - (int64_t)arg1);
-            }
+            case Snapshot::BRANCH:
+            links.branch(jitJmp(), snap.target);
             break;
 
-            case GT_I64:
-            {
-                auto arg1 = popVal();
-                auto arg0 = popVal();
-                auto boolVal = (int64_t)arg0 > (int64_t)arg1;
-                pushVal(boolVal? Value::TRUE : Value::FALSE);
-            }
+            // The arguments and callee are on the stack
+            case Snapshot::CALL:
+            jitCallHelper((void*)jitCall, (uint64_t)snap.operands, (uint64_t)snap.retCell);
+            jitJmpReg(RAX);
             break;
+        }
+    }
+}
 
-            case JUMP:
-            {
-                auto& dstAddr = readCode<uint8_t*>();
+uint8_t* OptCompiler::compile()
+{
+    auto codeAddr = jitAlloc;
 
-                if (dstAddr < codeHeap || dstAddr >= codeHeapLimit)
-                {
-                    std::cout << "Patching jump" << std::endl;
+    // Jumps from the region to its first version go to the optimized
+    // code
+    version->jitPtr = codeAddr;
 
-                    auto dstVer = (BlockVersion*)dstAddr;
-                    if (!dstVer->startPtr)
-                        compile(dstVer);
+    builder.build();
 
-                    // Patch the jump
-                    dstAddr = dstVer->startPtr;
-                }
+    eliminateBoundsChecks();
+    removeDeadCode();
+    fuseCompares();
+    allocRegs();
 
-                instrPtr = dstAddr;
-            }
-            break;
+    builder.checks.writeChecks();
 
-            case IF_TRUE:
-            {
-                auto& thenAddr = readCode<uint8_t*>();
-                auto& elseAddr = readCode<uint8_t*>();
+    for (uint32_t i = 0; i < ir.size(); ++i)
+        writeInstr(i);
 
-                auto arg0 = popVal();
+    builder.checks.writeSlowPaths();
 
-                if (arg0 == Value::TRUE)
-                {
+    // The registers holding words are saved around the safepoint,
+    // except rbx which the helper preserves
+    if (safepointSite)
+    {
+        static const Reg savedRegs[] = { RAX, RCX, RDX, RSI, RDI, R8, R9, R10 };
 
-                   if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
-                   {
-                       std::cout << "Patching then target" << std::endl;
+        jitPatch(safepointSite, jitAlloc);
+        for (auto reg : savedRegs)
+        {
+            jitRex(false, 0, reg);
+            jitByte(0x50 | (reg & 7));
+        }
+        jitCallHelper((void*)jitSafepoint, 0);
+        for (auto i = std::end(savedRegs); i-- != std::begin(savedRegs);)
+        {
+            jitRex(false, 0, *i);
+            jitByte(0x58 | (*i & 7));
+        }
+        jitPatch(jitJmp(), safepointSite + 4);
+    }
 
-                       auto thenVer = (BlockVersion*)thenAddr;
-                       if (!thenVer->startPtr)
-                           compile(thenVer);
+    writeExits();
+    links.writeStubs();
 
-                       // Patch the jump
-                       thenAddr = thenVer->startPtr;
-                   }
+    return codeAddr;
+}
 
-                    instrPtr = thenAddr;
-                }
-                else
-                {
-                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
-                    {
-                       std::cout << "Patching else target" << std::endl;
+/// Recompile a hot block version with the optimizing tier, and
+/// redirect the entry of its baseline code to the optimized code
+uint8_t* jitOptimize(BlockVersion* version, uint64_t)
+{
+    return jitGuard([=]() {
+        auto baseAddr = version->jitPtr;
 
-                       auto elseVer = (BlockVersion*)elseAddr;
-                       if (!elseVer->startPtr)
-                           compile(elseVer);
+        // Versions whose optimized code was discarded too many times,
+        // or which cannot be optimized since the JIT heap is full, keep
+        // their baseline code. Their entry count wraps around.
+        if (version->numInvalidations >= MAX_REOPTIMIZATIONS || jitHeapFull)
+            return baseAddr;
 
-                       // Patch the jump
-                       elseAddr = elseVer->startPtr;
-                    }
+        version->baseJitPtr = baseAddr;
+        version->deoptCountdown = DEOPT_THRESHOLD;
 
-                    instrPtr = elseAddr;
-                }
-            }
-            break;
+        auto startAddr = jitAlloc;
+        uint8_t* optAddr;
 
-            case RET:
-            {
-                // TODO:
-                // Get the caller function, base pointer adjustment
+        try
+        {
+            OptCompiler compiler(version);
+            optAddr = compiler.compile();
+        }
+        catch (JitHeapFull&)
+        {
+            jitAlloc = startAddr;
+            jitHeapFull = true;
+            version->jitPtr = baseAddr;
+            return baseAddr;
+        }
+        catch (OptAbort&)
+        {
+            jitAlloc = startAddr;
+            version->jitPtr = baseAddr;
+            return baseAddr;
+        }
 
-                // Get the return address
-                auto retAddrVal = basePtr[1];
-                auto retAddr = retAddrVal.getWord().ptr;
+        memcpy(version->baseEntryBytes, baseAddr, sizeof(version->baseEntryBytes));
+        baseAddr[0] = 0xE9;
+        jitPatch(baseAddr + 1, optAddr);
 
-                // Pop the return value
-                auto val = popVal();
+        return optAddr;
+    });
+}
 
-                // If this is a top-level return
-                if (retAddr == nullptr)
-                {
-                    return val;
-                }
-                else
-                {
-                    // TODO
-                    assert (false);
-                }
-            }
-            break;
+/// Discard the optimized code of a version which deoptimizes too
+/// often. The version runs its baseline code again, and gets optimized
+/// anew once hot, with the inline caches updated by the baseline code.
+uint8_t* jitInvalidate(BlockVersion* version, uint64_t)
+{
+    auto optAddr = version->jitPtr;
+    auto baseAddr = version->baseJitPtr;
+    assert (optAddr != baseAddr);
 
-            default:
-            assert (false && "unhandled instruction in interpreter loop");
-        }
+    // Branches already linked to the optimized code go through
+    // its entry, which now jumps to the baseline code
+    memcpy(baseAddr, version->baseEntryBytes, sizeof(version->baseEntryBytes));
+    optAddr[0] = 0xE9;
+    jitPatch(optAddr + 1, baseAddr);
+
+    version->jitPtr = baseAddr;
+    version->optCountdown = std::max(optThreshold, (uint32_t)1);
+    version->numInvalidations++;
 
+    return nullptr;
+}
+
+/// Reserve the address range of the JIT heap, map its first chunk,
+/// and write the trampolines entering and leaving JIT code. If
+/// executable memory cannot be allocated, the interpreter is used
+/// instead.
+void initJit()
+{
+    auto mem = mmap(
+        nullptr,
+        JIT_HEAP_MAX_SIZE,
+        PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+    {
+        useJit = false;
+        return;
     }
 
-    assert (false);
+    jitHeap = (uint8_t*)mem;
+    jitHeapLimit = jitHeap;
+    jitHeapEnd = jitHeap + JIT_HEAP_MAX_SIZE;
+    jitAlloc = jitHeap;
+
+    try
+    {
+        growJitHeap();
+    }
+    catch (JitHeapFull&)
+    {
+        useJit = false;
+        return;
+    }
+
+#ifdef THREADED_DISPATCH
+    for (size_t op = 0; op < NUM_OPCODES; ++op)
+    {
+        if (opHandlers[op])
+            handlerOps[opHandlers[op]] = (Opcode)op;
+    }
+#endif
+
+    // Save the callee-saved registers used, and reserve the slots
+    // optimized code spills registers to. The native stack stays
+    // aligned for helper calls.
+    jitEnter = (void (*)(uint8_t*))jitAlloc;
+    for (auto reg : { RBX, R12, R13, R14, R15 })
+    {
+        jitRex(false, 0, reg);
+        jitByte(0x50 | (reg & 7));
+    }
+    jitRegOp(true, 0x81, 5, RSP);
+    jitWrite<int32_t>(JIT_SPILL_SLOTS * sizeof(Word));
+
+    jitMovImm(REG_SP_ADDR, (uint64_t)&stackPtr);
+    jitMovImm(REG_BP_ADDR, (uint64_t)&basePtr);
+    jitReload();
+    jitJmpReg(RDI);
+
+    jitExit = jitAlloc;
+    jitSpill();
+    jitRegOp(true, 0x81, 0, RSP);
+    jitWrite<int32_t>(JIT_SPILL_SLOTS * sizeof(Word));
+    for (auto reg : { R15, R14, R13, R12, RBX })
+    {
+        jitRex(false, 0, reg);
+        jitByte(0x58 | (reg & 7));
+    }
+    jitByte(0xC3);
 }
 
-/// Begin the execution of a function (top-level call)
+#endif // HAVE_JIT
+
+/// Begin the execution of a function (top-level call). This may be
+/// called reentrantly from host functions running under execCode.
 Value callFun(Object fun, ValueVec args)
 {
     static ICache numParamsIC("num_params");
@@ -1430,67 +8243,49 @@ Value callFun(Object fun, ValueVec args)
     assert (args.size() <= numParams);
     assert (numParams <= numLocals);
 
-    std::cout << "pushing RA" << std::endl;
-
-    // Push the caller function and return address
-    // Note: these are placeholders because we are doing a toplevel call
-    assert (stackPtr == stackBottom);
-    pushVal(Value(0));
-    pushVal(Value(nullptr, TAG_RETADDR));
-
-    // Initialize the base pointer (used to access locals)
-    basePtr = stackPtr - 1;
-
-    // Push space for the local variables
-    stackPtr -= numLocals;
-    assert (stackPtr >= stackLimit);
+    // Save the state of the interpreter, if it is running
+    auto prevInstrPtr = instrPtr;
+    auto prevStackPtr = stackPtr;
 
-    std::cout << "pushing locals" << std::endl;
-
-    // Copy the arguments into the locals
+    // Push the arguments. There is no return address since this is
+    // a top-level call.
     for (size_t i = 0; i < args.size(); ++i)
-    {
-        //std::cout << "  " << args[i].toString() << std::endl;
-        basePtr[i] = args[i];
-    }
+        pushVal(args[i]);
+    basePtr = pushFrame(fun, args.size(), numLocals, nullptr);
 
     // Get the function entry block
     static ICache entryIC("entry");
     auto entryBlock = entryIC.getObj(fun);
 
-    auto entryVer = getBlockVersion(entryBlock);
+    auto entryVer = getEntryVersion(entryBlock, numParams, numLocals);
 
     // Generate code for the entry block version
-    compile(entryVer);
+    if (!entryVer->startPtr)
+        compile(entryVer);
     assert (entryVer->length() > 0);
 
-    std::cout << "Starting top-level unit execution" << std::endl;
-
-    // Begin execution at the entry block
-    instrPtr = entryVer->startPtr;
-    auto retVal = execCode();
+    Value retVal;
 
-    // Pop the local variables, return address and calling function
-    stackPtr += numLocals;
-    stackPtr += 2;
-    assert (stackPtr == stackBottom);
+#ifdef HAVE_JIT
+    if (useJit && countEntry(entryVer) && getJitCode(entryVer))
+    {
+        retVal = runJit(entryVer->jitPtr);
+    }
+    else
+#endif
+    {
+        // Begin execution at the entry block
+        instrPtr = entryVer->startPtr;
+        retVal = execCode();
+    }
 
-    return retVal;
-}
+    // Pop the return value, the frame was popped on return
+    popVal();
+    assert (stackPtr == prevStackPtr);
 
-/// Call a function exported by a package
-Value callExportFnNew(
-    Object pkg,
-    std::string fnName,
-    ValueVec args = ValueVec()
-)
-{
-    assert (pkg.hasField(fnName));
-    auto fnVal = pkg.getField(fnName);
-    assert (fnVal.isObject());
-    auto funObj = Object(fnVal);
+    instrPtr = prevInstrPtr;
 
-    return callFun(funObj, args);
+    return retVal;
 }
 
 Value testRunImageNew(std::string fileName)
@@ -1499,14 +8294,40 @@ Value testRunImageNew(std::string fileName)
 
     auto pkg = parseFile(fileName);
 
-    return callExportFnNew(pkg, "main");
+    return callFun(getExportFn(pkg, "main"), ValueVec());
 }
 
 void testInterpNew()
 {
+    std::cout << "block versioning interpreter tests" << std::endl;
+
     assert (testRunImageNew("tests/vm/ex_ret_cst.zim") == Value(777));
     assert (testRunImageNew("tests/vm/ex_loop_cnt.zim") == Value(0));
-    //assert (testRunImageNew("tests/vm/ex_image.zim") == Value(10));
-    //assert (testRunImageNew("tests/vm/ex_rec_fact.zim") == Value(5040));
-    //assert (testRunImageNew("tests/vm/ex_fibonacci.zim") == Value(377));
+    assert (testRunImageNew("tests/vm/ex_image.zim") == Value(10));
+    assert (testRunImageNew("tests/vm/ex_rec_fact.zim") == Value(5040));
+    assert (testRunImageNew("tests/vm/ex_fibonacci.zim") == Value(377));
+    assert (testRunImageNew("tests/vm/ex_field_ic.zim") == Value(10));
+    assert (testRunImageNew("tests/vm/ex_str_ops.zim") == Value(-1176));
+    assert (testRunImageNew("tests/vm/ex_type_tests.zim") == Value(18));
+
+    // Blocks past the version cap use their generic version
+    auto numVersions = maxVersions;
+    maxVersions = 0;
+    assert (testRunImageNew("tests/vm/ex_type_tests.zim") == Value(18));
+    maxVersions = numVersions;
+}
+
+/// Call a function exported by a package
+Value callExportFn(
+    Object pkg,
+    std::string fnName,
+    ValueVec args
+)
+{
+    auto fun = getExportFn(pkg, fnName);
+
+    if (useCallInterp)
+        return call(fun, args);
+
+    return callFun(fun, args);
 }
@@ -5,6 +5,21 @@
 
 typedef std::vector<Value> ValueVec;
 
+/// Run code with the call() interpreter instead of the block
+/// versioning interpreter
+extern bool useCallInterp;
+
+/// Run hot block versions as native code, on hosts which support it
+extern bool useJit;
+
+/// Entry counts after which block versions run in JIT code, and
+/// after which their JIT code is optimized
+extern uint32_t jitThreshold;
+extern uint32_t optThreshold;
+
+/// Maximum number of type-specialized versions per block
+extern size_t maxVersions;
+
 /// Initialize the interpreter
 void initInterp();
 
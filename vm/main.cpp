@@ -1,4 +1,7 @@
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <exception>
@@ -6,13 +9,77 @@
 #include "interp.h"
 #include "core.h"
 
+/// Parse the value of a count option, a non-negative integer
+uint32_t parseCountOpt(const char* optName, const char* str)
+{
+    char* end = nullptr;
+    errno = 0;
+    auto val = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0' || errno == ERANGE ||
+        val < 0 || val > UINT32_MAX)
+    {
+        throw RunError(
+            std::string("invalid value for ") + optName + ": \"" + str +
+            "\", expected a non-negative integer"
+        );
+    }
+
+    return (uint32_t)val;
+}
+
 int main(int argc, char** argv)
 {
     try
     {
+        // Parse the interpreter options preceding the file name.
+        // The block versioning interpreter is used by default, with
+        // its hot block versions compiled by the JIT. Hosts without the
+        // JIT use the call() interpreter, which can also be selected.
+        while (argc >= 2)
+        {
+            if (strcmp(argv[1], "--call-interp") == 0)
+            {
+                useCallInterp = true;
+                argv++;
+                argc--;
+            }
+            else if (strcmp(argv[1], "--no-jit") == 0)
+            {
+                useJit = false;
+                argv++;
+                argc--;
+            }
+            else if (argc >= 3 && strcmp(argv[1], "--max-versions") == 0)
+            {
+                maxVersions = parseCountOpt(argv[1], argv[2]);
+                argv += 2;
+                argc -= 2;
+            }
+            else if (argc >= 3 && strcmp(argv[1], "--jit-threshold") == 0)
+            {
+                jitThreshold = parseCountOpt(argv[1], argv[2]);
+                argv += 2;
+                argc -= 2;
+            }
+            else if (argc >= 3 && strcmp(argv[1], "--opt-threshold") == 0)
+            {
+                optThreshold = parseCountOpt(argv[1], argv[2]);
+                argv += 2;
+                argc -= 2;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        // The interpreter is initialized once its options are known,
+        // so that the JIT heap only gets allocated if the JIT is used
         //initRuntime();
         //initParser();
         initInterp();
+        initCore();
 
         // If we are in test mode
         if (argc == 2 && strcmp(argv[1], "--test") == 0)
@@ -29,6 +96,10 @@ int main(int argc, char** argv)
             auto fileName = argv[1];
             auto pkg = load(fileName);
 
+            // Keep the package alive while its functions run
+            Value pkgVal = pkg;
+            GCRoot pkgRoot(pkgVal);
+
             // Initialize the package
             if (pkg.hasField("init"))
             {
@@ -36,9 +107,10 @@ int main(int argc, char** argv)
             }
 
             // Call the main function, if present
-            if (pkg.hasField("main"))
+            // Note: the package object may have been moved by the GC
+            if (Object(pkgVal).hasField("main"))
             {
-                auto retVal = callExportFn(pkg, "main");
+                auto retVal = callExportFn(pkgVal, "main");
                 return (int64_t)retVal;
             }
 
@@ -345,6 +345,10 @@ Value parseStringLit(Input& input, char endCh)
         str += ch;
     }
 
+    // Identifier strings are likely to be used as field names
+    if (isValidIdent(str))
+        return String::intern(str);
+
     return String(str);
 }
 
@@ -539,7 +543,7 @@ Value parseExpr(Input& input)
     if (input.match('@'))
     {
         // Produce an image reference placeholder
-        return ImgRef(parseIdentStr(input));
+        return ImgRef(String::intern(parseIdentStr(input)));
     }
 
     // Special values
@@ -589,7 +593,7 @@ Value parseExpr(Input& input)
 Process a value which is potentially a reference
 */
 Value processRef(
-    std::unordered_map<std::string, Value>& globalDefs,
+    std::unordered_map<String, Value, StringHash>& globalDefs,
     std::vector<Value>& visitStack,
     Value val
 )
@@ -598,15 +602,14 @@ Value processRef(
     if (val.getTag() == TAG_IMGREF)
     {
         auto ref = ImgRef(val);
-        auto varName = ref.getName();
 
         // Get the value of this reference
-        auto refVal = globalDefs.find(varName);
+        auto refVal = globalDefs.find(ref.getSymbol());
 
         if (refVal == globalDefs.end())
         {
             throw ParseError(
-                "unresolved reference to \"" + varName + "\""
+                "unresolved reference to \"" + ref.getName() + "\""
             );
         }
 
@@ -629,7 +632,7 @@ Value processRef(
 Resolve the references in values exported by the image
 */
 Value resolveRefs(
-    std::unordered_map<std::string, Value>& globalDefs,
+    std::unordered_map<String, Value, StringHash>& globalDefs,
     Value exportsTree
 )
 {
@@ -718,7 +721,8 @@ Value resolveRefs(
 Value parseInput(Input& input)
 {
     // Global definitions
-    std::unordered_map<std::string, Value> globalDefs;
+    // Note: the names are interned, so they never move
+    std::unordered_map<String, Value, StringHash> globalDefs;
 
     // Until done parsing all expressions
     for (;;)
@@ -730,7 +734,7 @@ Value parseInput(Input& input)
         if (input.peek() != '_' && !isalpha(input.peek()))
             break;
 
-        std::string ident = parseIdentStr(input);
+        auto ident = String::intern(parseIdentStr(input));
 
         // Match the assignment operator
         input.eatWS();
@@ -752,7 +756,10 @@ Value parseInput(Input& input)
         // A global name can only be associated with one definition
         if (globalDefs.find(ident) != globalDefs.end())
         {
-            throw ParseError(input, "redefinition of \"" + ident + "\"");
+            throw ParseError(
+                input,
+                "redefinition of \"" + (std::string)ident + "\""
+            );
         }
 
         // Add the value to the global definitions map
@@ -1,8 +1,10 @@
 #include <cassert>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include "runtime.h"
+#include "gc.h"
 
 /// Undefined value constant
 const Value Value::UNDEF(Word((int64_t)0), TAG_UNDEF);
@@ -19,12 +21,6 @@ const Value Value::TWO(2l);
 // Global virtual machine instance
 VM vm;
 
-Value::Value(Word w, Tag t)
-{
-    word = w;
-    tag = t;
-}
-
 /// Produce a string representation of a value
 std::string Value::toString() const
 {
@@ -70,18 +66,6 @@ bool Value::isPointer() const
     }
 }
 
-Value::operator bool () const
-{
-    assert (tag == TAG_BOOL);
-    return word.int64? 1:0;
-}
-
-Value::operator int64_t () const
-{
-    assert (tag == TAG_INT64);
-    return word.int64;
-}
-
 Value::operator refptr () const
 {
     assert (isPointer());
@@ -94,36 +78,593 @@ Value::operator std::string () const
     return String(*this);
 }
 
+void Pool::init(size_t cellSize)
+{
+    // Free cells need room for the header and the free list link
+    assert (cellSize >= 2 * sizeof(Word));
+    assert (cellSize % sizeof(Word) == 0);
+    assert (cellSize <= CHUNK_SIZE);
+    this->cellSize = cellSize;
+
+    // Round the chunk size down to a whole number of cells
+    this->chunkSize = CHUNK_SIZE - (CHUNK_SIZE % cellSize);
+}
+
+/**
+Allocate a cell when there are no free cells left to reuse, sweeping
+the chunks left to sweep, or growing the pool by one chunk.
+This is the slow path of Pool::alloc.
+*/
+refptr Pool::allocSlow()
+{
+    assert (cellSize > 0);
+
+    size_t maxChunks = 1;
+    while (!sweep(maxChunks))
+    {
+        if (freeList)
+            return popFree();
+        maxChunks = 1;
+    }
+
+    if (freeList)
+        return popFree();
+
+    // Chunks are zeroed out in bulk at allocation time
+    auto chunk = (uint8_t*)calloc(1, chunkSize);
+
+    if (!chunk)
+    {
+        throw RunError("failed to allocate pool memory chunk");
+    }
+
+    chunks.push_back(chunk);
+
+    curChunk = chunk;
+    allocPtr = chunk + cellSize;
+    allocLimit = chunk + chunkSize;
+
+    return chunk;
+}
+
+void Pool::sweepChunk(size_t idx)
+{
+    auto chunk = chunks[idx];
+
+    // Cells past the allocation pointer were never allocated
+    auto limit = (chunk == curChunk)? allocPtr:(chunk + chunkSize);
+
+    auto chunkFreeList = freeList;
+    size_t numLive = 0;
+
+    for (auto ptr = chunk; ptr < limit; ptr += cellSize)
+    {
+        auto& header = *(uint64_t*)ptr;
+
+        if (header & HEADER_MSK_MARK)
+        {
+            header &= ~(HEADER_MSK_MARK | HEADER_MSK_SCANNED);
+            numLive++;
+            continue;
+        }
+
+        if (header != 0)
+        {
+            header = 0;
+            numCells--;
+        }
+
+        *(uint8_t**)(ptr + sizeof(uint8_t*)) = freeList;
+        freeList = ptr;
+    }
+
+    // Give back chunks with no live cells, except the current one
+    if (numLive == 0 && chunk != curChunk)
+    {
+        freeList = chunkFreeList;
+        ::free(chunk);
+        chunks[idx] = nullptr;
+    }
+}
+
+void Pool::startSweep()
+{
+    assert (sweepIdx == sweepEnd);
+
+    // The free list gets rebuilt as the chunks are swept
+    freeList = nullptr;
+    sweepIdx = 0;
+    sweepEnd = chunks.size();
+
+    // The current chunk is swept right away, since cells allocated
+    // from it from now on will not be marked
+    if (curChunk)
+    {
+        assert (chunks.back() == curChunk);
+        sweepChunk(--sweepEnd);
+    }
+}
+
+bool Pool::sweep(size_t& maxChunks)
+{
+    for (; maxChunks > 0 && sweepIdx < sweepEnd; --maxChunks)
+        sweepChunk(sweepIdx++);
+
+    if (sweepIdx < sweepEnd)
+        return false;
+
+    // Remove the chunks given back from the chunk list
+    if (sweepEnd > 0)
+    {
+        chunks.erase(
+            std::remove(chunks.begin(), chunks.end(), nullptr),
+            chunks.end()
+        );
+        sweepIdx = sweepEnd = 0;
+    }
+
+    return true;
+}
+
+GCRoot::GCRoot(Value& val)
+: val(val),
+  prev(vm.hostRoots)
+{
+    vm.hostRoots = this;
+}
+
+GCRoot::~GCRoot()
+{
+    assert (vm.hostRoots == this);
+    vm.hostRoots = prev;
+}
+
+/**
+Size class index for each object size in words. Sizes up to 16 words
+each have their own class, larger sizes are rounded up to the next of
+20, 24, 28, 32, 40, 48, 56 and 64 words.
+*/
+const uint8_t VM::sizeClasses[VM::MAX_POOL_WORDS + 1] = {
+     0,  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13,
+    14, 15, 15, 15, 15, 16, 16, 16, 16, 17, 17, 17, 17, 18, 18, 18,
+    18, 19, 19, 19, 19, 19, 19, 19, 19, 20, 20, 20, 20, 20, 20, 20,
+    20, 21, 21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22,
+    22
+};
+
 VM::VM()
 {
+    // Cell sizes in words for each size class
+    static const size_t poolWords[NUM_POOLS] = {
+        2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+        20, 24, 28, 32, 40, 48, 56, 64
+    };
+
+    for (size_t i = 0; i < NUM_POOLS; ++i)
+        pools[i].init(poolWords[i] * sizeof(Word));
+
+    assert (pools[sizeClasses[MAX_POOL_WORDS]].getCellSize() ==
+            MAX_POOL_WORDS * sizeof(Word));
+
+    // Allocate the nursery, which gets zeroed out after each collection
+    nurseryStart = (uint8_t*)calloc(1, NURSERY_SIZE);
+    nurseryPtr = nurseryStart;
+    nurseryLimit = nurseryStart + NURSERY_SIZE;
+
+    internTable.resize(INTERN_TABLE_INIT_SIZE);
+
+    gcRequested = false;
+}
+
+VM::~VM()
+{
+    // Stop the marker threads
+    delete marker;
+}
+
+refptr VM::allocOld(size_t& size, Tag tag)
+{
+    size_t numWords = (size + sizeof(Word) - 1) / sizeof(Word);
+
+    refptr ptr;
+
+    if (numWords <= MAX_POOL_WORDS)
+    {
+        // Allocating may sweep chunks of the pool, freeing cells
+        auto& pool = pools[sizeClasses[numWords]];
+        auto numCells = pool.getNumCells();
+        ptr = pool.alloc();
+        size = pool.getCellSize();
+        bytesAllocated -= (numCells + 1 - pool.getNumCells()) * size;
+    }
+    else
+    {
+        size = numWords * sizeof(Word);
+        ptr = allocLarge(size);
+    }
+
+    // Objects allocated while marking are allocated black, since they
+    // can only reference objects which are marked or allocated later
+    uint64_t header = tag | ((uint64_t)size << (8 * HEADER_OF_SIZE));
+    if (marking)
+        header |= HEADER_MSK_MARK | HEADER_MSK_SCANNED;
+    *(uint64_t*)ptr = header;
+
+    bytesAllocated += size;
+
+    if (bytesAllocated >= gcThreshold)
+        gcRequested = true;
+
+    return ptr;
+}
+
+/**
+Allocate a block which could not be bump-allocated in the nursery.
+This is the slow path of VM::alloc.
+*/
+refptr VM::allocSlow(size_t& size, Tag tag)
+{
+    // If the nursery is full, a nursery collection is needed, but
+    // until the next safepoint, objects get allocated in the old space
+    if (size <= MAX_NURSERY_OBJ)
+    {
+        nurseryFull = true;
+        gcRequested = true;
+    }
+
+    return allocOld(size, tag);
 }
 
 /**
-Allocates a block of memory
-Note that this function guarantees that the memory is zeroed out
+Allocate a large object outside of the pools
 */
-Value VM::alloc(uint32_t size, Tag tag)
+refptr VM::allocLarge(size_t size)
 {
-    // FIXME: use an alloc pool of some kind
     auto ptr = (refptr)calloc(1, size);
 
-    // Set the tag in the object header
-    *(Tag*)ptr = tag;
+    if (!ptr)
+    {
+        throw RunError("failed to allocate large heap object");
+    }
+
+    largeObjs.push_back(ptr);
+
+    return ptr;
+}
+
+void VM::remember(refptr obj)
+{
+    if (loadHeader(obj) & HEADER_MSK_REMEMBERED)
+        return;
+
+    setHeaderBits(obj, HEADER_MSK_REMEMBERED);
+    rememberedSet.push_back(obj);
+}
+
+void VM::visitRoot(Wrapper& wrapper)
+{
+    visitRoot(wrapper.val);
+}
+
+refptr VM::visitPtr(refptr ptr)
+{
+    if (inMinorGC)
+        return isYoung(ptr)? promote(ptr):ptr;
+
+    // The nursery is always empty when marking starts
+    assert (marking && !isYoung(ptr));
+
+    if (markGrey(ptr))
+        greyObjs.push_back(ptr);
+
+    return ptr;
+}
+
+refptr VM::promote(refptr ptr)
+{
+    auto header = *(uint64_t*)ptr;
+
+    // If the object was already promoted, get its new address
+    if (header & HEADER_MSK_FWD)
+        return *(refptr*)(ptr + OBJ_OF_NEXT);
+
+    size_t size = *(uint32_t*)(ptr + HEADER_OF_SIZE);
+    auto objSize = size;
+    auto newPtr = allocOld(size, *(Tag*)ptr);
+
+    // The header was initialized by allocOld, copy the fields and
+    // the flags which are kept when an object moves
+    memcpy(newPtr + HEADER_SIZE, ptr + HEADER_SIZE, objSize - HEADER_SIZE);
+    *(uint64_t*)newPtr |= header & (
+        HEADER_MSK_NEXT | HEADER_MSK_AUX | HEADER_MSK_INDIRECT
+    );
+
+    // Leave a forwarding pointer behind
+    *(uint64_t*)ptr = header | HEADER_MSK_FWD;
+    *(refptr*)(ptr + OBJ_OF_NEXT) = newPtr;
 
-    // Wrap the pointer in a tagged value
-    return Value(ptr, tag);
+    markStack.push_back(newPtr);
+
+    return newPtr;
+}
+
+void VM::traceObj(refptr ptr)
+{
+    auto header = *(uint64_t*)ptr;
+
+    // Extended arrays and objects have their fields stored in the
+    // object pointed to by the next pointer, which overlaps with the
+    // capacity and length fields of the original object
+    if (header & HEADER_MSK_NEXT)
+    {
+        visitRoot(*(refptr*)(ptr + OBJ_OF_NEXT));
+        return;
+    }
+
+    switch (*(Tag*)ptr)
+    {
+        case TAG_STRING:
+        if (header & HEADER_MSK_INDIRECT)
+        {
+            visitRoot(*(refptr*)(ptr + String::OF_LEFT));
+
+            // Slices and flattened ropes have no right string
+            auto& right = *(refptr*)(ptr + String::OF_RIGHT);
+            if (right)
+                visitRoot(right);
+        }
+        break;
+
+        case TAG_ARRAY:
+        {
+            auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto words = (Word*)(ptr + Array::OF_DATA);
+            auto tags  = (Tag*) (ptr + Array::OF_DATA + cap * sizeof(Word));
+
+            for (size_t i = 0; i < len; ++i)
+            {
+                Value val(words[i], tags[i]);
+                visitRoot(val);
+                words[i] = val.getWord();
+            }
+        }
+        break;
+
+        case TAG_OBJECT:
+        {
+            auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+            auto words = (Word*)(ptr + Object::OF_FIELDS);
+            auto tags  = (Tag*) (ptr + Object::OF_FIELDS + cap * sizeof(Word));
+
+            for (size_t i = 0; i < cap; ++i)
+            {
+                Value val(words[i], tags[i]);
+                visitRoot(val);
+                words[i] = val.getWord();
+            }
+        }
+        break;
+
+        case TAG_IMGREF:
+        visitRoot(*(refptr*)(ptr + ImgRef::OF_SYM));
+        break;
+
+        default:
+        assert (false && "unknown object type in traceObj");
+    }
+}
+
+void VM::visitRoots()
+{
+    for (auto rootFn : rootFns)
+        rootFn();
+
+    // Interned strings are old, and only need to be visited when
+    // marking the old space
+    if (!inMinorGC)
+    {
+        for (auto& entry : internTable)
+            if (entry.str)
+                visitRoot(entry.str);
+    }
+
+    for (auto root = hostRoots; root != nullptr; root = root->prev)
+        visitRoot(root->val);
+}
+
+void VM::collectNursery()
+{
+    inMinorGC = true;
+
+    // Old objects written with pointers into the nursery are roots
+    for (auto ptr : rememberedSet)
+    {
+        clearHeaderBits(ptr, HEADER_MSK_REMEMBERED);
+        markStack.push_back(ptr);
+    }
+    rememberedSet.clear();
+
+    // Promote the objects reachable from the roots, and
+    // the objects reachable from those
+    visitRoots();
+    while (!markStack.empty())
+    {
+        auto ptr = markStack.back();
+        markStack.pop_back();
+        traceObj(ptr);
+    }
+
+    // All survivors were promoted, the nursery can be reused
+    memset(nurseryStart, 0, nurseryPtr - nurseryStart);
+    nurseryPtr = nurseryStart;
+    nurseryFull = false;
+
+    inMinorGC = false;
+    numMinorCollections++;
+}
+
+void VM::scanBeforeWrite(refptr obj)
+{
+    // If a marker thread is scanning the object, this waits for it
+    if (claimScan(obj, true))
+        scanObj(obj, greyObjs);
+
+    if (greyObjs.size() >= GREY_BUFFER_SIZE)
+        flushGreyObjs();
+}
+
+void VM::flushGreyObjs()
+{
+    marker->push(greyObjs);
+}
+
+void VM::startMarking()
+{
+    assert (!marking);
+
+    // Mark bits left over from the last cycle must be cleared
+    sweepStep(SIZE_MAX);
+
+    // Evacuate the nursery, so that marking only needs to consider
+    // the old space. Objects allocated from now on are either in the
+    // nursery or allocated black.
+    collectNursery();
+
+    if (!marker)
+        marker = new Marker();
+
+    marking = true;
+    visitRoots();
+    flushGreyObjs();
+
+    // Poll for completion, in case there was nothing to mark
+    gcRequested = true;
+}
+
+void VM::awaitMarking()
+{
+    assert (marking);
+
+    flushGreyObjs();
+
+    while (!marker->isDone())
+        std::this_thread::yield();
+
+    finishMarking();
+}
+
+void VM::finishMarking()
+{
+    assert (marking && greyObjs.empty() && marker->isDone());
+    marking = false;
+
+    // Sweep the large objects right away
+    size_t numLarge = 0;
+    for (auto ptr : largeObjs)
+    {
+        auto& header = *(uint64_t*)ptr;
+
+        if (header & HEADER_MSK_MARK)
+        {
+            header &= ~(HEADER_MSK_MARK | HEADER_MSK_SCANNED);
+            largeObjs[numLarge++] = ptr;
+            continue;
+        }
+
+        bytesAllocated -= *(uint32_t*)(ptr + HEADER_OF_SIZE);
+        free(ptr);
+    }
+    largeObjs.resize(numLarge);
+
+    // The pools get swept lazily, a full collection must not be
+    // triggered again before the sweep is complete
+    for (auto& pool : pools)
+        pool.startSweep();
+    sweeping = true;
+    sweepPoolIdx = 0;
+    gcThreshold = SIZE_MAX;
+
+    numCollections++;
+}
+
+void VM::sweepStep(size_t maxChunks)
+{
+    if (!sweeping)
+        return;
+
+    for (; sweepPoolIdx < NUM_POOLS; ++sweepPoolIdx)
+    {
+        auto& pool = pools[sweepPoolIdx];
+        auto numCells = pool.getNumCells();
+        auto done = pool.sweep(maxChunks);
+        bytesAllocated -= (numCells - pool.getNumCells()) * pool.getCellSize();
+
+        if (!done)
+            return;
+    }
+
+    sweeping = false;
+
+    // Let the heap grow before the next full collection
+    gcThreshold = std::max((size_t)MIN_GC_THRESHOLD, 2 * bytesAllocated);
+}
+
+void VM::gcStep()
+{
+    gcRequested = false;
+
+    if (nurseryFull)
+        collectNursery();
+
+    if (marking)
+    {
+        flushGreyObjs();
+
+        if (marker->isDone())
+            finishMarking();
+    }
+
+    if (sweeping)
+    {
+        sweepStep(SWEEP_STEP_CHUNKS);
+
+        // Keep sweeping at the next safepoints
+        if (sweeping)
+            gcRequested = true;
+    }
+
+    if (!marking && !sweeping && bytesAllocated >= gcThreshold)
+        startMarking();
+}
+
+void VM::collect(bool full)
+{
+    if (!full)
+    {
+        collectNursery();
+        gcStep();
+        return;
+    }
+
+    // Complete the marking in progress, if any, then mark from scratch
+    if (marking)
+        awaitMarking();
+    startMarking();
+    awaitMarking();
+
+    sweepStep(SIZE_MAX);
 }
 
 void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
 {
-    // Get the object header
-    auto header = *(uint64_t*)obj;
+    vm.writeBarrier(obj, Value(nextPtr, *(Tag*)obj));
 
     // Set the next pointer
     *(refptr*)(obj + OBJ_OF_NEXT) = nextPtr;
 
     // Set the next pointer flag bit in the object header
-    *(uint64_t*)(obj) = header | HEADER_MSK_NEXT;
+    setHeaderBits(obj, HEADER_MSK_NEXT);
 }
 
 refptr Wrapper::getNextPtr(refptr obj, refptr notFound)
@@ -179,31 +720,183 @@ uint32_t String::length() const
     return len;
 }
 
-const char* String::getDataPtr() const
+const char* String::getDataPtr() const
+{
+    auto ptr = (refptr)val;
+    assert (ptr != nullptr);
+
+    if (loadHeader(ptr) & HEADER_MSK_INDIRECT)
+    {
+        // Rope nodes get flattened into slices
+        if (*(refptr*)(ptr + OF_RIGHT))
+            flatten(ptr);
+
+        auto base = *(refptr*)(ptr + OF_LEFT);
+        auto start = *(uint32_t*)(ptr + OF_START);
+        return (char*)(base + OF_DATA + start);
+    }
+
+    auto strdata = (char*)(ptr + OF_DATA);
+    return strdata;
+}
+
+void String::flatten(refptr rope)
+{
+    auto len = *(uint32_t*)(rope + OF_LEN);
+    auto flatVal = vm.alloc(memSize(len), TAG_STRING);
+    auto flatPtr = (refptr)flatVal;
+    *(uint32_t*)(flatPtr + OF_LEN) = len;
+
+    // Copy the flat strings from left to right, using an explicit
+    // stack since ropes built in loops can be very deep
+    auto dst = (char*)(flatPtr + OF_DATA);
+    std::vector<refptr> stack = { rope };
+
+    while (!stack.empty())
+    {
+        auto ptr = stack.back();
+        stack.pop_back();
+
+        // Rope nodes which are not flattened yet
+        if ((loadHeader(ptr) & HEADER_MSK_INDIRECT) && *(refptr*)(ptr + OF_RIGHT))
+        {
+            stack.push_back(*(refptr*)(ptr + OF_RIGHT));
+            stack.push_back(*(refptr*)(ptr + OF_LEFT));
+            continue;
+        }
+
+        // Flat strings and slices
+        String part = Value(ptr, TAG_STRING);
+        auto partLen = part.length();
+        memcpy(dst, part.getDataPtr(), partLen);
+        dst += partLen;
+    }
+
+    assert (dst == (char*)(flatPtr + OF_DATA) + len);
+
+    // The rope node becomes a slice of the whole flat string
+    vm.writeBarrier(rope, flatVal);
+    *(refptr*)(rope + OF_LEFT) = flatPtr;
+    *(refptr*)(rope + OF_RIGHT) = nullptr;
+    assert (*(uint32_t*)(rope + OF_START) == 0);
+}
+
+uint32_t String::hash(const char* str, size_t len)
+{
+    // FNV-1a hash
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+
+    // Zero denotes hash codes not yet computed
+    return hash? hash:1;
+}
+
+String String::intern(const char* str, size_t len)
+{
+    auto hash = String::hash(str, len);
+
+    auto strPtr = findInterned(str, len, hash);
+    if (strPtr)
+        return Value(strPtr, TAG_STRING);
+
+    auto& table = vm.internTable;
+
+    // Keep the table at most half full
+    if (2 * (vm.numInterned + 1) > table.size())
+    {
+        std::vector<VM::InternEntry> newTable(2 * table.size());
+
+        for (auto& entry : table)
+        {
+            if (!entry.str)
+                continue;
+
+            auto i = entry.hash & (newTable.size() - 1);
+            while (newTable[i].str)
+                i = (i + 1) & (newTable.size() - 1);
+            newTable[i] = entry;
+        }
+
+        table.swap(newTable);
+    }
+
+    // Interned strings are allocated in the old space, so they
+    // never move and can be compared by address
+    size_t numBytes = memSize(len);
+    strPtr = vm.allocOld(numBytes, TAG_STRING);
+    *(uint32_t*)(strPtr + OF_LEN) = len;
+    *(uint32_t*)(strPtr + OF_HASH) = hash;
+    memcpy(strPtr + OF_DATA, str, len);
+    setHeaderBits(strPtr, HEADER_MSK_INTERNED);
+
+    auto i = hash & (table.size() - 1);
+    while (table[i].str)
+        i = (i + 1) & (table.size() - 1);
+    table[i] = { strPtr, hash };
+    vm.numInterned++;
+
+    return Value(strPtr, TAG_STRING);
+}
+
+String String::intern() const
+{
+    if (isInterned())
+        return *this;
+
+    return intern(getDataPtr(), length());
+}
+
+refptr String::findInterned(const char* str, size_t len, uint32_t hash)
 {
-    auto ptr = (refptr)val;
-    assert (ptr != nullptr);
-    auto strdata = (char*)(ptr + OF_DATA);
-    return strdata;
+    auto& table = vm.internTable;
+    auto mask = table.size() - 1;
+
+    for (auto i = hash & mask;; i = (i + 1) & mask)
+    {
+        auto& entry = table[i];
+
+        if (!entry.str)
+            return nullptr;
+
+        if (entry.hash != hash)
+            continue;
+
+        auto entryLen = *(uint32_t*)(entry.str + OF_LEN);
+        if (entryLen == len && memcmp(entry.str + OF_DATA, str, len) == 0)
+            return entry.str;
+    }
 }
 
 /// Casting operator to extract a string value
 String::operator std::string ()
 {
-    auto len = length();
-
-    std::string str;
-    str.reserve(len);
-
-    for (size_t i = 0; i < len; ++i)
-        str += (*this)[i];
-
-    return str;
+    return std::string(getDataPtr(), length());
 }
 
 bool String::operator == (const char* that) const
 {
-    return strcmp(getDataPtr(), that) == 0;
+    auto len = strlen(that);
+    return length() == len && memcmp(getDataPtr(), that, len) == 0;
+}
+
+bool String::operator == (String that) const
+{
+    if ((refptr)val == (refptr)that.val)
+        return true;
+
+    if (isInterned() && that.isInterned())
+        return false;
+
+    auto len = length();
+    return (
+        len == that.length() &&
+        memcmp(getDataPtr(), that.getDataPtr(), len) == 0
+    );
 }
 
 /// Get the ith character code
@@ -219,17 +912,118 @@ String String::concat(String a, String b)
 {
     auto lenA = a.length();
     auto lenB = b.length();
+    auto len = (size_t)lenA + lenB;
 
-    std::string c;
-    c.resize(lenA + lenB);
+    if (len > UINT32_MAX)
+    {
+        throw RunError("string concatenation result is too long");
+    }
 
-    for (size_t i = 0; i < lenA; ++i)
-        c[i] = a[i];
+    if (len < MIN_ROPE_LEN)
+    {
+        auto val = vm.alloc(memSize(len), TAG_STRING);
+        auto ptr = (refptr)val;
+        *(uint32_t*)(ptr + OF_LEN) = len;
+        memcpy(ptr + OF_DATA, a.getDataPtr(), lenA);
+        memcpy(ptr + OF_DATA + lenA, b.getDataPtr(), lenB);
+        return val;
+    }
 
-    for (size_t i = 0; i < lenB; ++i)
-        c[lenA + i] = b[i];
+    // Create a rope node, which gets flattened on first access
+    auto val = vm.alloc(INDIRECT_SIZE, TAG_STRING);
+    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= HEADER_MSK_INDIRECT;
+    *(uint32_t*)(ptr + OF_LEN) = len;
+
+    vm.writeBarrier(ptr, a);
+    *(refptr*)(ptr + OF_LEFT) = (refptr)a;
+    vm.writeBarrier(ptr, b);
+    *(refptr*)(ptr + OF_RIGHT) = (refptr)b;
+
+    return val;
+}
+
+int String::compare(String a, String b)
+{
+    auto lenA = a.length();
+    auto lenB = b.length();
+
+    // memcmp is vectorized by the C library
+    auto cmp = memcmp(a.getDataPtr(), b.getDataPtr(), std::min(lenA, lenB));
+    if (cmp != 0)
+        return cmp;
+
+    return (lenA < lenB)? -1:(lenA > lenB)? 1:0;
+}
+
+int64_t String::find(String sub, size_t startIdx)
+{
+    auto len = length();
+    auto subLen = sub.length();
+
+    if (startIdx > len || subLen > len - startIdx)
+        return -1;
+
+    if (subLen == 0)
+        return startIdx;
+
+    auto data = getDataPtr();
+    auto subData = sub.getDataPtr();
+    auto end = data + len - subLen + 1;
+
+    // Scan for the first character of the substring with memchr,
+    // which is vectorized by the C library, and check candidates
+    for (auto ptr = data + startIdx; ptr < end; ++ptr)
+    {
+        ptr = (const char*)memchr(ptr, subData[0], end - ptr);
+        if (!ptr)
+            break;
+
+        if (memcmp(ptr + 1, subData + 1, subLen - 1) == 0)
+            return ptr - data;
+    }
+
+    return -1;
+}
+
+String String::slice(String str, size_t start, size_t end)
+{
+    assert (start <= end && end <= str.length());
+    auto len = end - start;
+
+    if (len == str.length())
+        return str;
+
+    // Ropes get flattened, so that slices reference flat strings
+    auto data = str.getDataPtr();
+
+    if (len < MIN_SLICE_LEN)
+    {
+        auto val = vm.alloc(memSize(len), TAG_STRING);
+        auto ptr = (refptr)val;
+        *(uint32_t*)(ptr + OF_LEN) = len;
+        memcpy(ptr + OF_DATA, data + start, len);
+        return val;
+    }
+
+    // Slices of slices reference the same flat string
+    auto base = (refptr)str.val;
+    if (loadHeader(base) & HEADER_MSK_INDIRECT)
+    {
+        start += *(uint32_t*)(base + OF_START);
+        base = *(refptr*)(base + OF_LEFT);
+    }
+
+    auto val = vm.alloc(INDIRECT_SIZE, TAG_STRING);
+    auto ptr = (refptr)val;
+    *(uint64_t*)ptr |= HEADER_MSK_INDIRECT;
+    *(uint32_t*)(ptr + OF_LEN) = len;
+    *(uint32_t*)(ptr + OF_START) = start;
+
+    vm.writeBarrier(ptr, Value(base, TAG_STRING));
+    *(refptr*)(ptr + OF_LEFT) = base;
 
-    return String(c);
+    return val;
 }
 
 /// Allocate a new array of a given length
@@ -275,13 +1069,14 @@ uint32_t Array::length()
 void Array::setElem(size_t i, Value v)
 {
     auto ptr = getObjPtr();
-    auto cap = length();
+    auto cap = getCap();
 
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
     assert (length() <= getCap());
     assert (i < length());
+    vm.writeBarrier(ptr, v);
     words[i] = v.getWord();
     tags[i] = v.getTag();
 }
@@ -336,6 +1131,7 @@ void Array::push(Value val)
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
+    vm.writeBarrier(ptr, val);
     words[len] = val.getWord();
     tags[len] = val.getTag();
 
@@ -361,6 +1157,114 @@ Array Array::concat(Array a, Array b)
 }
 */
 
+Shape::Shape(Shape* parent, refptr fieldName)
+: parent(parent)
+{
+    if (!parent)
+    {
+        numFields = 0;
+        table = new FieldTable();
+        return;
+    }
+
+    numFields = parent->numFields + 1;
+
+    // If the parent is the last shape of its table, the table can be
+    // extended and shared, otherwise the parent fields are copied
+    if (parent->table->names.size() == parent->numFields)
+    {
+        table = parent->table;
+    }
+    else
+    {
+        table = new FieldTable();
+        for (uint32_t i = 0; i < parent->numFields; ++i)
+        {
+            auto& name = parent->table->names[i];
+            table->slotIdxs[name] = i;
+            table->names.push_back(name);
+        }
+    }
+
+    assert (table->slotIdxs.find(fieldName) == table->slotIdxs.end());
+    table->slotIdxs[fieldName] = numFields - 1;
+    table->names.push_back(fieldName);
+}
+
+Shape* Shape::empty()
+{
+    static Shape* emptyShape = new Shape(nullptr, nullptr);
+    return emptyShape;
+}
+
+Shape* Shape::dict()
+{
+    static Shape* dictShape = new Shape(nullptr, nullptr);
+    return dictShape;
+}
+
+Shape* Shape::addField(String fieldName)
+{
+    assert (this != dict());
+    assert (fieldName.isInterned());
+    assert (getSlotIdx(fieldName) == NOT_FOUND);
+
+    auto namePtr = (refptr)fieldName;
+
+    auto itr = transitions.find(namePtr);
+    if (itr != transitions.end())
+        return itr->second;
+
+    auto shape = new Shape(this, namePtr);
+    transitions[namePtr] = shape;
+    return shape;
+}
+
+uint32_t Shape::findSlotIdx(refptr fieldName) const
+{
+    auto itr = table->slotIdxs.find(fieldName);
+
+    // Fields past the ones of this shape belong to descendants
+    if (itr == table->slotIdxs.end() || itr->second >= numFields)
+        return NOT_FOUND;
+
+    return itr->second;
+}
+
+uint32_t Shape::getSlotIdx(String fieldName) const
+{
+    if (fieldName.isInterned())
+        return findSlotIdx((refptr)fieldName);
+
+    auto namePtr = String::findInterned(
+        fieldName.getDataPtr(),
+        fieldName.length(),
+        fieldName.hash()
+    );
+
+    if (!namePtr)
+        return NOT_FOUND;
+
+    return findSlotIdx(namePtr);
+}
+
+uint32_t Shape::getSlotIdx(const char* fieldName, size_t len) const
+{
+    // Names which were never interned can't be field names
+    auto hash = String::hash(fieldName, len);
+    auto namePtr = String::findInterned(fieldName, len, hash);
+    if (!namePtr)
+        return NOT_FOUND;
+
+    return findSlotIdx(namePtr);
+}
+
+String Shape::getFieldName(uint32_t slotIdx) const
+{
+    assert (slotIdx < numFields);
+    return Value(table->names[slotIdx], TAG_STRING);
+}
+
 /// Allocate a new empty object
 Object Object::newObject(size_t cap)
 {
@@ -374,10 +1278,9 @@ Object Object::newObject(size_t cap)
     auto val = vm.alloc(numBytes, TAG_OBJECT);
     auto ptr = (refptr)val;
 
-    // Set the object capacity
+    // Set the object capacity and shape
     *(uint32_t*)(ptr + OF_CAP) = cap;
-
-    // TODO: init object shape, when shapes actually implemented!
+    *(Shape**)(ptr + OF_SHAPE) = Shape::empty();
 
     // No field initialization necessary
 
@@ -399,136 +1302,332 @@ size_t Object::getCap()
     return cap;
 }
 
-size_t Object::getSlotIdx(
+Value Object::getSlot(refptr ptr, size_t idx)
+{
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+
+    assert (idx < cap);
+    return Value(words[idx], tags[idx]);
+}
+
+void Object::setSlot(refptr ptr, size_t idx, Value val)
+{
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto words = (Word*)(ptr + OF_FIELDS);
+    auto tags  = (Tag*) (ptr + OF_FIELDS + cap * sizeof(Word));
+
+    assert (idx < cap);
+    vm.writeBarrier(ptr, val);
+    words[idx] = val.getWord();
+    tags[idx] = val.getTag();
+}
+
+Shape* Object::getShape()
+{
+    auto ptr = getObjPtr();
+    return *(Shape**)(ptr + OF_SHAPE);
+}
+
+bool Object::isDict(refptr ptr)
+{
+    return *(Shape**)(ptr + OF_SHAPE) == Shape::dict();
+}
+
+refptr Object::newDict(size_t cap)
+{
+    // The capacity is a power of two, so that hash codes can be
+    // masked into bucket indices
+    size_t dictCap = MIN_CAP;
+    while (dictCap < cap)
+        dictCap *= 2;
+
+    auto val = vm.alloc(dictMemSize(dictCap), TAG_OBJECT);
+    auto ptr = (refptr)val;
+
+    *(uint32_t*)(ptr + OF_CAP) = dictCap;
+    *(uint32_t*)(ptr + OF_DICT_LEN) = 0;
+    *(Shape**)(ptr + OF_SHAPE) = Shape::dict();
+
+    return ptr;
+}
+
+uint32_t Object::dictFind(
     refptr ptr,
-    size_t cap,
-    String fieldName,
-    bool newField
+    const char* name,
+    size_t len,
+    uint32_t hash
 )
 {
-    auto values = (Value*)(ptr + OF_FIELDS);
+    assert (isDict(ptr));
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto buckets = (uint64_t*)(ptr + memSize(cap));
 
-    // FIXME: for now, we use a dumb key-pair linear search strategy
-    size_t idx = 0;
-    for (; idx < cap; idx += 2)
+    // The table is at most half full, so probing ends on an empty bucket
+    for (size_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1))
     {
-        // Empty slot, property name not found
-        if (values[idx] == Value::UNDEF)
-            return newField? idx:cap;
+        auto bucket = buckets[i];
+
+        if (bucket == 0)
+            return Shape::NOT_FOUND;
 
-        assert (values[idx].isString());
+        if ((bucket >> 32) != hash)
+            continue;
 
-        // Slot found
-        if ((String)values[idx] == fieldName)
+        auto idx = (uint32_t)bucket - 1;
+        String key = getSlot(ptr, 2 * idx);
+        auto keyData = key.getDataPtr();
+
+        if (keyData == name)
             return idx;
-    }
 
-    return cap;
+        if (key.length() == len && memcmp(keyData, name, len) == 0)
+            return idx;
+    }
 }
 
-bool Object::hasField(String fieldName)
+void Object::dictAdd(refptr ptr, String name, uint32_t hash, Value val)
 {
-    auto ptr = getObjPtr();
-    auto cap = getCap();
+    assert (isDict(ptr));
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto len = *(uint32_t*)(ptr + OF_DICT_LEN);
+    auto buckets = (uint64_t*)(ptr + memSize(cap));
+    assert (2 * (len + 1) <= cap);
+
+    setSlot(ptr, 2 * len, name);
+    setSlot(ptr, 2 * len + 1, val);
 
-    auto slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+    auto i = hash & (cap - 1);
+    while (buckets[i] != 0)
+        i = (i + 1) & (cap - 1);
 
-    return (slotIdx < cap);
+    buckets[i] = ((uint64_t)hash << 32) | (len + 1);
+    *(uint32_t*)(ptr + OF_DICT_LEN) = len + 1;
 }
 
-void Object::setField(String name, Value value)
+refptr Object::moveToDict(size_t numFields)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto newPtr = newDict(2 * numFields);
 
-    auto slotIdx = getSlotIdx(ptr, cap, name, true);
+    if (isDict(ptr))
+    {
+        auto len = *(uint32_t*)(ptr + OF_DICT_LEN);
 
-    // If we've exceeded the object capacity
-    if (slotIdx >= cap)
+        for (size_t i = 0; i < len; ++i)
+        {
+            String name = getSlot(ptr, 2 * i);
+            dictAdd(newPtr, name, name.hash(), getSlot(ptr, 2 * i + 1));
+        }
+    }
+    else
     {
-        // Create a new object with twice the capacity
-        assert (cap > 0);
-        auto newCap = 2 * cap;
-        std::cerr << "extending object capacity from " << cap << " to " << newCap << std::endl;
-        auto newObj = Object::newObject(newCap);
+        auto shape = *(Shape**)(ptr + OF_SHAPE);
 
-        // Copy properties to the new object
-        for (auto itr = ObjFieldItr(*this); itr.valid(); itr.next())
+        for (size_t i = 0; i < shape->getNumFields(); ++i)
         {
-            auto fieldName = itr.get();
-            auto fieldVal = getField(fieldName);
-            newObj.setField(fieldName, fieldVal);
+            auto name = shape->getFieldName(i);
+            dictAdd(newPtr, name, name.hash(), getSlot(ptr, i));
         }
+    }
 
-        // Set the next pointer on this object
-        auto newObjPtr = newObj.getObjPtr();
-        auto rootObjPtr = (refptr)val;
-        setNextPtr(rootObjPtr, newObjPtr);
-        assert (getObjPtr() != ptr);
+    // Set the next pointer on this object
+    setNextPtr((refptr)val, newPtr);
+    assert (getObjPtr() == newPtr);
 
-        ptr = getObjPtr();
-        cap = getCap();
-    }
+    return newPtr;
+}
 
-    // Write the new property
-    assert (slotIdx + 1 < cap);
-    auto values = (Value*)(ptr + OF_FIELDS);
-    values[slotIdx + 0] = name;
-    values[slotIdx + 1] = value;
+bool Object::addSlot(Shape* newShape, Value val)
+{
+    auto ptr = getObjPtr();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto slotIdx = newShape->getNumFields() - 1;
+    assert (!isDict(ptr));
+
+    if (slotIdx >= cap)
+        return false;
+
+    assert (getShape()->getNumFields() == slotIdx);
+    *(Shape**)(ptr + OF_SHAPE) = newShape;
+    setSlot(ptr, slotIdx, val);
+
+    return true;
 }
 
-Value Object::getField(String name)
+bool Object::hasField(String fieldName)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, name, false);
+    if (isDict(ptr))
+    {
+        auto idx = dictFind(
+            ptr,
+            fieldName.getDataPtr(),
+            fieldName.length(),
+            fieldName.hash()
+        );
+
+        return idx != Shape::NOT_FOUND;
+    }
 
-    assert (slotIdx < cap);
-    return values[slotIdx + 1];
+    auto shape = getShape();
+    return shape->getSlotIdx(fieldName) != Shape::NOT_FOUND;
 }
 
-bool Object::getField(const char* name, Value& value, size_t& idxCache)
+void Object::setField(String name, Value value)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
 
-    //std::cout << "Lookup" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-    //std::cout << "  idxCache=" << idxCache << std::endl;
+    if (isDict(ptr))
+    {
+        auto hash = name.hash();
+        auto idx = dictFind(ptr, name.getDataPtr(), name.length(), hash);
+
+        if (idx != Shape::NOT_FOUND)
+        {
+            setSlot(ptr, 2 * idx + 1, value);
+            return;
+        }
+
+        // If the dictionary is full, double its capacity
+        auto cap = *(uint32_t*)(ptr + OF_CAP);
+        auto len = *(uint32_t*)(ptr + OF_DICT_LEN);
+        if (2 * (len + 1) > cap)
+            ptr = moveToDict(2 * len);
+
+        dictAdd(ptr, name, hash, value);
+        return;
+    }
+
+    auto shape = getShape();
+    auto slotIdx = shape->getSlotIdx(name);
 
-    assert (idxCache < cap);
-    auto nameSlot = values[idxCache];
-    if (nameSlot.isString())
+    // If this is a new field, transition to a new shape
+    if (slotIdx == Shape::NOT_FOUND)
     {
-        auto nameSlotStr = String(nameSlot);
-        if (strcmp(nameSlotStr.getDataPtr(), name) == 0)
+        // Objects with many fields are likely used as maps, which
+        // would create long chains of shapes, switch to a dictionary
+        auto numFields = shape->getNumFields();
+        if (numFields >= DICT_THRESHOLD)
+        {
+            ptr = moveToDict(2 * (numFields + 1));
+            dictAdd(ptr, name, name.hash(), value);
+            return;
+        }
+
+        shape = shape->addField(name.intern());
+        slotIdx = shape->getNumFields() - 1;
+
+        // If we've exceeded the object capacity
+        auto cap = getCap();
+        if (slotIdx >= cap)
         {
-            //std::cout << "  cache hit" << std::endl;
-            value = values[idxCache + 1];
-            return true;
+            // Create a new object with twice the capacity
+            auto newCap = 2 * cap;
+            auto newObj = Object::newObject(newCap);
+            auto newObjPtr = newObj.getObjPtr();
+
+            // Copy the field slots to the new object
+            for (size_t i = 0; i < slotIdx; ++i)
+                setSlot(newObjPtr, i, getSlot(ptr, i));
+
+            // Set the next pointer on this object
+            auto rootObjPtr = (refptr)val;
+            setNextPtr(rootObjPtr, newObjPtr);
+            assert (getObjPtr() != ptr);
+
+            ptr = newObjPtr;
         }
+
+        *(Shape**)(ptr + OF_SHAPE) = shape;
     }
 
-    //std::cout << "cache miss" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
+    // Write the new property
+    setSlot(ptr, slotIdx, value);
+}
 
+Value Object::getField(String name)
+{
+    Value value;
+    bool found = getField(name, value);
+    assert (found);
+    return value;
+}
 
-    size_t slotIdx = getSlotIdx(ptr, cap, String(name), false);
+bool Object::getField(String name, Value& value)
+{
+    auto ptr = getObjPtr();
 
-    if (slotIdx >= cap)
+    if (isDict(ptr))
     {
+        auto idx = dictFind(
+            ptr,
+            name.getDataPtr(),
+            name.length(),
+            name.hash()
+        );
+
+        if (idx == Shape::NOT_FOUND)
+            return false;
+
+        value = getSlot(ptr, 2 * idx + 1);
+        return true;
+    }
+
+    auto shape = *(Shape**)(ptr + OF_SHAPE);
+
+    auto slotIdx = shape->getSlotIdx(name);
+    if (slotIdx == Shape::NOT_FOUND)
         return false;
+
+    value = getSlot(ptr, slotIdx);
+    return true;
+}
+
+bool Object::getField(
+    String name,
+    Value& value,
+    Shape*& shapeCache,
+    size_t& idxCache
+)
+{
+    auto ptr = getObjPtr();
+    auto shape = *(Shape**)(ptr + OF_SHAPE);
+
+    // Objects of the same shape store the field in the same slot
+    if (shape == shapeCache)
+    {
+        value = getSlot(ptr, idxCache);
+        return true;
     }
 
-    idxCache = slotIdx;
+    // Objects in dictionary mode are not cached
+    if (isDict(ptr))
+    {
+        auto idx = dictFind(
+            ptr,
+            name.getDataPtr(),
+            name.length(),
+            name.hash()
+        );
+
+        if (idx == Shape::NOT_FOUND)
+            return false;
+
+        value = getSlot(ptr, 2 * idx + 1);
+        return true;
+    }
 
-    //std::cout << "  cache miss" << std::endl;
-    //std::cout << "  slotIdx=" << slotIdx << std::endl;
+    auto slotIdx = shape->getSlotIdx(name);
+    if (slotIdx == Shape::NOT_FOUND)
+        return false;
+
+    shapeCache = shape;
+    idxCache = slotIdx;
 
-    value = values[slotIdx + 1];
+    value = getSlot(ptr, slotIdx);
     return true;
 }
 
@@ -539,42 +1638,27 @@ ObjFieldItr::ObjFieldItr(Object obj)
 
 bool ObjFieldItr::valid()
 {
-    //std::cout << "valid" << std::endl;
-
     auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
 
-    return slotIdx < cap && values[slotIdx].isString();
+    if (Object::isDict(ptr))
+        return slotIdx < *(uint32_t*)(ptr + Object::OF_DICT_LEN);
+
+    return slotIdx < obj.getShape()->getNumFields();
 }
 
 std::string ObjFieldItr::get()
 {
     auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    //std::cout << "cap=" << cap << std::endl;
-    //std::cout << "tag=" << (int)values[slotIdx].getTag() << std::endl;
 
-    assert (values[slotIdx].isString());
+    if (Object::isDict(ptr))
+        return String(Object::getSlot(ptr, 2 * slotIdx));
 
-    return values[slotIdx];
+    return obj.getShape()->getFieldName(slotIdx);
 }
 
 void ObjFieldItr::next()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    slotIdx += 2;
-
-    if (slotIdx >= cap)
-        return;
-
-    if (values[slotIdx] == Value::UNDEF)
-        slotIdx = cap;
+    slotIdx++;
 }
 
 ImgRef::ImgRef(String symbol)
@@ -584,6 +1668,7 @@ ImgRef::ImgRef(String symbol)
     auto ptr = (refptr)val;
 
     // Set the string pointer
+    vm.writeBarrier(ptr, symbol);
     *(refptr*)(ptr + OF_SYM) = (refptr)symbol;
 }
 
@@ -593,6 +1678,15 @@ ImgRef::ImgRef(Value val)
     this->val = val;
 }
 
+String ImgRef::getSymbol() const
+{
+    auto ptr = (refptr)val;
+    assert (ptr != nullptr);
+
+    auto strPtr = *(refptr*)(ptr + OF_SYM);
+    return Value(strPtr, TAG_STRING);
+}
+
 std::string ImgRef::getName() const
 {
     auto ptr = (refptr)val;
@@ -631,17 +1725,89 @@ void testRuntime()
 {
     std::cout << "runtime tests" << std::endl;
 
+    // Heap allocation
+    auto allocStart = vm.allocated();
+    auto block0 = (refptr)vm.alloc(9, TAG_STRING);
+    auto block1 = (refptr)vm.alloc(16, TAG_STRING);
+    assert (vm.allocated() == allocStart + 32);
+    assert ((uintptr_t)block0 % sizeof(Word) == 0);
+    assert ((uintptr_t)block1 % sizeof(Word) == 0);
+    assert (block0 != block1);
+    assert (*(uint64_t*)(block1 + HEADER_SIZE) == 0);
+
+    // Pool cell reuse
+    Pool pool;
+    pool.init(3 * sizeof(Word));
+    auto cell0 = pool.alloc();
+    memset(cell0, 0xFF, pool.getCellSize());
+    pool.free(cell0);
+    assert (pool.getNumCells() == 0);
+    auto cell1 = pool.alloc();
+    assert (cell1 == cell0);
+    assert (*(uint64_t*)(cell1 + 2 * sizeof(Word)) == 0);
+    assert (pool.getNumCells() == 1);
+
     // Strings
     auto str = String("foobar");
     assert (str.length() == 6);
     assert ((std::string)str == "foobar");
     assert (str[1] == 'o');
+    assert (*(uint32_t*)((refptr)str + String::OF_HASH) == 0);
+    assert (str.hash() == String::hash("foobar", 6));
+    assert (*(uint32_t*)((refptr)str + String::OF_HASH) == str.hash());
     auto str2 = String("foobar");
     assert (str.length() == 6);
     assert (str2.length() == 6);
     assert (str == str2);
     assert ((std::string)str == (std::string)str2);
 
+    // Rope strings
+    auto rope = String("");
+    for (size_t i = 0; i < 1000; ++i)
+        rope = String::concat(rope, String("ab"));
+    assert (loadHeader((refptr)rope) & HEADER_MSK_INDIRECT);
+    assert (rope.length() == 2000);
+    assert (rope[0] == 'a' && rope[1999] == 'b');
+    assert (String::concat(rope, String("c"))[2000] == 'c');
+    assert (String::concat(String("a"), rope).length() == 2001);
+    assert (rope.hash() == String::hash(rope.getDataPtr(), 2000));
+
+    // Slices
+    auto slice = String::slice(rope, 1, 1999);
+    assert (slice.length() == 1998);
+    assert (slice[0] == 'b' && slice[1997] == 'a');
+    auto slice2 = String::slice(slice, 2, 40);
+    assert ((refptr)slice2 != (refptr)slice);
+    assert (slice2.length() == 38 && slice2[0] == 'b');
+    assert (slice2.getDataPtr() == rope.getDataPtr() + 3);
+    assert (String::slice(slice, 1, 5) == "abab");
+    assert ((std::string)String::slice(String("foobar"), 3, 6) == "bar");
+    assert (String::concat(slice2, String("x"))[38] == 'x');
+
+    // String comparison and search
+    assert (String::compare(String("abc"), String("abd")) < 0);
+    assert (String::compare(String("abc"), String("ab")) > 0);
+    assert (String::compare(String("abc"), String::intern("abc")) == 0);
+    assert (String::compare(String(""), String("a")) < 0);
+    assert (String("foobarbar").find(String("bar"), 0) == 3);
+    assert (String("foobarbar").find(String("bar"), 4) == 6);
+    assert (String("foobarbar").find(String("baz"), 0) == -1);
+    assert (String("foo").find(String(""), 3) == 3);
+    assert (String("foo").find(String("o"), 4) == -1);
+    assert (slice.find(String("ba"), 0) == 0);
+    assert (rope.find(String("ba"), 0) == 1);
+
+    // String interning
+    auto istr = String::intern("foobar");
+    assert (istr.isInterned() && !str.isInterned());
+    assert ((refptr)String::intern("foobar") == (refptr)istr);
+    assert ((refptr)str.intern() == (refptr)istr);
+    assert (!vm.isYoung((refptr)istr));
+    assert (istr == str && str == istr);
+    assert (!(istr == String::intern("foobaz")));
+    assert (String::findInterned("foobaz", 6, String::hash("foobaz", 6)));
+    assert (!String::findInterned("foobax", 6, String::hash("foobax", 6)));
+
     // Arrays
     auto arr = Array(2);
     assert (arr.length() == 0);
@@ -686,7 +1852,99 @@ void testRuntime()
         fieldStr += itr.get();
     assert (fieldStr == "foobar");
 
-
-
-
+    // Shapes
+    auto obj2 = Object::newObject();
+    assert (obj2.getShape() == Shape::empty());
+    obj2.setField("foo", Value::TWO);
+    obj2.setField("bar", Value::ONE);
+    assert (obj2.getShape() == obj.getShape());
+    assert (obj2.getShape()->getSlotIdx("bar") == 1);
+    auto obj3 = Object::newObject();
+    obj3.setField("bar", Value::ONE);
+    obj3.setField("foo", Value::TWO);
+    assert (obj3.getShape() != obj.getShape());
+    assert (obj3.getShape()->getSlotIdx("foo") == 1);
+    obj2.setField("baz", Value::ZERO);
+    assert (!obj.hasField("baz"));
+    assert (obj.getShape()->getSlotIdx("baz") == Shape::NOT_FOUND);
+
+    // Object extension
+    auto obj4 = Object::newObject(1);
+    for (size_t i = 0; i < 2 * Object::MIN_CAP + 1; ++i)
+        obj4.setField("f" + std::to_string(i), Value((int64_t)i));
+    for (size_t i = 0; i < 2 * Object::MIN_CAP + 1; ++i)
+        assert (obj4.getField("f" + std::to_string(i)) == Value((int64_t)i));
+    assert (obj4.getShape()->getNumFields() == 2 * Object::MIN_CAP + 1);
+
+    // Objects with many fields switch to dictionary mode
+    auto obj5 = Object::newObject();
+    for (size_t i = 0; i < 4 * Object::DICT_THRESHOLD; ++i)
+        obj5.setField("f" + std::to_string(i), Value((int64_t)i));
+    assert (obj5.getShape() == Shape::dict());
+    obj5.setField("f7", Value(-7l));
+    assert (obj5.getField("f7") == Value(-7l));
+    assert (obj5.getField("f100") == Value(100l));
+    assert (!obj5.hasField("f1000"));
+    size_t numFields = 0;
+    for (auto itr = ObjFieldItr(obj5); itr.valid(); itr.next())
+        assert (itr.get() == "f" + std::to_string(numFields++));
+    assert (numFields == 4 * Object::DICT_THRESHOLD);
+
+    // Garbage collection
+    Value liveArr = Array(1);
+    GCRoot arrRoot(liveArr);
+    Array(liveArr).push(String("live"));
+    for (size_t i = 0; i < 100; ++i)
+        Array(liveArr).push(Object::newObject());
+    for (size_t i = 0; i < 1000; ++i)
+        Object::newObject();
+    auto internPtr = (refptr)String::intern("interned_live");
+    auto numCollections = vm.getNumCollections();
+    auto allocBefore = vm.allocated();
+    vm.collect();
+    assert (vm.getNumCollections() == numCollections + 1);
+    assert (vm.allocated() < allocBefore);
+
+    // Promoted objects of the default capacity are pool-allocated
+    auto& objPool = vm.getPool(Object::memSize(Object::MIN_CAP));
+    assert (objPool.getNumCells() >= 100);
+    assert (Array(liveArr).length() == 101);
+    assert ((std::string)Array(liveArr).getElem(0) == "live");
+    assert (Array(liveArr).getElem(100).isObject());
+
+    // Interned strings are kept alive and never move
+    assert ((refptr)String::intern("interned_live") == internPtr);
+    assert (String(Value(internPtr, TAG_STRING)) == "interned_live");
+
+    // Mark bits are cleared once the collection is complete
+    assert (!vm.isMarking());
+    auto liveHeader = loadHeader((refptr)liveArr);
+    assert (!(liveHeader & (HEADER_MSK_MARK | HEADER_MSK_SCANNED)));
+
+    // Nursery collection with pointers from old to young objects
+    assert (!vm.isYoung((refptr)liveArr));
+    auto numMinor = vm.getNumMinorCollections();
+    Array(liveArr).setElem(1, String("young"));
+    Array(liveArr).push(String("pushed"));
+    vm.collect(false);
+    assert (vm.getNumMinorCollections() == numMinor + 1);
+    assert ((std::string)Array(liveArr).getElem(1) == "young");
+    assert ((std::string)Array(liveArr).getElem(101) == "pushed");
+
+    // Rope nodes keep the strings they concatenate alive
+    auto rope2 = String::concat(String(std::string(40, 'x')), String("young"));
+    Array(liveArr).push(String::concat(rope2, String(std::string(40, 'y'))));
+    vm.collect(false);
+    vm.collect();
+    String liveRope = Array(liveArr).getElem(102);
+    assert (liveRope.length() == 85);
+    assert ((std::string)liveRope == std::string(40, 'x') + "young" + std::string(40, 'y'));
+
+    // Slices keep the string they reference alive
+    Array(liveArr).push(String::slice(liveRope, 35, 85));
+    vm.collect(false);
+    vm.collect();
+    String liveSlice = Array(liveArr).getElem(103);
+    assert ((std::string)liveSlice == "xxxxxyoung" + std::string(40, 'y'));
+    assert (!vm.isYoung(Array(liveArr).getElem(101).getWord().ptr));
 }
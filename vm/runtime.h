@@ -1,7 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 /// Type tag, 8 bits
 typedef uint8_t Tag;
@@ -29,9 +34,65 @@ const size_t HEADER_SIZE = sizeof(intptr_t);
 const size_t HEADER_IDX_NEXT = 15;
 const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
 
+/// Bit flag set on objects found live by the garbage collector
+const size_t HEADER_IDX_MARK = 14;
+const size_t HEADER_MSK_MARK = 1 << HEADER_IDX_MARK;
+
+/// Bit flag set on old objects recorded in the remembered set
+const size_t HEADER_IDX_REMEMBERED = 13;
+const size_t HEADER_MSK_REMEMBERED = 1 << HEADER_IDX_REMEMBERED;
+
+/// Bit flag set on nursery objects which have been promoted, the
+/// forwarding pointer is then stored in place of the next pointer
+const size_t HEADER_IDX_FWD = 12;
+const size_t HEADER_MSK_FWD = 1 << HEADER_IDX_FWD;
+
+/// Bit flag set on old objects whose fields have been scanned while
+/// marking, or which were allocated while marking
+const size_t HEADER_IDX_SCANNED = 11;
+const size_t HEADER_MSK_SCANNED = 1 << HEADER_IDX_SCANNED;
+
+/// Bit flag held by the thread currently scanning an object
+const size_t HEADER_IDX_BUSY = 10;
+const size_t HEADER_MSK_BUSY = 1 << HEADER_IDX_BUSY;
+
+/// Bit flag set on strings which are in the intern table
+const size_t HEADER_IDX_INTERNED = 9;
+const size_t HEADER_MSK_INTERNED = 1 << HEADER_IDX_INTERNED;
+
+/// Bit flag set on strings which do not hold their characters,
+/// namely rope nodes and slices
+const size_t HEADER_IDX_INDIRECT = 8;
+const size_t HEADER_MSK_INDIRECT = 1 << HEADER_IDX_INDIRECT;
+
+/// Header bits available for the VM to cache data about an object
+const size_t HEADER_IDX_AUX = 16;
+const uint64_t HEADER_MSK_AUX = 0xFFFFull << HEADER_IDX_AUX;
+
+/// Offset of the allocation size, in bytes, in the object header
+const size_t HEADER_OF_SIZE = sizeof(uint32_t);
+
 /// Offset of the next pointer
 const size_t OBJ_OF_NEXT = HEADER_SIZE;
 
+/// Load an object header, which marker threads may update concurrently
+inline uint64_t loadHeader(refptr obj)
+{
+    return __atomic_load_n((uint64_t*)obj, __ATOMIC_ACQUIRE);
+}
+
+/// Atomically set bits in an object header, returns the previous header
+inline uint64_t setHeaderBits(refptr obj, uint64_t mask)
+{
+    return __atomic_fetch_or((uint64_t*)obj, mask, __ATOMIC_ACQ_REL);
+}
+
+/// Atomically clear bits in an object header, returns the previous header
+inline uint64_t clearHeaderBits(refptr obj, uint64_t mask)
+{
+    return __atomic_fetch_and((uint64_t*)obj, ~mask, __ATOMIC_ACQ_REL);
+}
+
 /**
 64-bit word union
 */
@@ -69,7 +130,7 @@ public:
     Value() : Value(FALSE.word, FALSE.tag) {}
     Value(int64_t v) : Value(Word(v), TAG_INT64) {}
     Value(refptr p, Tag t) : Value(Word(p), t) {}
-    Value(Word w, Tag t);
+    Value(Word w, Tag t) : word(w), tag(t) {}
     ~Value() {}
 
     bool isBool() const { return tag == TAG_BOOL; }
@@ -86,8 +147,18 @@ public:
 
     std::string toString() const;
 
-    operator bool () const;
-    operator int64_t () const;
+    operator bool () const
+    {
+        assert (tag == TAG_BOOL);
+        return word.int64? 1:0;
+    }
+
+    operator int64_t () const
+    {
+        assert (tag == TAG_INT64);
+        return word.int64;
+    }
+
     operator refptr () const;
     operator std::string () const;
 
@@ -102,29 +173,443 @@ public:
     }
 };
 
+/**
+Pool of fixed-size memory cells for one size class of small objects.
+Cells are bump-allocated out of contiguous chunks, and cells placed
+back on the free list are reused before the pool grows.
+Free cells have a zero header word, the free list is threaded through
+their second word.
+
+After marking, chunks are swept lazily: the free list is rebuilt one
+chunk at a time, when the pool runs out of free cells.
+*/
+class Pool
+{
+private:
+
+    /// Size of the memory chunks the pool grows by
+    static const size_t CHUNK_SIZE = 1 << 16;
+
+    /// Size of the cells in this pool, in bytes
+    size_t cellSize = 0;
+
+    /// Size of the chunks of this pool (a multiple of the cell size)
+    size_t chunkSize = 0;
+
+    /// Chunk currently being bump-allocated from
+    uint8_t* curChunk = nullptr;
+
+    /// Current allocation pointer in the current chunk
+    uint8_t* allocPtr = nullptr;
+
+    /// Limit pointer for the current chunk
+    uint8_t* allocLimit = nullptr;
+
+    /// Linked list of free cells
+    uint8_t* freeList = nullptr;
+
+    /// Number of cells currently allocated in this pool
+    size_t numCells = 0;
+
+    /// List of memory chunks owned by this pool
+    std::vector<uint8_t*> chunks;
+
+    /// Index of the next chunk to sweep, and one past the last one
+    size_t sweepIdx = 0;
+    size_t sweepEnd = 0;
+
+    /// Take a cell off the free list
+    refptr popFree()
+    {
+        // Reused cells must be zeroed out
+        auto ptr = freeList;
+        freeList = *(uint8_t**)(ptr + sizeof(uint8_t*));
+        memset(ptr, 0, cellSize);
+        return ptr;
+    }
+
+    /// Sweep the chunk at a given index
+    void sweepChunk(size_t idx);
+
+    /// Allocate a cell when there are no free cells left to reuse
+    refptr allocSlow();
+
+public:
+
+    void init(size_t cellSize);
+
+    /// Allocate a zeroed out cell from the pool
+    refptr alloc()
+    {
+        refptr ptr;
+
+        if (freeList)
+        {
+            ptr = popFree();
+        }
+        else if (cellSize <= (size_t)(allocLimit - allocPtr))
+        {
+            // Bump the allocation pointer, chunk memory is pre-zeroed
+            ptr = allocPtr;
+            allocPtr += cellSize;
+        }
+        else
+        {
+            ptr = allocSlow();
+        }
+
+        numCells++;
+        return ptr;
+    }
+
+    /// Return a cell to the pool so it can be reused
+    void free(refptr ptr)
+    {
+        assert (numCells > 0);
+        *(uint64_t*)ptr = 0;
+        *(uint8_t**)(ptr + sizeof(uint8_t*)) = freeList;
+        freeList = ptr;
+        numCells--;
+    }
+
+    /// Start sweeping the chunks after marking. Cells which were not
+    /// marked get freed and the mark bits of the others are cleared.
+    void startSweep();
+
+    /// Sweep up to a given number of the chunks left to sweep,
+    /// decrementing the count. Returns true once all are swept.
+    bool sweep(size_t& maxChunks);
+
+    size_t getCellSize() const { return cellSize; }
+    size_t getNumCells() const { return numCells; }
+};
+
+/**
+Scoped garbage collection root for a value held in a host variable
+across code that may trigger a collection
+*/
+class GCRoot
+{
+    friend class VM;
+
+    /// Host variable holding the value
+    Value& val;
+
+    /// Previously registered root
+    GCRoot* prev;
+
+public:
+
+    GCRoot(Value& val);
+    ~GCRoot();
+};
+
+/// Function enumerating the roots held by a VM component
+typedef void (*RootFn)();
+
+class Wrapper;
+class Marker;
+
 /**
 Virtual Machine object (singleton)
+
+Small objects are allocated in a nursery, and the survivors of a
+nursery collection are promoted by copying them into the old space.
+The old space is made of size class pools and individually allocated
+large objects, and is collected by mark-sweep.
+
+The old space is marked concurrently with execution, by background
+marker threads, and swept lazily. The interpreter only pauses at
+safepoints for nursery collections, for the greying of the roots when
+marking starts, and for small increments of sweeping.
 */
 class VM
 {
+    friend class GCRoot;
+    friend class String;
+
 private:
 
-    // TODO: total memory size allocated
+    /// Number of size classes with a dedicated pool
+    static const size_t NUM_POOLS = 23;
+
+    /// Largest object size served by the pools, in words
+    static const size_t MAX_POOL_WORDS = 64;
+
+    /// Size of the nursery in bytes
+    static const size_t NURSERY_SIZE = 4 << 20;
+
+    /// Largest object size allocated in the nursery, in bytes
+    static const size_t MAX_NURSERY_OBJ = MAX_POOL_WORDS * sizeof(Word);
+
+    /// Minimum old space size at which a full collection is triggered
+    static const size_t MIN_GC_THRESHOLD = 32 << 20;
+
+    /// Number of pool chunks swept at each safepoint while sweeping
+    static const size_t SWEEP_STEP_CHUNKS = 4;
+
+    /// Number of grey objects buffered before handing them over
+    /// to the marker threads
+    static const size_t GREY_BUFFER_SIZE = 1024;
+
+    /// Size class index for each object size in words
+    static const uint8_t sizeClasses[MAX_POOL_WORDS + 1];
+
+    /// Nursery memory region
+    uint8_t* nurseryStart = nullptr;
+
+    /// Current allocation pointer in the nursery
+    uint8_t* nurseryPtr = nullptr;
+
+    /// Limit pointer for the nursery
+    uint8_t* nurseryLimit = nullptr;
+
+    /// Pools for small objects, one per size class
+    Pool pools[NUM_POOLS];
+
+    /// Large objects, each individually allocated
+    std::vector<refptr> largeObjs;
+
+    /// Total number of bytes currently allocated in the old space
+    size_t bytesAllocated = 0;
+
+    /// Old space size at which the next full collection is triggered
+    size_t gcThreshold = MIN_GC_THRESHOLD;
+
+    /// Flag set when there is collection work to do at the next
+    /// safepoint, which the marker threads may also set
+    std::atomic<bool> gcRequested;
+
+    /// Flag set when the nursery is full and must be collected
+    bool nurseryFull = false;
+
+    /// Flag set while a nursery collection is in progress
+    bool inMinorGC = false;
+
+    /// Flag set while the old space is being marked
+    bool marking = false;
+
+    /// Flag set while pools remain to be swept, and index of the
+    /// next pool to sweep
+    bool sweeping = false;
+    size_t sweepPoolIdx = 0;
+
+    /// Concurrent marker, created when marking first starts
+    Marker* marker = nullptr;
+
+    /// Objects greyed by the mutator, not yet handed to the marker
+    std::vector<refptr> greyObjs;
+
+    /// Number of full and nursery collections performed so far
+    size_t numCollections = 0;
+    size_t numMinorCollections = 0;
+
+    /// Interned string table entry
+    struct InternEntry
+    {
+        refptr str;
+        uint32_t hash;
+    };
+
+    /// Initial size of the intern table
+    static const size_t INTERN_TABLE_INIT_SIZE = 1024;
+
+    /// Interned strings, in a hash table with linear probing. Interned
+    /// strings are allocated in the old space so they never move, and
+    /// the table holds strong references to them.
+    std::vector<InternEntry> internTable;
+    size_t numInterned = 0;
+
+    /// Root enumeration functions registered by VM components
+    std::vector<RootFn> rootFns;
+
+    /// Most recently registered scoped host root
+    GCRoot* hostRoots = nullptr;
+
+    /// Old objects which may contain pointers into the nursery
+    std::vector<refptr> rememberedSet;
+
+    /// Stack of promoted objects whose fields remain to be traced
+    std::vector<refptr> markStack;
+
+    /// Allocate memory in the old space, rounding up the size, and
+    /// initialize the object header
+    refptr allocOld(size_t& size, Tag tag);
+
+    /// Allocate a block when the nursery fast path fails
+    refptr allocSlow(size_t& size, Tag tag);
+
+    /// Allocate a large object outside of the pools
+    refptr allocLarge(size_t size);
+
+    /// Record an old object written with a pointer into the nursery
+    void remember(refptr obj);
+
+    /// Visit a pointer to a heap object, returning its new address
+    refptr visitPtr(refptr ptr);
+
+    /// Copy a nursery object into the old space and queue it for tracing
+    refptr promote(refptr ptr);
+
+    /// Visit the objects referenced by the fields of an object
+    void traceObj(refptr ptr);
+
+    /// Visit the registered roots
+    void visitRoots();
+
+    /// Collect the nursery, promoting all surviving objects
+    void collectNursery();
 
-    // TODO: dynamically grow pools?
+    /// Scan an object before it gets written to while marking
+    void scanBeforeWrite(refptr obj);
 
-    // TODO: pools for sizes up to 32 (words)
+    /// Hand the objects greyed by the mutator to the marker threads
+    void flushGreyObjs();
 
-    // TODO: number of elements allocated in each pool
+    /// Start marking the old space, greying the objects referenced
+    /// by the roots
+    void startMarking();
+
+    /// Wait for the marker threads to finish marking
+    void awaitMarking();
+
+    /// Finish marking once all grey objects were scanned, sweeping
+    /// large objects and starting the lazy sweep of the pools
+    void finishMarking();
+
+    /// Sweep up to a given number of pool chunks
+    void sweepStep(size_t maxChunks);
+
+    /// Perform the collection work pending at a safepoint
+    void gcStep();
 
 public:
 
     VM();
+    ~VM();
 
     /// Allocate a block of memory on the heap
-    Value alloc(uint32_t size, Tag tag);
+    /// Note: the memory returned is zeroed out
+    Value alloc(uint32_t size, Tag tag)
+    {
+        // Round the size up to a multiple of the word size
+        size_t numBytes = (size + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+
+        refptr ptr;
+
+        // Fast path: bump the allocation pointer in the nursery
+        if (numBytes <= MAX_NURSERY_OBJ &&
+            numBytes <= (size_t)(nurseryLimit - nurseryPtr))
+        {
+            ptr = nurseryPtr;
+            nurseryPtr += numBytes;
+
+            // Set the tag and allocation size in the object header
+            *(Tag*)ptr = tag;
+            *(uint32_t*)(ptr + HEADER_OF_SIZE) = numBytes;
+        }
+        else
+        {
+            ptr = allocSlow(numBytes, tag);
+        }
+
+        // Wrap the pointer in a tagged value
+        return Value(ptr, tag);
+    }
+
+    /// Test if a heap pointer points into the nursery
+    bool isYoung(refptr ptr) const
+    {
+        return (size_t)(ptr - nurseryStart) < NURSERY_SIZE;
+    }
+
+    /// Write barrier, to be called before a value is stored into
+    /// a field of a heap object
+    void writeBarrier(refptr obj, Value val)
+    {
+        if (isYoung(obj))
+            return;
+
+        // While marking, the references an object held when marking
+        // started must be marked before they can be overwritten
+        if (marking && !(loadHeader(obj) & HEADER_MSK_SCANNED))
+            scanBeforeWrite(obj);
+
+        if (isYoung(val.getWord().ptr) && val.isPointer())
+            remember(obj);
+    }
+
+    /// Get the total number of bytes currently allocated on the heap
+    size_t allocated() const
+    {
+        return bytesAllocated + (nurseryPtr - nurseryStart);
+    }
+
+    /// Get the number of collections performed so far
+    size_t getNumCollections() const { return numCollections; }
+    size_t getNumMinorCollections() const { return numMinorCollections; }
+
+    /// Get the pool serving objects of a given size in bytes
+    const Pool& getPool(size_t size) const
+    {
+        size_t numWords = (size + sizeof(Word) - 1) / sizeof(Word);
+        assert (numWords <= MAX_POOL_WORDS);
+        return pools[sizeClasses[numWords]];
+    }
+
+    /// Register a function enumerating roots held outside of the heap
+    void addRootFn(RootFn fn) { rootFns.push_back(fn); }
+
+    /// Test if the current collection only collects the nursery.
+    /// Root functions may then skip the roots that are known to
+    /// point to old objects only.
+    bool isMinorGC() const { return inMinorGC; }
+
+    /// Visit a root value, called by root enumeration functions
+    /// Note: the value is updated if the object it points to moved
+    void visitRoot(Value& val)
+    {
+        if (!val.isPointer())
+            return;
+
+        auto ptr = val.getWord().ptr;
+        auto newPtr = visitPtr(ptr);
+
+        if (newPtr != ptr)
+            val = Value(newPtr, val.getTag());
+    }
+
+    /// Visit a root pointer to a heap object
+    void visitRoot(refptr& ptr)
+    {
+        assert (ptr != nullptr);
+        ptr = visitPtr(ptr);
+    }
+
+    /// Visit a root held in a heap object wrapper
+    void visitRoot(Wrapper& wrapper);
+
+    /// Test if the old space is currently being marked
+    bool isMarking() const { return marking; }
+
+    /// Request that the collection work be checked at the next safepoint
+    void requestSafepoint() { gcRequested = true; }
 
-    size_t allocated() const;
+    /// Address of the safepoint request flag, which compiled code polls
+    const void* getSafepointFlag() const { return &gcRequested; }
+
+    /// Do the pending collection work, if any.
+    /// This must only be called where every live value is reachable
+    /// from the registered roots.
+    void safepoint()
+    {
+        if (gcRequested.load(std::memory_order_relaxed))
+            gcStep();
+    }
+
+    /// Perform a collection of the nursery. If full is true, also
+    /// mark and sweep the whole old space before returning.
+    void collect(bool full = true);
 };
 
 /**
@@ -167,6 +652,8 @@ Heap object value wrapper base class
 */
 class Wrapper
 {
+    friend class VM;
+
 protected:
 
     /// Internal value holding a heap pointer to the string
@@ -203,15 +690,45 @@ public:
 /**
 Wrapper to manipulate string values
 Note: strings are UTF-8 and null-terminated
+
+Indirect strings hold a left string, a right string and a start
+index in place of character data. Concatenations of long strings
+produce rope nodes, with a left and right string to concatenate.
+Slices have no right string, and reference the characters of the
+flat left string from the start index. A rope is flattened when its
+characters are first accessed, and becomes a slice of its flat copy.
+Note: the characters of slices are not null-terminated.
 */
 class String : public Wrapper
 {
+private:
+
+    /// Flatten a rope node into a slice of a new flat string
+    static void flatten(refptr rope);
+
 public:
 
-    /// Offset and size of the length and data fields
+    /// Offset and size of the length, hash code and data fields
+    /// Note: the hash code is computed lazily, and zero until then
     static const size_t OF_LEN = HEADER_SIZE;
     static const size_t SZ_LEN = sizeof(uint32_t);
-    static const size_t OF_DATA = OF_LEN + SZ_LEN;
+    static const size_t OF_HASH = OF_LEN + SZ_LEN;
+    static const size_t SZ_HASH = sizeof(uint32_t);
+    static const size_t OF_DATA = OF_HASH + SZ_HASH;
+
+    /// Offset of the fields of indirect strings
+    static const size_t OF_LEFT = OF_HASH + SZ_HASH;
+    static const size_t OF_RIGHT = OF_LEFT + sizeof(refptr);
+    static const size_t OF_START = OF_RIGHT + sizeof(refptr);
+    static const size_t INDIRECT_SIZE = OF_START + sizeof(uint32_t);
+
+    /// Minimum length of the concatenations producing rope nodes,
+    /// shorter strings are copied right away
+    static const size_t MIN_ROPE_LEN = 32;
+
+    /// Minimum length of the substrings produced as slices, shorter
+    /// ones are copied, which takes no more memory
+    static const size_t MIN_SLICE_LEN = 24;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t len)
@@ -229,20 +746,76 @@ public:
     /// Warning: this data can get garbage-collected
     const char* getDataPtr() const;
 
+    /// Compute the hash code of raw string data, which is never zero
+    static uint32_t hash(const char* str, size_t len);
+
+    /// Get the hash code of the string, computed on first use
+    uint32_t hash() const
+    {
+        auto ptr = (refptr)val;
+        auto hashCode = *(uint32_t*)(ptr + OF_HASH);
+
+        if (hashCode == 0)
+        {
+            hashCode = hash(getDataPtr(), length());
+            *(uint32_t*)(ptr + OF_HASH) = hashCode;
+        }
+
+        return hashCode;
+    }
+
+    /// Get the unique interned string with the given characters
+    static String intern(const char* str, size_t len);
+    static String intern(const std::string& str) { return intern(str.c_str(), str.length()); }
+
+    /// Get the interned string equal to this string
+    String intern() const;
+
+    /// Find an interned string, returns null if there is none
+    static refptr findInterned(const char* str, size_t len, uint32_t hash);
+
+    /// Test if this is the interned copy of a string
+    bool isInterned() const
+    {
+        return loadHeader((refptr)val) & HEADER_MSK_INTERNED;
+    }
+
     /// Casting operator to extract a string value
     operator std::string ();
 
     /// Comparison with a string literal
     bool operator == (const char* that) const;
 
-    // FIXME: temporary until string internsing is implemented
-    bool operator == (String that) { return (std::string)*this == (std::string)that; }
+    /// Comparison with another string, interned strings are equal
+    /// only if they are the same object
+    bool operator == (String that) const;
 
     /// Get the ith character code
     char operator [] (size_t i);
 
     /// Concatenate two strings
     static String concat(String a, String b);
+
+    /// Get the substring between the start and end indices
+    static String slice(String str, size_t start, size_t end);
+
+    /// Compare two strings lexicographically by byte value, returns
+    /// a negative, zero or positive value as with memcmp
+    static int compare(String a, String b);
+
+    /// Find the index of the first occurrence of a substring at or
+    /// after a given index, or -1 if there is none
+    int64_t find(String sub, size_t startIdx);
+};
+
+/**
+Hash function object for host-side maps keyed by strings
+Note: maps holding strings which are not interned must be
+      registered as roots, since the strings can move
+*/
+struct StringHash
+{
+    size_t operator () (String str) const { return str.hash(); }
 };
 
 /**
@@ -294,8 +867,86 @@ public:
     //static Array concat(Array a, Array b);
 };
 
+/**
+Object shape (hidden class). Shapes form a tree rooted at the empty
+shape, where each shape adds one field to its parent shape. Objects
+which had the same fields added in the same order share a shape, and
+the shape fixes the slot index of each field.
+Objects with too many fields switch to dictionary mode, and all share
+the dictionary shape, which has no fields or transitions.
+Note: shapes are never freed.
+*/
+class Shape
+{
+private:
+
+    /// Field names and slot indices, shared along a chain of shapes.
+    /// A shape only sees the first numFields fields of its table.
+    /// Field names are interned strings, keyed by address.
+    struct FieldTable
+    {
+        std::unordered_map<refptr, uint32_t> slotIdxs;
+        std::vector<refptr> names;
+    };
+
+    /// Parent shape, null for the empty shape
+    Shape* parent;
+
+    /// Number of fields, the last one being added by this shape
+    uint32_t numFields;
+
+    /// Table of the fields of this shape
+    FieldTable* table;
+
+    /// Transitions to the child shapes, by name of the field added
+    std::unordered_map<refptr, Shape*> transitions;
+
+    Shape(Shape* parent, refptr fieldName);
+
+    /// Find the slot index of a field by interned name
+    uint32_t findSlotIdx(refptr fieldName) const;
+
+public:
+
+    /// Slot index returned for missing fields
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    /// Get the empty shape, which new objects have
+    static Shape* empty();
+
+    /// Get the shape of objects in dictionary mode
+    static Shape* dict();
+
+    /// Get the shape resulting from adding a field to this shape
+    /// Note: the field name must be interned
+    Shape* addField(String fieldName);
+
+    /// Find the slot index of a field, or NOT_FOUND
+    /// Note: field names which are not interned are looked up in
+    ///       the intern table, which does not allocate
+    uint32_t getSlotIdx(String fieldName) const;
+    uint32_t getSlotIdx(const char* fieldName, size_t len) const;
+    uint32_t getSlotIdx(const std::string& fieldName) const
+    {
+        return getSlotIdx(fieldName.c_str(), fieldName.length());
+    }
+
+    /// Get the name of the field stored at a given slot index
+    String getFieldName(uint32_t slotIdx) const;
+
+    uint32_t getNumFields() const { return numFields; }
+};
+
 /**
 Object value wrapper
+Objects store their fields as words followed by tags, in the slots
+assigned by their shape.
+
+Objects in dictionary mode store their fields as pairs of name and
+value slots, in insertion order, followed by a hash table of
+bucket words. Each bucket holds the hash code of a field name in its
+upper half and the index of the field plus one in its lower half, or
+zero if it is empty.
 */
 class Object : public Wrapper
 {
@@ -304,49 +955,95 @@ class Object : public Wrapper
     /// Get the object's capacity
     size_t getCap();
 
-    /// Find the slot index at which a field is stored
-    size_t getSlotIdx(
+    /// Read and write a field slot of the object storage
+    static Value getSlot(refptr ptr, size_t idx);
+    static void setSlot(refptr ptr, size_t idx, Value val);
+
+    /// Test if an object is in dictionary mode
+    static bool isDict(refptr ptr);
+
+    /// Allocate an empty object in dictionary mode
+    static refptr newDict(size_t cap);
+
+    /// Find the index of a field in dictionary mode, or Shape::NOT_FOUND
+    static uint32_t dictFind(
         refptr ptr,
-        size_t cap,
-        String fieldName,
-        bool newField
+        const char* name,
+        size_t len,
+        uint32_t hash
     );
 
+    /// Append a field to an object in dictionary mode with free space
+    static void dictAdd(refptr ptr, String name, uint32_t hash, Value val);
+
+    /// Move the fields of this object into a new dictionary with room
+    /// for numFields fields, which this object then points to
+    refptr moveToDict(size_t numFields);
+
 public:
 
     /// Minimum guaranteed object capacity
-    static const size_t MIN_CAP = 16;
+    static const size_t MIN_CAP = 8;
 
     /// Offset and size of the fields
+    /// Note: the shape pointer is kept word-aligned
     static const size_t OF_CAP = HEADER_SIZE;
     static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_SHAPE = OF_CAP + SZ_CAP;
-    static const size_t SZ_SHAPE = sizeof(refptr);
+    static const size_t OF_DICT_LEN = OF_CAP + SZ_CAP;
+    static const size_t SZ_DICT_LEN = sizeof(uint32_t);
+    static const size_t OF_SHAPE = OF_CAP + sizeof(Word);
+    static const size_t SZ_SHAPE = sizeof(Shape*);
     static const size_t OF_FIELDS = OF_SHAPE + SZ_SHAPE;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t cap)
     {
-        // FIXME: for now, we store tagged values, this will change
-        // once we have proper shapes implemented
-        //return OF_FIELDS + cap * sizeof(Word);
-        return OF_FIELDS + cap * sizeof(Value);
+        return OF_FIELDS + cap * sizeof(Word) + cap * sizeof(Tag);
     }
 
+    /// Compute the size of an object in dictionary mode, which has one
+    /// bucket per slot, so the hash table is at most half full
+    static constexpr size_t dictMemSize(size_t cap)
+    {
+        return memSize(cap) + cap * sizeof(uint64_t);
+    }
+
+    /// Number of fields past which objects switch to dictionary mode
+    static const size_t DICT_THRESHOLD = 32;
+
     /// Allocate a new empty object
     static Object newObject(size_t cap = 0);
 
     Object(Value value);
 
+    /// Get the shape of the object
+    Shape* getShape();
+
+    /// Read and write a field by slot index, for inline caches
+    Value getSlot(size_t idx) { return getSlot(getObjPtr(), idx); }
+    void setSlot(size_t idx, Value val) { setSlot(getObjPtr(), idx, val); }
+
+    /// Add a field by transitioning to a child of the current shape.
+    /// Returns false if the object must first be extended.
+    bool addSlot(Shape* newShape, Value val);
+
     bool hasField(String name);
     void setField(String name, Value val);
     Value getField(String name);
 
-    /// Property lookup with a slot index cache
-    bool getField(const char* name, Value& value, size_t& idxCache);
+    /// Property lookup, returns false if the field is missing
+    bool getField(String name, Value& value);
+
+    /// Property lookup with a shape and slot index cache
+    bool getField(
+        String name,
+        Value& value,
+        Shape*& shapeCache,
+        size_t& idxCache
+    );
 
     bool hasField(std::string name) { return hasField(String(name)); }
-    void setField(std::string name, Value val) { return setField(String(name), val); }
+    void setField(std::string name, Value val) { return setField(String::intern(name), val); }
     Value getField(std::string name) { return getField(String(name)); }
 };
 
@@ -388,6 +1085,9 @@ public:
     ImgRef(String symbol);
     ImgRef(Value val);
 
+    /// Get the symbol string
+    String getSymbol() const;
+
     std::string getName() const;
 };
 